@@ -0,0 +1,477 @@
+// Metal Dispersion Analyzer - benchmarks
+// Description: Timing of the hot paths of metal_dispersion.cpp: data loading, permittivity
+// computation, residual evaluation (Drude and Drude–Lorentz), grid search at several thread
+// counts and the fitters' time to convergence. Results are printed as a table and can be
+// exported as JSON in the layout used by Google Benchmark (--json <file>), so the usual
+// comparison tools apply.
+//
+// Build (headless, no Python needed), from the project directory:
+//   g++ -std=c++17 -O2 -pthread bench/metal_dispersion_bench.cpp -o metal_dispersion_bench
+// or with the build script:
+//   tools\build_plot.ps1 -Headless <path_to_project>\bench\metal_dispersion_bench.cpp
+// Run from the project directory so that data/Ag_Palik_400-900nm.txt is found:
+//   metal_dispersion_bench [--filter <substring>] [--min-time <seconds>] [--json <file>]
+// or, to check that mixed_precision fits agree with the all-double ones and that bad input and
+// unwritable output files are reported (exit status 1 if not):
+//   metal_dispersion_bench --check
+
+#define METAL_DISPERSION_HEADLESS
+#define METAL_DISPERSION_NO_MAIN
+#include "../metal_dispersion.cpp"
+
+#include <iomanip>
+#include <random>
+
+namespace bench {
+
+// Keeps the compiler from discarding a computed value.
+template <class T>
+inline void doNotOptimize(const T& value) {
+#if defined(__GNUC__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+struct Measurement {
+    std::string name;
+    size_t iterations = 0;
+    double ns_per_iteration = 0.0;
+    double bytes_per_iteration = 0.0;   // 0 when not meaningful
+    double items_per_iteration = 0.0;   // 0 when not meaningful
+};
+
+struct Options {
+    std::string filter;
+    double min_time = 0.5;   // seconds spent on each benchmark
+    std::string json;
+    bool check = false;   // run the mixed-precision and error-path checks instead of the timings
+};
+
+// Runs 'body' repeatedly (doubling the batch size) until min_time has passed and records the
+// mean time per call. bytes/items describe the work done by one call, for throughput figures.
+class Runner {
+public:
+    explicit Runner(const Options& options) : options_(options) {}
+
+    template <class Body>
+    void run(const std::string& name, Body body, double bytes = 0.0, double items = 0.0) {
+        if (!options_.filter.empty() && name.find(options_.filter) == std::string::npos)
+            return;
+        using clock = std::chrono::steady_clock;
+        body();   // warm-up (page faults, lazy initialization)
+
+        size_t iterations = 0;
+        size_t batch = 1;
+        double elapsed = 0.0;
+        while (elapsed < options_.min_time) {
+            auto t0 = clock::now();
+            for (size_t i = 0; i < batch; ++i)
+                body();
+            elapsed += std::chrono::duration<double>(clock::now() - t0).count();
+            iterations += batch;
+            batch *= 2;
+        }
+
+        Measurement m {name, iterations, 1e9 * elapsed / iterations, bytes, items};
+        print(m);
+        results_.push_back(m);
+    }
+
+    void writeJson() const {
+        if (options_.json.empty())
+            return;
+        std::ofstream out (options_.json);
+        if (!out) {
+            throw std::runtime_error("Error: Could not write " + options_.json);
+        }
+        out.precision(10);
+        out << "{\n  \"context\": {\n"
+            << "    \"executable\": \"metal_dispersion_bench\",\n"
+            << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+            << "    \"residual_kernel\": \"" << drudeKernels().name << "\"\n"
+            << "  },\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results_.size(); ++i) {
+            const Measurement& m = results_[i];
+            double seconds = m.ns_per_iteration * 1e-9;
+            out << "    {\"name\": \"" << jsonEscape(m.name) << "\", \"run_type\": \"iteration\", "
+                << "\"iterations\": " << m.iterations << ", "
+                << "\"real_time\": " << m.ns_per_iteration << ", \"cpu_time\": " << m.ns_per_iteration << ", "
+                << "\"time_unit\": \"ns\"";
+            if (m.bytes_per_iteration > 0)
+                out << ", \"bytes_per_second\": " << m.bytes_per_iteration / seconds;
+            if (m.items_per_iteration > 0)
+                out << ", \"items_per_second\": " << m.items_per_iteration / seconds;
+            out << "}" << (i + 1 < results_.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+        std::cout << "\nResults written to " << options_.json << '\n';
+    }
+
+private:
+    static void print(const Measurement& m) {
+        double seconds = m.ns_per_iteration * 1e-9;
+        std::cout << std::left << std::setw(44) << m.name << std::right << std::setw(14) << std::fixed
+                  << std::setprecision(m.ns_per_iteration < 1e4 ? 1 : 0) << m.ns_per_iteration << " ns"
+                  << std::setw(12) << m.iterations;
+        if (m.bytes_per_iteration > 0)
+            std::cout << std::setw(12) << std::setprecision(1) << m.bytes_per_iteration / seconds / 1e6 << " MB/s";
+        if (m.items_per_iteration > 0)
+            std::cout << std::setw(12) << std::setprecision(2) << m.items_per_iteration / seconds / 1e6 << " M items/s";
+        std::cout << std::defaultfloat << std::setprecision(6) << '\n';
+    }
+
+    Options options_;
+    std::vector<Measurement> results_;
+};
+
+// Synthetic Drude-like spectrum of 'points' lines over 400–900 nm, written once to a temp file.
+std::string syntheticDataFile(size_t points) {
+    std::string path = (std::filesystem::temp_directory_path()
+                        / ("metal_dispersion_bench_" + std::to_string(points) + ".txt")).string();
+    std::error_code ec;
+    if (std::filesystem::exists(path, ec))
+        return path;
+    std::ofstream out (path);
+    out.precision(15);
+    std::mt19937_64 rng (42);
+    std::uniform_real_distribution<double> noise (-0.01, 0.01);
+    for (size_t i = 0; i < points; ++i) {
+        double lambda = 400.0 + 500.0 * i / (points - 1);
+        std::complex<double> eps = drude_eps((2*pi*c)/(lambda*1e-9), eps_inf, 1.35e16, 1.4e14);
+        std::complex<double> index = std::sqrt(eps);
+        out << lambda << ',' << index.real() * (1 + noise(rng)) << ',' << index.imag() * (1 + noise(rng)) << '\n';
+    }
+    return path;
+}
+
+// fitDrude with mixed_precision off and on, for every search mode: the two must agree within
+// one step of the mode's final grid in ω_p and γ, and within kErrorTolerance (relative, about
+// ten times the float residual's rounding) in the error. Prints one line per mode and returns
+// the number of disagreements.
+int checkMixedPrecision(const FitProblem& problem, const std::string& label) {
+    constexpr double kErrorTolerance = 2e-5;
+    int failures = 0;
+    for (SearchMode mode : {SearchMode::Grid, SearchMode::Refine, SearchMode::LevenbergMarquardt}) {
+        mixed_precision = false;
+        const DrudeFit reference = fitDrude(problem, mode, 1);
+        mixed_precision = true;
+        const DrudeFit mixed = fitDrude(problem, mode, 1);
+        mixed_precision = false;
+
+        const bool refine = mode == SearchMode::Refine;
+        const double step_omega_p = refine ? refine_domega_p : domega_p;
+        const double step_gamma = refine ? refine_dgamma : dgamma;
+        const double d_omega_p = std::fabs(mixed.fit.omega_p - reference.fit.omega_p) / step_omega_p;
+        const double d_gamma = std::fabs(mixed.fit.gamma - reference.fit.gamma) / step_gamma;
+        const double d_error = std::fabs(mixed.fit.error - reference.fit.error) / reference.fit.error;
+        const bool agree = d_omega_p <= 1.0 && d_gamma <= 1.0 && d_error <= kErrorTolerance;
+        failures += !agree;
+        std::cout << std::left << std::setw(44) << std::string("check/mixed/") + searchModeName(mode) + "/" + label
+                  << "omega_p " << d_omega_p << " steps, gamma " << d_gamma << " steps, error "
+                  << d_error << " relative  " << (agree ? "ok" : "FAILED") << '\n';
+    }
+    return failures;
+}
+
+// Error paths of the command line, run in-process: runs that must fail (status 1 with an
+// "Error" message) and output files that must only warn (status 0). stdout and stderr of
+// each run are captured and the globals set by the runs are restored afterwards. Prints one
+// line per case and returns the number of cases that did not behave as expected.
+int checkCommandLine(const std::string& data_file) {
+    struct Case {
+        std::string name;
+        std::vector<std::string> args;
+        int status;            // expected exit status
+        std::string message;   // expected on stderr
+    };
+    const std::string bad_file = (std::filesystem::temp_directory_path() / "metal_dispersion_bench_bad.txt").string();
+    const std::string results = (std::filesystem::temp_directory_path() / "metal_dispersion_bench_fit.json").string();
+    std::ofstream(bad_file) << "wavelength n k\n400,0.17\n";
+    const std::string data = "data_file=" + data_file;
+    const std::vector<Case> cases = {
+        {"missing_data_file", {"--set", "data_file=" + bad_file + ".missing"}, 1, "Error: "},
+        {"bad_data_file", {"--set", "data_file=" + bad_file}, 1, "Error: Malformed data"},
+        {"bad_data_file/streamed", {"--set", "data_file=" + bad_file, "--set", "stream_data=true"}, 1, "Error: "},
+        {"empty_window", {"--set", data, "--set", "omega_min=1", "--set", "omega_max=2"}, 1,
+         "Error: No data points inside the fitting window"},
+        {"empty_window/streamed", {"--set", data, "--set", "omega_min=1", "--set", "omega_max=2",
+                                   "--set", "stream_data=true"}, 1, "Error: No data points inside the fitting window"},
+        {"unwritable_results", {"--set", data, "--results", "/nonexistent/fit.json"}, 1, "Error: "},
+        {"unwritable_surface", {"--set", data, "--set", "surface_file=/nonexistent/surface.npy"}, 0,
+         "Warning: could not write error surface"},
+        {"unwritable_trace", {"--set", data, "--trace", "/nonexistent/trace.json"}, 0, "Warning: could not write trace"},
+        {"batch/drude-lorentz", {"--batch", data_file, "--model", "drude-lorentz"}, 1, "Error: "},
+    };
+
+    int failures = 0;
+    for (const Case& c : cases) {
+        const double saved_omega_min = omega_min, saved_omega_max = omega_max;
+        const std::string saved_surface_file = surface_file, saved_results_file = results_file;
+        const bool saved_stream_data = stream_data, saved_headless = headless;
+        const bool saved_use_fit_cache = use_fit_cache, saved_use_data_cache = use_data_cache;
+        use_fit_cache = use_data_cache = false;   // nothing of these runs is kept on disk
+
+        std::vector<std::string> args = {"metal_dispersion", "--set", "results_file=" + results};
+        args.insert(args.end(), c.args.begin(), c.args.end());
+        std::vector<char*> argv;
+        for (std::string& arg : args)
+            argv.push_back(arg.data());
+        std::ostringstream out, err;
+        std::streambuf* cout_buf = std::cout.rdbuf(out.rdbuf());
+        std::streambuf* cerr_buf = std::cerr.rdbuf(err.rdbuf());
+        const int status = runCommandLine(static_cast<int>(argv.size()), argv.data());
+        std::cout.rdbuf(cout_buf);
+        std::cerr.rdbuf(cerr_buf);
+
+        omega_min = saved_omega_min;
+        omega_max = saved_omega_max;
+        surface_file = saved_surface_file;
+        results_file = saved_results_file;
+        stream_data = saved_stream_data;
+        headless = saved_headless;
+        use_fit_cache = saved_use_fit_cache;
+        use_data_cache = saved_use_data_cache;
+        Profiler::enabled = false;
+
+        const std::string errors = err.str();
+        const bool ok = status == c.status && errors.find(c.message) != std::string::npos;
+        failures += !ok;
+        std::cout << std::left << std::setw(44) << "check/cli/" + c.name << "status " << status << ", "
+                  << errors.substr(0, errors.find('\n')) << "  " << (ok ? "ok" : "FAILED") << '\n';
+    }
+    std::filesystem::remove(bad_file);
+    std::filesystem::remove(results);
+    return failures;
+}
+
+size_t fileSize(const std::string& path) {
+    std::error_code ec;
+    return static_cast<size_t>(std::filesystem::file_size(path, ec));
+}
+
+} // namespace bench
+
+int main(int argc, char* argv[]) {
+    bench::Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            options.min_time = std::stod(argv[++i]);
+        } else if (arg == "--json" && i + 1 < argc) {
+            options.json = argv[++i];
+        } else if (arg == "--check") {
+            options.check = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--filter <substring>] [--min-time <seconds>] [--json <file>]\n"
+                      << "       " << argv[0] << " --check\n";
+            return 1;
+        }
+    }
+
+    const std::string palik_file = "data/Ag_Palik_400-900nm.txt";
+    const std::string large_file = bench::syntheticDataFile(1000000);
+    if (options.check) {
+        Material palik ("Silver");
+        palik.loadData(palik_file, false, false);
+        Material large ("Synthetic");
+        large.loadData(large_file, false, false);
+        const int mixed_failures = bench::checkMixedPrecision(FitProblem(palik), "palik")
+                                 + bench::checkMixedPrecision(FitProblem(large), "synthetic_1M");
+        std::cout << (mixed_failures ? "Mixed precision disagrees with double\n" : "Mixed precision agrees with double\n");
+        const int cli_failures = bench::checkCommandLine(palik_file);
+        std::cout << (cli_failures ? "Command line error handling FAILED\n" : "Command line errors are reported\n");
+        return mixed_failures || cli_failures ? 1 : 0;
+    }
+    bench::Runner runner (options);
+    std::cout << "Residual kernel: " << drudeKernels().name << ", hardware threads: "
+              << std::thread::hardware_concurrency() << "\n\n";
+
+    // Loading
+    for (const std::string& file : {palik_file, large_file}) {
+        std::string label = (file == palik_file) ? "palik" : "synthetic_1M";
+        Material probe ("probe");
+        probe.loadData(file, false, false);
+        double points = static_cast<double>(probe.getWavelength().size());
+        runner.run("load/" + label, [&] {
+            Material m ("bench");
+            m.loadData(file, false, false);
+            bench::doNotOptimize(m.getWavelength().data());
+        }, static_cast<double>(bench::fileSize(file)), points);
+        runner.run("stream_fit_problem/" + label, [&] {
+            FitProblem problem = streamFitProblem("bench", file, stream_chunk_points, omega_min, omega_max, false);
+            bench::doNotOptimize(problem.size());
+        }, static_cast<double>(bench::fileSize(file)), points);
+    }
+
+    Material palik ("Silver");
+    palik.loadData(palik_file, false, false);
+    Material large ("Synthetic");
+    large.loadData(large_file, false, false);
+
+    // Permittivity from n and k
+    for (Material* m : {&palik, &large}) {
+        std::string label = (m == &palik) ? "palik" : "synthetic_1M";
+        runner.run("compute_epsilon/" + label, [&] {
+            m->invalidate();
+            bench::doNotOptimize(m->computeEpsilon().first.data());
+        }, 0.0, static_cast<double>(m->getWavelength().size()));
+    }
+
+    // Monotone cubic resampling onto a uniform energy grid (interpolants rebuilt every time)
+    for (Material* m : {&palik, &large}) {
+        std::string label = (m == &palik) ? "palik" : "synthetic_1M";
+        runner.run("resample/" + label + "/points:4096", [&] {
+            m->invalidate();
+            bench::doNotOptimize(m->resample(4096).n.data());
+        }, 0.0, static_cast<double>(m->getWavelength().size()));
+    }
+
+    // Residual evaluation, per kernel set
+    FitProblem palik_problem (palik);
+    FitProblem large_problem (large);
+    for (const DrudeKernels& kernels : availableDrudeKernels()) {
+        for (const FitProblem* problem : {&palik_problem, &large_problem}) {
+            std::string label = (problem == &palik_problem) ? "palik" : "synthetic_1M";
+            double samples = static_cast<double>(problem->size());
+            runner.run(std::string("residual/") + kernels.name + "/" + label, [&] {
+                bench::doNotOptimize(kernels.error(*problem, eps_inf, 1.35e16, 1.4e14));
+            }, 0.0, samples);
+
+            double omega_p[GridSearch::kTile], gamma[GridSearch::kTile], errors[GridSearch::kTile];
+            for (size_t k = 0; k < GridSearch::kTile; ++k) {
+                omega_p[k] = 1.3e16 + 1e13 * k;
+                gamma[k] = 1.4e14 + 1e11 * k;
+            }
+            runner.run(std::string("residual_batch64/") + kernels.name + "/" + label, [&] {
+                kernels.errors(*problem, eps_inf, omega_p, gamma, GridSearch::kTile, errors);
+                bench::doNotOptimize(errors[0]);
+            }, 0.0, samples * GridSearch::kTile);
+        }
+    }
+    // The same tile in single precision (coarse phases of mixed_precision), per kernel set
+    for (const FloatDrudeKernels& kernels : availableFloatDrudeKernels()) {
+        for (const FitProblem* problem : {&palik_problem, &large_problem}) {
+            std::string label = (problem == &palik_problem) ? "palik" : "synthetic_1M";
+            FloatFitProblem float_problem (*problem);
+            double omega_p[GridSearch::kTile], gamma[GridSearch::kTile], errors[GridSearch::kTile];
+            for (size_t k = 0; k < GridSearch::kTile; ++k) {
+                omega_p[k] = 1.3e16 + 1e13 * k;
+                gamma[k] = 1.4e14 + 1e11 * k;
+            }
+            runner.run(std::string("residual_batch64_float/") + kernels.name + "/" + label, [&] {
+                kernels.errors(float_problem, eps_inf, omega_p, gamma, GridSearch::kTile, errors, HUGE_VAL);
+                bench::doNotOptimize(errors[0]);
+            }, 0.0, static_cast<double>(problem->size()) * GridSearch::kTile);
+        }
+    }
+    // Generic model kernels (model ε of every sample stored, as in the fitter), per instruction set
+    using DrudeLorentz1 = DrudeLorentzModel<1>;
+    using Lorentz2 = LorentzModel<2>;
+    DrudeLorentz1::Params dl_params {1.335e16, 1.04e14, 1.0, 2.87, 1.25e16, 4.8e15};
+    Lorentz2::Params lorentz_params {1.0, 2.87, 1.25e16, 4.8e15, 1.0, 8e15, 1e15};
+    for (const FitProblem* problem : {&palik_problem, &large_problem}) {
+        std::string label = (problem == &palik_problem) ? "palik" : "synthetic_1M";
+        std::vector<double> eps1 (problem->size()), eps2 (problem->size());
+        for (const ModelKernels<DrudeLorentz1>& kernels : availableModelKernels<DrudeLorentz1>()) {
+            runner.run(std::string("model_eps/DrudeLorentz1/") + kernels.name + "/" + label, [&] {
+                bench::doNotOptimize(kernels.error(*problem, dl_params, eps1.data(), eps2.data()));
+            }, 0.0, static_cast<double>(problem->size()));
+        }
+        for (const ModelKernels<Lorentz2>& kernels : availableModelKernels<Lorentz2>()) {
+            runner.run(std::string("model_eps/Lorentz2/") + kernels.name + "/" + label, [&] {
+                bench::doNotOptimize(kernels.error(*problem, lorentz_params, eps1.data(), eps2.data()));
+            }, 0.0, static_cast<double>(problem->size()));
+        }
+    }
+
+    runner.run("residual/reference/palik", [&] {
+        bench::doNotOptimize(computeError(palik.getOmega(), eps_inf, 1.35e16, 1.4e14,
+                                          palik.computeEpsilon().first, palik.computeEpsilon().second));
+    }, 0.0, static_cast<double>(palik_problem.size()));
+
+    // Full exhaustive grid at several thread counts
+    ParameterGrid grid {omega_p_min, omega_p_max, domega_p, gamma_min, gamma_max, dgamma};
+    DrudeObjective objective {palik_problem, eps_inf};
+    unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned threads = 1; ; threads *= 2) {
+        threads = std::min(threads, hw);
+        runner.run("grid_search/palik/threads:" + std::to_string(threads), [&] {
+            bench::doNotOptimize(GridSearch(grid, threads).run(objective).error);
+        }, 0.0, static_cast<double>(grid.size()));
+        if (threads == hw)
+            break;
+    }
+    grid_pruning = false;
+    runner.run("grid_search/palik/unpruned/threads:1", [&] {
+        bench::doNotOptimize(GridSearch(grid, 1).run(objective).error);
+    }, 0.0, static_cast<double>(grid.size()));
+    grid_pruning = true;
+    FloatFitProblem palik_float (palik_problem);
+    FloatDrudeObjective float_objective {palik_float, eps_inf};
+    runner.run("grid_search/palik/float/threads:1", [&] {
+        bench::doNotOptimize(GridSearch(grid, 1).run(float_objective).error);
+    }, 0.0, static_cast<double>(grid.size()));
+    DrudeObjective objective_fit_eps_inf {palik_problem, eps_inf, true};
+    runner.run("grid_search/palik/fit_eps_inf/threads:1", [&] {
+        bench::doNotOptimize(GridSearch(grid, 1).run(objective_fit_eps_inf).error);
+    }, 0.0, static_cast<double>(grid.size()));
+
+    // Error-surface scan over ε∞ (coarse ε∞ step, pruned CPU backend)
+    ScanGrid scan_grid {grid, 3.0, 6.0, 0.5};
+    runner.run("scan/palik/eps_inf:6/threads:1", [&] {
+        bench::doNotOptimize(scanErrorSurface(palik_problem, scan_grid, ScanBackend::CPU, false, 1).best.error);
+    }, 0.0, static_cast<double>(scan_grid.size()));
+
+    // Thin-film sweep of the measured ε: one angle (kernel bound) and a full angle sweep, per kernel set
+    FilmSpectrum film_spectrum = filmSpectrum(palik);
+    FilmSweep film_one_angle {1.0, 201.0, 1.0, 30.0, 31.0, 1.0};
+    FilmSweep film_sweep {1.0, 201.0, 1.0, 0.0, 90.0, 1.0};
+    for (const FilmKernels& kernels : availableFilmKernels()) {
+        runner.run(std::string("film/") + kernels.name + "/palik/thickness:200/angles:1/threads:1", [&] {
+            bench::doNotOptimize(solveFilmSweep(film_spectrum, film_one_angle, 1, kernels).values.data());
+        }, 0.0, 200.0 * film_spectrum.wavelength.size());
+    }
+    runner.run("film/palik/thickness:200/angles:90/threads:1", [&] {
+        bench::doNotOptimize(solveFilmSweep(film_spectrum, film_sweep, 1).values.data());
+    }, 0.0, 200.0 * 90 * film_spectrum.wavelength.size());
+
+    // Time to convergence of the faster fitters
+    for (SearchMode mode : {SearchMode::Refine, SearchMode::LevenbergMarquardt}) {
+        for (const FitProblem* problem : {&palik_problem, &large_problem}) {
+            std::string label = (problem == &palik_problem) ? "palik" : "synthetic_1M";
+            runner.run(std::string("fit/") + searchModeName(mode) + "/" + label, [&] {
+                bench::doNotOptimize(fitDrude(*problem, mode, 1).fit.error);
+            });
+        }
+    }
+    // Grid and coarse-to-fine fits in mixed precision, against their all-double runs
+    mixed_precision = true;
+    for (SearchMode mode : {SearchMode::Grid, SearchMode::Refine}) {
+        for (const FitProblem* problem : {&palik_problem, &large_problem}) {
+            if (mode == SearchMode::Grid && problem == &large_problem)
+                continue;
+            std::string label = (problem == &palik_problem) ? "palik" : "synthetic_1M";
+            runner.run(std::string("fit/") + searchModeName(mode) + "/mixed/" + label, [&] {
+                bench::doNotOptimize(fitDrude(*problem, mode, 1).fit.error);
+            });
+        }
+    }
+    mixed_precision = false;
+    // Bootstrap intervals around the Levenberg–Marquardt fit
+    DrudeFit palik_fit = fitDrude(palik_problem, SearchMode::LevenbergMarquardt, 1);
+    runner.run("bootstrap/palik/replicates:200/threads:1", [&] {
+        bench::doNotOptimize(bootstrapDrude(palik_problem, palik_fit, 200, 0.95, 1, 1).omega_p.lower);
+    }, 0.0, 200.0);
+    FitProblem palik_full (palik, 0.0, std::numeric_limits<double>::max());
+    runner.run("fit/DrudeLorentz/LevenbergMarquardt/palik", [&] {
+        bench::doNotOptimize(fitDrudeLorentz(palik_full, SearchMode::LevenbergMarquardt, 1).fit.error);
+    });
+
+    runner.writeJson();
+    return 0;
+}
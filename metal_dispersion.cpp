@@ -13,31 +13,200 @@
 #include <fstream>
 #include <vector>
 #include <complex>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <cstdint>
+#include <filesystem>
+#include <cstdio>
+#include <functional>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <iomanip>
+#include <map>
+#include <limits>
+#include <array>
+#include <sstream>
+#include <random>
+
+// Headless build: define METAL_DISPERSION_HEADLESS to compile without matplotlibcpp.h,
+// so the program neither needs nor starts an embedded Python interpreter.
+#ifndef METAL_DISPERSION_HEADLESS
 #include "matplotlibcpp.h"
+#endif
+
+// Optional GPU backend of the error-surface scan: define METAL_DISPERSION_CUDA and link
+// metal_dispersion_cuda.cu (built with nvcc).
+#ifdef METAL_DISPERSION_CUDA
+#include "metal_dispersion_cuda.h"
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Hand-vectorized AVX2/AVX-512 kernels, selected at runtime. Define METAL_DISPERSION_NO_SIMD
+// to build with the portable scalar kernels only.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(METAL_DISPERSION_NO_SIMD)
+#define METAL_DISPERSION_X86_SIMD
+#include <immintrin.h>
+#endif
 
+// Forces inlining of the generic kernel bodies into their per-instruction-set wrappers.
+#if defined(__GNUC__)
+#define METAL_DISPERSION_INLINE inline __attribute__((always_inline))
+#else
+#define METAL_DISPERSION_INLINE inline
+#endif
+
+#ifndef METAL_DISPERSION_HEADLESS
 namespace plt = matplotlibcpp;
+#endif
 
 constexpr double c = 2.99792458e8;
 constexpr double pi = 3.1415;
+// Full-precision π for the FFT, the Kramers–Kronig check and the film solver; 'pi' above keeps
+// its historical value so the wavelength-to-frequency conversion, and every fit, stay as before.
+constexpr double kPi = 3.141592653589793;
+
+// High-frequency permittivity: used as is, or as the starting value when fit_eps_inf is set.
+// The default suits silver.
+double eps_inf = 4.3;
 
-// Default high-frequency permittivity
-constexpr double eps_inf = 4.3; 
+// Fit eps_inf together with omega_p and gamma. The grid searches solve it in closed form at
+// every grid point (the error is quadratic in eps_inf), so the three-parameter fit costs the
+// same as the two-parameter one; Levenberg–Marquardt fits it as a third parameter.
+bool fit_eps_inf = false;
 
 // Drude model is valid only below interband transition energies.
 // We restrict fitting to omega_min < ω < omega_max to avoid interband effects.
-constexpr double omega_min = 1.5e15;   // rad/s
-constexpr double omega_max = 4.0e15;   // rad/s
+double omega_min = 1.5e15;   // rad/s
+double omega_max = 4.0e15;   // rad/s
 
 // Parameter search ranges
-constexpr double omega_p_min = 1.0e15; // rad/s
-constexpr double omega_p_max = 3.0e16; // rad/s
-constexpr double gamma_min   = 1.0e13; // s^-1
-constexpr double gamma_max   = 1.5e14; // s^-1
+double omega_p_min = 1.0e15; // rad/s
+double omega_p_max = 3.0e16; // rad/s
+double gamma_min   = 1.0e13; // s^-1
+double gamma_max   = 1.5e14; // s^-1
 
 // Step sizes (grid resolution)
 double domega_p = 0.05e15;
 double dgamma   = 0.1e13;
 
+// Number of worker threads used by the grid search (0 = all hardware threads).
+unsigned num_threads = 0;
+
+// Let the grid searches abandon candidates whose partial error already exceeds the best one
+// found so far (same result, fewer residual evaluations).
+bool grid_pruning = true;
+
+// Mixed precision: run the grid and coarse-to-fine searches (and the Levenberg–Marquardt seed
+// grid) on float copies of the fit window, twice as many samples per SIMD instruction, then
+// rescore the neighbourhood of the best point in double. Fixed eps_inf only; with fit_eps_inf
+// the searches stay in double.
+bool mixed_precision = false;
+
+// Final resolution of the coarse-to-fine search (SearchMode::Refine).
+double refine_domega_p = 0.005e15;
+double refine_dgamma   = 0.01e13;
+
+// Error-surface scan (--scan): the Drude error at every point of the omega_p × gamma grid above
+// (domega_p, dgamma) for every eps_inf from scan_eps_inf_min up to scan_eps_inf_max in steps of
+// scan_deps_inf, e.g. to study parameter degeneracy.
+double scan_eps_inf_min = 3.0;
+double scan_eps_inf_max = 6.0;
+double scan_deps_inf = 0.1;
+
+// Levenberg–Marquardt fitter (SearchMode::LevenbergMarquardt).
+size_t lm_seed_points = 8;    // points per axis of the coarse grid providing the starting point
+
+// Map / sequence fitting (--map): pixels are fitted in tiles of map_tile × map_tile
+// (map_tile² consecutive steps for single-row sequences), one tile per thread at a time. The
+// first pixel of a tile gets a global search; every later one starts Levenberg–Marquardt
+// from its neighbour's solution and falls back to the global search only if its error comes
+// out above map_fallback_ratio times the neighbour's.
+size_t map_tile = 16;
+double map_fallback_ratio = 2.0;
+
+// Bootstrap confidence intervals of the Drude fit (0 replicates = off). Each replicate
+// resamples the in-window points with replacement and is refitted with Levenberg–Marquardt
+// from the best fit; replicates run on num_threads threads and depend only on bootstrap_seed.
+size_t bootstrap_replicates = 0;
+double bootstrap_confidence = 0.95;   // coverage of the percentile intervals
+size_t bootstrap_seed = 1;
+
+// Keep the results of the fits in fit_cache_dir, keyed by a hash of the fitted data and of every
+// setting the fit depends on, and return them instead of refitting unchanged inputs.
+bool use_fit_cache = false;
+std::string fit_cache_dir = ".mdfit";
+
+// Keep a binary copy of each parsed data file next to it (<file>.mdbin) and load that
+// instead of re-parsing the text while the source file is unchanged.
+bool use_data_cache = false;
+
+// Streaming mode for spectra larger than memory: the data file is read in chunks of
+// stream_chunk_points and only the samples inside the fitting window are kept.
+// The full-spectrum plots are not available in this mode.
+bool stream_data = false;
+size_t stream_chunk_points = 1 << 16;
+
+// Resampling: with resample_points > 0 the loaded n, k data are replaced by a monotone cubic
+// interpolation onto resample_points energies evenly spaced from resample_energy_min to
+// resample_energy_max (eV; both 0 = the data range) before fitting, plotting and output.
+size_t resample_points = 0;
+double resample_energy_min = 0.0;
+double resample_energy_max = 0.0;
+
+// Kramers–Kronig check of the loaded data before the fit (kk_check = warn or reject): the
+// Hilbert transform of ε₂, on kk_points uniform energies, is compared with the measured ε₁ in
+// kk_regions energy bands; a band whose RMS deviation (relative to |ε|) exceeds kk_tolerance
+// is reported, and with reject the data are not fitted.
+size_t kk_points = 2048;
+size_t kk_regions = 4;
+double kk_tolerance = 0.02;
+
+// Thin-film forward solver (--film): reflectance and transmittance (s and p) of a film of the
+// loaded material between an ambient of index film_ambient_index and a substrate of index
+// film_substrate_index, for every data wavelength × thickness from film_thickness_min up to
+// film_thickness_max (nm, step film_dthickness) × angle of incidence from film_angle_min up to
+// film_angle_max (degrees, step film_dangle).
+double film_thickness_min = 5.0;
+double film_thickness_max = 105.0;
+double film_dthickness = 5.0;
+double film_angle_min = 0.0;
+double film_angle_max = 90.0;
+double film_dangle = 5.0;
+double film_ambient_index = 1.0;
+double film_substrate_index = 1.52;
+
+// Headless mode (always on in METAL_DISPERSION_HEADLESS builds, or with --no-plot): no figures
+// are drawn, Python is never initialized and the results are written to results_file instead.
+#ifdef METAL_DISPERSION_HEADLESS
+bool headless = true;
+#else
+bool headless = false;
+#endif
+std::string results_file = "drude_fit.json";   // .json or .csv
+
+// Plotted series longer than this are reduced by min/max decimation before they are
+// handed to matplotlib (a few points per horizontal pixel). 0 plots every point.
+size_t plot_max_points = 4000;
+
 
 // Basic wavelength-domain plots can be enabled for data validation and educational purposes.
 // Advanced plots focus on physical modeling and comparison with experiment. This feature is tunable in the main function.
@@ -46,6 +215,510 @@ enum class PlotLevel {
     Advanced    // v2 plots (ε vs energy + Drude fit)
 };
 
+// Strategy used to search the (omega_p, gamma) parameter space.
+enum class SearchMode {
+    Grid,       // exhaustive grid with steps domega_p, dgamma
+    Refine,     // coarse grid, then repeated finer grids around the best point
+    LevenbergMarquardt  // small coarse grid, then gradient-based least-squares refinement
+};
+
+// Where the error-surface scan (--scan) is evaluated.
+enum class ScanBackend {
+    CPU,    // SIMD kernels on num_threads threads (default)
+    CUDA    // GPU, only in builds with METAL_DISPERSION_CUDA
+};
+ScanBackend scan_backend = ScanBackend::CPU;
+
+// Error-surface store: with a .npy file name, --scan and the exhaustive Grid fit of the Drude
+// model (fixed eps_inf) keep every error and write them to surface_file as a NumPy array
+// [eps_inf][omega_p][gamma], described by the JSON sidecar <surface_file>.json. A later run on
+// the same data whose grid lies inside the stored one reads the errors back instead.
+std::string surface_file = "";
+
+// Kramers–Kronig validation stage before the fit.
+enum class KKCheck {
+    Off,
+    Warn,       // report inconsistent bands, fit anyway
+    Reject      // do not fit data with an inconsistent band
+};
+KKCheck kk_check = KKCheck::Off;
+
+// Permittivity of the film in the thin-film solver.
+enum class FilmSource {
+    Data,   // measured ε of the loaded data
+    Drude   // ε of the Drude fit to the data
+};
+FilmSource film_source = FilmSource::Data;
+
+// Dispersion model fitted to the data.
+enum class ModelType {
+    Drude,          // free electrons only, fitted inside omega_min < ω < omega_max
+    DrudeLorentz    // Drude term plus Lorentz oscillators, fitted over the full data range
+};
+
+// Pipeline instrumentation: scoped stage timers and event counters, switched on with
+// --profile (summary table) or --trace <file> (Chrome trace viewer JSON).
+// When disabled every probe is a single well-predicted test of Profiler::enabled.
+class Profiler {
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum Counter {
+        PointsParsed,       // data points read from files
+        ErrorEvaluations,   // residual evaluations (computeError calls or equivalent passes)
+        GridPoints,         // grid points visited by the grid searches
+        FitterIterations,   // Levenberg–Marquardt iterations
+        PrunedPoints,       // grid points rejected early by the bounded (pruning) objective
+        FilmPoints,         // (thickness, angle, wavelength) points of the thin-film solver
+        CounterCount
+    };
+
+    static inline bool enabled = false;
+
+    static void count(Counter counter, uint64_t n = 1) {
+        if (enabled)
+            state().counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    static void record(const char* name, clock::time_point start, clock::time_point end) {
+        State& s = state();
+        Event event {name, start, end, threadIndex()};
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.events.push_back(event);
+    }
+
+    // Time per stage (calls, total, mean) followed by the counters.
+    static void printSummary(std::ostream& out) {
+        State& s = state();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        std::map<std::string, std::pair<size_t, double>> stages;
+        for (const Event& e : s.events) {
+            auto& stage = stages[e.name];
+            stage.first += 1;
+            stage.second += std::chrono::duration<double, std::milli>(e.end - e.start).count();
+        }
+        out << "\n***Profile***\n" << std::left << std::setw(24) << "stage" << std::right
+            << std::setw(8) << "calls" << std::setw(14) << "total (ms)" << std::setw(14) << "mean (ms)" << '\n';
+        out << std::fixed << std::setprecision(3);
+        for (const auto& [name, stage] : stages)
+            out << std::left << std::setw(24) << name << std::right << std::setw(8) << stage.first
+                << std::setw(14) << stage.second << std::setw(14) << stage.second / stage.first << '\n';
+        out << std::defaultfloat << std::setprecision(6);
+        for (int c = 0; c < CounterCount; ++c)
+            out << std::left << std::setw(24) << counterName(c) << std::right << std::setw(8)
+                << s.counters[c].load() << '\n';
+    }
+
+    // Chrome trace event format: one complete ("X") event per timed scope, counters at the end.
+    static void writeTrace(const std::string& path) {
+        State& s = state();
+        std::ofstream out (path);
+        if (!out) {
+            throw std::runtime_error("Error: Could not write " + path);
+        }
+        std::lock_guard<std::mutex> lock(s.mutex);
+        clock::time_point origin = s.events.empty() ? clock::now() : s.events.front().start;
+        for (const Event& e : s.events)
+            origin = std::min(origin, e.start);
+        auto us = [origin](clock::time_point t) {
+            return std::chrono::duration<double, std::micro>(t - origin).count();
+        };
+        out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        double last = 0.0;
+        for (const Event& e : s.events) {
+            out << "  {\"name\": \"" << e.name << "\", \"cat\": \"stage\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread
+                << ", \"ts\": " << us(e.start) << ", \"dur\": " << us(e.end) - us(e.start) << "},\n";
+            last = std::max(last, us(e.end));
+        }
+        out << "  {\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << last << ", \"args\": {";
+        for (int c = 0; c < CounterCount; ++c)
+            out << (c ? ", " : "") << '"' << counterName(c) << "\": " << s.counters[c].load();
+        out << "}}\n]}\n";
+    }
+
+private:
+    struct Event {
+        const char* name;
+        clock::time_point start, end;
+        unsigned thread;
+    };
+
+    struct State {
+        std::mutex mutex;
+        std::vector<Event> events;
+        std::atomic<uint64_t> counters[CounterCount] = {};
+    };
+
+    static State& state() {
+        static State s;
+        return s;
+    }
+
+    // Small, stable per-thread number for the trace.
+    static unsigned threadIndex() {
+        static std::atomic<unsigned> next {0};
+        thread_local unsigned index = next++;
+        return index;
+    }
+
+    static const char* counterName(int counter) {
+        static const char* names[CounterCount] = {"points_parsed", "error_evaluations", "grid_points", "fitter_iterations",
+                                                     "pruned_points", "film_points"};
+        return names[counter];
+    }
+};
+
+// Times the enclosing scope as stage 'name' (a string literal) when profiling is enabled.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(const char* name) : name_(name) {
+        if (Profiler::enabled)
+            start_ = Profiler::clock::now();
+    }
+
+    ~ScopedTimer() {
+        if (Profiler::enabled)
+            Profiler::record(name_, start_, Profiler::clock::now());
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    const char* name_;
+    Profiler::clock::time_point start_;
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+#ifdef _WIN32
+        file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Error: Could not open file " + filename);
+        LARGE_INTEGER size;
+        GetFileSizeEx(file_, &size);
+        size_ = static_cast<size_t>(size.QuadPart);
+        if (size_ > 0) {
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping_)
+                data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+            if (!data_) {
+                close();
+                throw std::runtime_error("Error: Could not map file " + filename);
+            }
+        }
+#else
+        fd_ = ::open(filename.c_str(), O_RDONLY);
+        if (fd_ < 0)
+            throw std::runtime_error("Error: Could not open file " + filename);
+        struct stat st;
+        if (fstat(fd_, &st) != 0) {
+            close();
+            throw std::runtime_error("Error: Could not open file " + filename);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (p == MAP_FAILED) {
+                close();
+                throw std::runtime_error("Error: Could not map file " + filename);
+            }
+            data_ = static_cast<const char*>(p);
+            madvise(p, size_, MADV_SEQUENTIAL);
+        }
+#endif
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    void close() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_) munmap(const_cast<char*>(data_), size_);
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+#endif
+        data_ = nullptr;
+    }
+
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// 64-bit FNV-1a hash; 'hash' allows hashing several buffers in sequence.
+uint64_t fnv1a64(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Header of the binary spectrum cache (<file>.mdbin), followed by the wavelength, n and k
+// arrays as native doubles, each starting at a 64-byte aligned offset. The cache is a local
+// sidecar, so it uses the native byte order.
+struct SpectrumCacheHeader {
+    char magic[8];              // "MDSPEC1"
+    uint32_t header_size;
+    uint32_t reserved;
+    char name[64];              // material name when the cache was written
+    char wavelength_unit[8];    // "nm"
+    uint64_t count;             // number of data points
+    uint64_t source_size;       // size of the source text in bytes
+    int64_t source_mtime;       // modification time of the source text
+    uint64_t source_checksum;   // fnv1a64 of the source text
+    uint64_t offsets[3];        // byte offsets of the wavelength, n and k arrays
+};
+
+constexpr char spectrum_cache_magic[8] = "MDSPEC1";
+
+// Modification time of a file as a plain integer, for staleness checks.
+int64_t fileModificationTime(const std::string& filename) {
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(filename, ec);
+    return ec ? 0 : static_cast<int64_t>(time.time_since_epoch().count());
+}
+
+// Parses one "wavelength, n, k" line of a data file into values[3] (or a line of 'fields'
+// numbers into values[fields], e.g. "row, col, wavelength, n, k" in map files).
+// Fields may be separated by a comma, a semicolon or whitespace. Returns 1 for a data line,
+// 0 for a blank or '#' comment line and -1 for a malformed line.
+int parseDataLine(const char* first, const char* last, double* values, int fields = 3) {
+    auto isSpace = [](char ch) { return ch == ' ' || ch == '\t' || ch == '\r'; };
+    while (first != last && isSpace(*first)) ++first;
+    if (first == last || *first == '#')
+        return 0;
+    for (int field = 0; field < fields; ++field) {
+        if (field > 0) {
+            while (first != last && isSpace(*first)) ++first;
+            if (first != last && (*first == ',' || *first == ';')) ++first;
+            while (first != last && isSpace(*first)) ++first;
+        }
+        if (first != last && *first == '+') ++first;
+        std::from_chars_result r = std::from_chars(first, last, values[field]);
+        if (r.ec != std::errc())
+            return -1;
+        first = r.ptr;
+    }
+    while (first != last && isSpace(*first)) ++first;
+    return first == last ? 1 : -1;
+}
+
+namespace kernels {
+
+// Evaluation of piecewise cubics at positions t[p] of known interval index[p] (knot x, SoA
+// coefficients c[0..3]): the knots and coefficients of kCubicLanes positions are gathered into
+// local arrays, then evaluated in one fixed-length, branch-free Horner loop that the compiler
+// vectorizes (compiled once per instruction set below).
+constexpr size_t kCubicLanes = 8;
+
+METAL_DISPERSION_INLINE void cubicEvaluateLanes(const double* x, const double* const* c, const size_t* index,
+                                                const double* t, size_t count, double* out) {
+    size_t p = 0;
+    for (; p + kCubicLanes <= count; p += kCubicLanes) {
+        double s[kCubicLanes], c0[kCubicLanes], c1[kCubicLanes], c2[kCubicLanes], c3[kCubicLanes];
+        for (size_t l = 0; l < kCubicLanes; ++l) {
+            const size_t i = index[p + l];
+            s[l] = t[p + l] - x[i];
+            c0[l] = c[0][i];
+            c1[l] = c[1][i];
+            c2[l] = c[2][i];
+            c3[l] = c[3][i];
+        }
+        for (size_t l = 0; l < kCubicLanes; ++l)
+            out[p + l] = c0[l] + s[l] * (c1[l] + s[l] * (c2[l] + s[l] * c3[l]));
+    }
+    for (; p < count; ++p) {
+        const size_t i = index[p];
+        const double s = t[p] - x[i];
+        out[p] = c[0][i] + s * (c[1][i] + s * (c[2][i] + s * c[3][i]));
+    }
+}
+
+inline void cubicEvaluateScalar(const double* x, const double* const* c, const size_t* index,
+                                const double* t, size_t count, double* out) {
+    cubicEvaluateLanes(x, c, index, t, count, out);
+}
+
+#ifdef METAL_DISPERSION_X86_SIMD
+__attribute__((target("avx2,fma")))
+inline void cubicEvaluateAVX2(const double* x, const double* const* c, const size_t* index,
+                              const double* t, size_t count, double* out) {
+    cubicEvaluateLanes(x, c, index, t, count, out);
+}
+
+__attribute__((target("avx512f")))
+inline void cubicEvaluateAVX512(const double* x, const double* const* c, const size_t* index,
+                                const double* t, size_t count, double* out) {
+    cubicEvaluateLanes(x, c, index, t, count, out);
+}
+#endif
+
+} // namespace kernels
+
+// Cubic evaluation kernel for a given instruction set.
+struct CubicKernels {
+    const char* name;
+    void (*evaluate)(const double* x, const double* const* c, const size_t* index, const double* t,
+                     size_t count, double* out);
+};
+
+// All cubic kernels usable on this CPU, fastest first; the scalar one is always last.
+std::vector<CubicKernels> availableCubicKernels() {
+    std::vector<CubicKernels> available;
+#ifdef METAL_DISPERSION_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        available.push_back({"avx512", kernels::cubicEvaluateAVX512});
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        available.push_back({"avx2", kernels::cubicEvaluateAVX2});
+#endif
+    available.push_back({"scalar", kernels::cubicEvaluateScalar});
+    return available;
+}
+
+const CubicKernels& cubicKernels() {
+    static const CubicKernels selected = availableCubicKernels().front();
+    return selected;
+}
+
+// Monotone piecewise-cubic (PCHIP, Fritsch–Carlson) interpolant of y(x) for strictly
+// increasing x. Slopes are limited so the curve never overshoots the data: no spurious
+// wiggles in n and k between sparse tabulated points, and no negative k. The cubic of every
+// interval is stored as polynomial coefficients (one array per power), so evaluation is a
+// short Horner loop over whole SIMD vectors of positions (cubicKernels()).
+class MonotoneCubic {
+public:
+    MonotoneCubic() = default;
+
+    MonotoneCubic(const std::vector<double>& x, const std::vector<double>& y) : x_(x) {
+        const size_t n = x.size();
+        intervals_ = n > 1 ? n - 1 : 1;
+        coefficients_.assign(4 * intervals_, 0.0);
+        if (n < 2) {
+            if (n == 1)
+                coefficients_[0] = y[0];
+            return;
+        }
+        std::vector<double> h (n - 1), delta (n - 1), slope (n);
+        for (size_t i = 0; i + 1 < n; ++i) {
+            h[i] = x[i + 1] - x[i];
+            delta[i] = (y[i + 1] - y[i]) / h[i];
+        }
+        // Interior slopes: weighted harmonic mean of the neighbouring secants, zero at extrema
+        for (size_t i = 1; i + 1 < n; ++i) {
+            if (delta[i - 1] * delta[i] <= 0.0) {
+                slope[i] = 0.0;
+            } else {
+                const double w1 = 2*h[i] + h[i - 1], w2 = h[i] + 2*h[i - 1];
+                slope[i] = (w1 + w2) / (w1 / delta[i - 1] + w2 / delta[i]);
+            }
+        }
+        // End slopes: one-sided three-point estimate, limited to keep the end intervals monotone
+        auto endSlope = [](double h0, double h1, double d0, double d1) {
+            double d = ((2*h0 + h1) * d0 - h0 * d1) / (h0 + h1);
+            if (d * d0 <= 0.0)
+                return 0.0;
+            if (d0 * d1 <= 0.0 && std::fabs(d) > 3 * std::fabs(d0))
+                return 3 * d0;
+            return d;
+        };
+        if (n == 2) {
+            slope[0] = slope[1] = delta[0];
+        } else {
+            slope[0] = endSlope(h[0], h[1], delta[0], delta[1]);
+            slope[n - 1] = endSlope(h[n - 2], h[n - 3], delta[n - 2], delta[n - 3]);
+        }
+        double* c0 = coefficients_.data();
+        double* c1 = c0 + intervals_;
+        double* c2 = c1 + intervals_;
+        double* c3 = c2 + intervals_;
+        for (size_t i = 0; i + 1 < n; ++i) {
+            c0[i] = y[i];
+            c1[i] = slope[i];
+            c2[i] = (3*delta[i] - 2*slope[i] - slope[i + 1]) / h[i];
+            c3[i] = (slope[i] + slope[i + 1] - 2*delta[i]) / (h[i] * h[i]);
+        }
+    }
+
+    // Values at 'count' increasing positions t[0..count); positions outside the data range
+    // continue the first or last cubic. The intervals of all positions are found first, so the
+    // polynomials are then evaluated without data-dependent branches. With fewer knots than
+    // positions, the first position at or past every knot is estimated from the mean spacing
+    // of t and corrected against t (no correction steps when t is evenly spaced like the
+    // resample() grid), and a running count of the knots passed gives each position its
+    // interval; with more knots, every position binary-searches the knots left of it.
+    void evaluate(const double* t, size_t count, double* out) const {
+        if (x_.empty()) {
+            std::fill(out, out + count, 0.0);
+            return;
+        }
+        const size_t intervals = intervals_;
+        std::vector<size_t> index (count + 1, 0);
+        if (intervals > count) {
+            const double* knot = x_.data() + 1;
+            for (size_t p = 0; p < count; ++p) {
+                knot = std::upper_bound(knot, x_.data() + intervals, t[p]);
+                index[p] = size_t(knot - x_.data()) - 1;
+            }
+        } else {
+            const double spacing = count > 1 && t[count - 1] > t[0] ? (count - 1) / (t[count - 1] - t[0]) : 0.0;
+            for (size_t j = 1; j < intervals; ++j) {
+                const double estimate = std::ceil((x_[j] - t[0]) * spacing);
+                size_t p = estimate <= 0.0 ? 0 : estimate >= double(count) ? count : size_t(estimate);
+                while (p > 0 && t[p - 1] >= x_[j]) --p;
+                while (p < count && t[p] < x_[j]) ++p;
+                ++index[p];
+            }
+            for (size_t p = 1; p < count; ++p)
+                index[p] += index[p - 1];
+        }
+        const double* c[4] = {coefficients_.data(), coefficients_.data() + intervals,
+                              coefficients_.data() + 2 * intervals, coefficients_.data() + 3 * intervals};
+        cubicKernels().evaluate(x_.data(), c, index.data(), t, count, out);
+    }
+
+    bool empty() const {
+        return x_.empty();
+    }
+
+private:
+    std::vector<double> x_;
+    size_t intervals_ = 0;
+    std::vector<double> coefficients_;   // planes c0, c1, c2, c3 of 'intervals_' values each
+};
+
+// n and k of a Material on a uniform energy grid: energy[i] = energy_min + i*energy_step (eV),
+// increasing, with the matching wavelength (nm) and angular frequency (rad/s), also uniform.
+struct ResampledSpectrum {
+    double energy_min = 0.0, energy_step = 0.0;
+    std::vector<double> energy, wavelength, omega, n, k;
+};
+
 class Material {
 public:
     Material(const std::string& name){
@@ -56,207 +729,4798 @@ public:
         return name_;
     }
 
-    std::vector<double> getWavelength() const {
+    // The getters return references into the Material (no copies). Omega, energy and
+    // epsilon are computed on first use and cached until loadData() changes the data.
+    // The lazy computation is not synchronized: call these once before sharing a
+    // Material between threads.
+    const std::vector<double>& getWavelength() const {
         return wavelength_;
     }
     
-    std::vector<double> getN() const {
+    const std::vector<double>& getN() const {
         return n_;
     }
     
-    std::vector<double> getK() const {
+    const std::vector<double>& getK() const {
         return k_;
     }
 
-    std::vector<double> getOmega() const {
-        std::vector<double> omega;
-        for (size_t i = 0; i < wavelength_.size(); i++){
-            omega.push_back(
-                (2*pi*c)/(wavelength_[i]*1e-9)
-            );
+    const std::vector<double>& getOmega() const {
+        if (!omega_valid_) {
+            omega_.resize(wavelength_.size());
+            for (size_t i = 0; i < wavelength_.size(); i++){
+                omega_[i] = (2*pi*c)/(wavelength_[i]*1e-9);
+            }
+            omega_valid_ = true;
         }
-        return omega;
+        return omega_;
     }
 
-    std::vector<double> getEnergy() const {
-        std::vector<double> energy;
-        for (size_t i = 0; i < wavelength_.size(); i++){
-            energy.push_back(
-                (1240)/(wavelength_[i])
-            );
+    const std::vector<double>& getEnergy() const {
+        if (!energy_valid_) {
+            energy_.resize(wavelength_.size());
+            for (size_t i = 0; i < wavelength_.size(); i++){
+                energy_[i] = (1240)/(wavelength_[i]);
+            }
+            energy_valid_ = true;
         }
-        return energy;
+        return energy_;
     }
 
     // Loading data
-    void loadData (const std::string& filename){
-        std::ifstream file (filename);
-        if (!file.is_open()) {
-            throw std::runtime_error("Error: Could not open file " + filename);
+    // The file is memory-mapped, its lines are counted to reserve the arrays once, and the
+    // numbers are parsed with std::from_chars (locale-independent). A malformed line stops
+    // the import with an error naming the line instead of silently truncating the data.
+    // With use_cache, a binary copy is kept in <filename>.mdbin and read back instead of
+    // parsing while the text file is unchanged (same size and modification time, or same
+    // checksum after a touch).
+    void loadData (const std::string& filename, bool use_cache = false, bool verbose = true){
+        ScopedTimer timer ("load");
+        const std::string cache_path = filename + ".mdbin";
+        bool from_cache = use_cache && readCache(cache_path, filename);
+        if (!from_cache) {
+            MappedFile file (filename);
+            size_t first = wavelength_.size();
+            parseText(file.data(), file.size(), filename);
+            if (use_cache)
+                writeCache(cache_path, filename, first, fnv1a64(file.data(), file.size()), file.size());
+        }
+        if (wavelength_.empty()) {
+            throw std::runtime_error("Error: No data points found in " + filename);
+        }
+        invalidate();
+        if (verbose) {
+            std::cout << "\n***Imported data information***\nLoaded "<< wavelength_.size() << " data points for " << name_ << " between " << wavelength_.front() << " and " << wavelength_.back() << " nm"
+                      << (from_cache ? " (binary cache)" : "") << "\n";
+        }
+        }
+
+    // Removes all data (keeping the allocated capacity) / appends one data point.
+    // Used to fill a Material chunk by chunk when streaming large files.
+    void clearData() {
+        wavelength_.clear();
+        n_.clear();
+        k_.clear();
+        invalidate();
+    }
+
+    void addPoint(double wavelength, double n, double k) {
+        wavelength_.push_back(wavelength);
+        n_.push_back(n);
+        k_.push_back(k);
+        invalidate();
+    }
+
+    // Drops the cached derived arrays; called whenever the loaded data changes.
+    void invalidate() {
+        omega_valid_ = energy_valid_ = epsilon_valid_ = false;
+        n_interpolant_ = k_interpolant_ = MonotoneCubic();
+        resampled_ = ResampledSpectrum();
+    }
+
+    // n and k interpolated (MonotoneCubic in energy) onto 'count' evenly spaced energies
+    // from energy_min to energy_max (eV, both included; 0, 0 = the data range). Uniform grids
+    // let spectra from different sources be compared point for point and suit FFT-based
+    // checks. The interpolants are built on first use and, like the last resampled grid,
+    // cached until the data change; the same grid is returned without recomputation.
+    const ResampledSpectrum& resample(size_t count, double energy_min = 0.0, double energy_max = 0.0) const {
+        if (wavelength_.empty() || count < 2)
+            throw std::runtime_error("Error: Resampling needs data and at least 2 points");
+        const std::vector<double>& energy = getEnergy();
+        auto [lowest, highest] = std::minmax_element(energy.begin(), energy.end());
+        if (energy_min == 0.0 && energy_max == 0.0) {
+            energy_min = *lowest;
+            energy_max = *highest;
         }
-        double lambda, n_real, n_imag;
-        char comma;
-        while(file >> lambda >> comma >> n_real >> comma >> n_imag){
-            wavelength_.push_back(lambda);
-            n_.push_back(n_real);
-            k_.push_back(n_imag);
+        const double step = (energy_max - energy_min) / (count - 1);
+        if (!resampled_.energy.empty() && resampled_.energy.size() == count
+            && resampled_.energy_min == energy_min && resampled_.energy_step == step)
+            return resampled_;
+        const double tolerance = 1e-12 * *highest;
+        if (!(energy_min < energy_max) || energy_min < *lowest - tolerance || energy_max > *highest + tolerance)
+            throw std::runtime_error("Error: Resampling range " + std::to_string(energy_min) + " - "
+                                     + std::to_string(energy_max) + " eV is not inside the data range "
+                                     + std::to_string(*lowest) + " - " + std::to_string(*highest) + " eV");
+
+        ScopedTimer timer ("resample");
+        if (n_interpolant_.empty()) {
+            // Data sorted by energy (files in increasing wavelength already are, reversed);
+            // of several points at the same energy only one is kept
+            std::vector<size_t> order (energy.size());
+            for (size_t i = 0; i < order.size(); ++i) order[i] = order.size() - 1 - i;
+            auto byEnergy = [&](size_t a, size_t b) { return energy[a] < energy[b]; };
+            if (!std::is_sorted(order.begin(), order.end(), byEnergy))
+                std::stable_sort(order.begin(), order.end(), byEnergy);
+            std::vector<double> x, n, k;
+            x.reserve(order.size());
+            n.reserve(order.size());
+            k.reserve(order.size());
+            for (size_t i : order) {
+                if (!x.empty() && !(energy[i] > x.back()))
+                    continue;
+                x.push_back(energy[i]);
+                n.push_back(n_[i]);
+                k.push_back(k_[i]);
+            }
+            n_interpolant_ = MonotoneCubic(x, n);
+            k_interpolant_ = MonotoneCubic(x, k);
         }
-        std::cout << "\n***Imported data information***\nLoaded "<< wavelength_.size() << " data points for " << name_ << " between " << wavelength_.front() << " and " << wavelength_.back() << " nm\n"; 
+
+        ResampledSpectrum& r = resampled_;
+        r.energy_min = energy_min;
+        r.energy_step = step;
+        r.energy.resize(count);
+        r.wavelength.resize(count);
+        r.omega.resize(count);
+        r.n.resize(count);
+        r.k.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            r.energy[i] = energy_min + i * step;
+            r.wavelength[i] = 1240 / r.energy[i];
+            r.omega[i] = (2*pi*c) / (r.wavelength[i]*1e-9);
         }
+        n_interpolant_.evaluate(r.energy.data(), count, r.n.data());
+        k_interpolant_.evaluate(r.energy.data(), count, r.k.data());
+        return r;
+    }
+
+    // Copy of this Material holding the resample() grid as its data, in increasing wavelength
+    // like the data files, so every later stage (fits, plots, results) works on the uniform grid.
+    Material resampled(size_t count, double energy_min = 0.0, double energy_max = 0.0) const {
+        const ResampledSpectrum& r = resample(count, energy_min, energy_max);
+        Material out (name_);
+        out.wavelength_.assign(r.wavelength.rbegin(), r.wavelength.rend());
+        out.n_.assign(r.n.rbegin(), r.n.rend());
+        out.k_.assign(r.k.rbegin(), r.k.rend());
+        return out;
+    }
 
     // Computes and returns (ε₁, ε₂) from loaded n and k data.
-    std::pair<std::vector<double>, std::vector<double>> computeEpsilon() const {
-        std::vector<double> e_real, e_imag;
-        for (size_t i = 0; i < wavelength_.size(); ++i){
-            double eps_real = n_[i] * n_[i] - k_[i] * k_[i];
-            double eps_imag = 2 * n_[i] * k_[i];
-            e_real.push_back(eps_real);
-            e_imag.push_back(eps_imag);
+    const std::pair<std::vector<double>, std::vector<double>>& computeEpsilon() const {
+        if (!epsilon_valid_) {
+            ScopedTimer timer ("epsilon");
+            std::vector<double>& e_real = epsilon_.first;
+            std::vector<double>& e_imag = epsilon_.second;
+            e_real.resize(wavelength_.size());
+            e_imag.resize(wavelength_.size());
+            for (size_t i = 0; i < wavelength_.size(); ++i){
+                e_real[i] = n_[i] * n_[i] - k_[i] * k_[i];
+                e_imag[i] = 2 * n_[i] * k_[i];
+            }
+            epsilon_valid_ = true;
         }
-        return std::make_pair(e_real, e_imag);
+        return epsilon_;
     }
 
 private:
+    void parseText(const char* pos, size_t size, const std::string& filename) {
+        const size_t first_point = wavelength_.size();
+        const char* end = pos + size;
+        size_t lines = pos ? std::count(pos, end, '\n') + 1 : 0;
+        wavelength_.reserve(wavelength_.size() + lines);
+        n_.reserve(n_.size() + lines);
+        k_.reserve(k_.size() + lines);
+
+        size_t line_number = 0;
+        while (pos < end) {
+            const char* eol = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+            if (!eol) eol = end;
+            ++line_number;
+
+            double values[3];
+            int status = parseDataLine(pos, eol, values);
+            if (status < 0) {
+                throw std::runtime_error("Error: Malformed data on line " + std::to_string(line_number)
+                                         + " of " + filename + ": '" + std::string(pos, eol) + "'");
+            }
+            if (status > 0) {
+                wavelength_.push_back(values[0]);
+                n_.push_back(values[1]);
+                k_.push_back(values[2]);
+            }
+            pos = eol + 1;
+        }
+        Profiler::count(Profiler::PointsParsed, wavelength_.size() - first_point);
+    }
+
+    // Appends the cached arrays if the cache exists, is well formed and matches the source.
+    bool readCache(const std::string& cache_path, const std::string& source) {
+        std::error_code ec;
+        if (!std::filesystem::exists(cache_path, ec))
+            return false;
+        try {
+            MappedFile cache (cache_path);
+            SpectrumCacheHeader header;
+            if (cache.size() < sizeof(header))
+                return false;
+            std::memcpy(&header, cache.data(), sizeof(header));
+            if (std::memcmp(header.magic, spectrum_cache_magic, sizeof(header.magic)) != 0
+                || header.header_size != sizeof(header))
+                return false;
+            for (uint64_t offset : header.offsets)
+                if (offset % 64 != 0 || offset + header.count * sizeof(double) > cache.size())
+                    return false;
+
+            uint64_t source_size = std::filesystem::file_size(source, ec);
+            if (ec || source_size != header.source_size)
+                return false;
+            if (fileModificationTime(source) != header.source_mtime) {
+                MappedFile text (source);
+                if (fnv1a64(text.data(), text.size()) != header.source_checksum)
+                    return false;
+            }
+
+            const double* arrays[3];
+            for (int a = 0; a < 3; ++a)
+                arrays[a] = reinterpret_cast<const double*>(cache.data() + header.offsets[a]);
+            wavelength_.insert(wavelength_.end(), arrays[0], arrays[0] + header.count);
+            n_.insert(n_.end(), arrays[1], arrays[1] + header.count);
+            k_.insert(k_.end(), arrays[2], arrays[2] + header.count);
+            return header.count > 0;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+
+    // Writes the points parsed from 'source' (starting at index 'first') to the cache.
+    // Failures only cost the speed-up, so they are reported and otherwise ignored.
+    void writeCache(const std::string& cache_path, const std::string& source, size_t first,
+                    uint64_t checksum, size_t source_size) const {
+        SpectrumCacheHeader header {};
+        std::memcpy(header.magic, spectrum_cache_magic, sizeof(header.magic));
+        header.header_size = sizeof(header);
+        std::strncpy(header.name, name_.c_str(), sizeof(header.name) - 1);
+        std::strncpy(header.wavelength_unit, "nm", sizeof(header.wavelength_unit) - 1);
+        header.count = wavelength_.size() - first;
+        header.source_size = source_size;
+        header.source_mtime = fileModificationTime(source);
+        header.source_checksum = checksum;
+
+        const uint64_t bytes = header.count * sizeof(double);
+        uint64_t offset = (sizeof(header) + 63) / 64 * 64;
+        for (int a = 0; a < 3; ++a) {
+            header.offsets[a] = offset;
+            offset += (bytes + 63) / 64 * 64;
+        }
+
+        const std::string tmp_path = cache_path + ".tmp";
+        {
+            std::ofstream out (tmp_path, std::ios::binary | std::ios::trunc);
+            const std::vector<double>* arrays[3] = {&wavelength_, &n_, &k_};
+            const char zeros[64] = {};
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            uint64_t written = sizeof(header);
+            for (int a = 0; a < 3; ++a) {
+                out.write(zeros, header.offsets[a] - written);
+                out.write(reinterpret_cast<const char*>(arrays[a]->data() + first), bytes);
+                written = header.offsets[a] + bytes;
+            }
+            if (!out) {
+                std::cerr << "Warning: could not write data cache " << cache_path << '\n';
+                return;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, cache_path, ec);
+        if (ec)
+            std::cerr << "Warning: could not write data cache " << cache_path << '\n';
+    }
+
     std::string name_;
     std::vector<double> wavelength_;
     std::vector<double> n_;
     std::vector<double> k_;
+
+    mutable std::vector<double> omega_;
+    mutable std::vector<double> energy_;
+    mutable std::pair<std::vector<double>, std::vector<double>> epsilon_;
+    mutable bool omega_valid_ = false;
+    mutable bool energy_valid_ = false;
+    mutable bool epsilon_valid_ = false;
+    mutable MonotoneCubic n_interpolant_;
+    mutable MonotoneCubic k_interpolant_;
+    mutable ResampledSpectrum resampled_;
 };
 
-class Plot {
-public:
+// Replaces the data of 'material' by its resampled grid when resample_points is set.
+void applyResampling(Material& material, bool verbose = true) {
+    if (resample_points == 0)
+        return;
+    material = material.resampled(resample_points, resample_energy_min, resample_energy_max);
+    if (verbose) {
+        const std::vector<double>& energy = material.getEnergy();
+        std::cout << "Resampled to " << resample_points << " points evenly spaced in energy between "
+                  << energy.back() << " and " << energy.front() << " eV\n";
+    }
+}
 
-    // Plots two datasets (i.e. real and imaginary parts of refractive index) against x axis (i.e. wavelength).
-    static void dispersionPlot(const int number,
-                               const std::vector<double>& x,
-                               const std::vector<double>& y1, const std::vector<double>& y2,
-                               const std::string& title = " ",
-                               const std::string& labelx = " ", const std::string& labely = " ", 
-                               const std::string& legend1 = "Real", const std::string& legend2 = "Imag",
-                               const std::string& linestyle = "-"){
-        plt::figure(number);
-        plt::named_plot(legend1, x, y1, linestyle);
-        plt::named_plot(legend2, x, y2, linestyle);
-        plt::title(title);
-        plt::xlabel(labelx);
-        plt::ylabel(labely);
-        plt::legend(); 
+// In-place iterative radix-2 FFT of a power-of-two length sequence (inverse: conjugate
+// twiddles and 1/N scaling). The twiddles come from one table of N/2 roots (no error build-up
+// from repeated rotation), and the products are written out to avoid the NaN-checking
+// std::complex multiplication.
+void fft(std::vector<std::complex<double>>& a, bool inverse = false) {
+    const size_t n = a.size();
+    for (size_t i = 1, j = 0; i < n; ++i) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j |= bit;
+        if (i < j) std::swap(a[i], a[j]);
+    }
+    std::vector<double> cos_table (n / 2), sin_table (n / 2);
+    for (size_t k = 0; k < n / 2; ++k) {
+        const double angle = (inverse ? 2 : -2) * kPi * k / n;
+        cos_table[k] = std::cos(angle);
+        sin_table[k] = std::sin(angle);
+    }
+    double* data = reinterpret_cast<double*>(a.data());
+    for (size_t length = 2; length <= n; length <<= 1) {
+        const size_t half = length / 2, stride = n / length;
+        for (size_t start = 0; start < n; start += length) {
+            for (size_t k = 0; k < half; ++k) {
+                double* u = data + 2 * (start + k);
+                double* v = data + 2 * (start + k + half);
+                const double wr = cos_table[k * stride], wi = sin_table[k * stride];
+                const double vr = v[0] * wr - v[1] * wi, vi = v[0] * wi + v[1] * wr;
+                v[0] = u[0] - vr;
+                v[1] = u[1] - vi;
+                u[0] += vr;
+                u[1] += vi;
+            }
+        }
     }
+    if (inverse)
+        for (std::complex<double>& value : a) value /= static_cast<double>(n);
+}
+
+// Kramers–Kronig deviation of one energy band of the data.
+struct KKRegion {
+    double energy_min = 0.0, energy_max = 0.0;   // eV
+    size_t points = 0;
+    double rms = 0.0;           // RMS of (ε₁ − ε₁,KK)/|ε| over the band
+    double max = 0.0;           // largest |ε₁ − ε₁,KK|/|ε|
+    bool consistent = true;     // rms <= tolerance
 };
 
-// Drude model:
-// ε(ω) = ε∞ − ωp² / (ω² + iγω)
-std::complex<double> drude_eps(double omega , double eps_inf , double omega_p , double gamma){
-    std::complex<double> denom = {omega*omega, gamma*omega};
-    return eps_inf - (omega_p * omega_p)/denom;
-}
+// Outcome of kramersKronigCheck().
+struct KKCheckResult {
+    std::vector<KKRegion> regions;
+    size_t points = 0;          // uniform samples compared
+    double rms = 0.0;           // over all bands
+    double offset = 0.0;        // fitted background a + b/ω² (ω in rad/s) of the out-of-range absorption
+    double inverse_square = 0.0;
+    bool consistent = true;
+};
 
-// find error of data vs drude model
-double computeError (const std::vector<double>& omega , double eps_inf , double omega_p , double gamma, const std::vector<double>& eps1_data, const std::vector<double>& eps2_data){
-    std::complex<double> eps_model;
-    double error = 0.0;
-    for (size_t i = 0 ; i < omega.size() ; i++){
-        if (omega[i] < omega_min || omega[i] > omega_max)// Frequency window where Drude model is valid
-        continue;
-    eps_model = drude_eps(omega[i] , eps_inf , omega_p , gamma);
+// Kramers–Kronig consistency of the loaded n, k data: ε₁(ω) − 1 = (2/π) P∫ ω'ε₂(ω')/(ω'² − ω²) dω'.
+// ε₂ is resampled onto about 'points' uniform energies (Material::resample), extended as an odd
+// function of ω (continued linearly to 0 below the data and tapered to 0 above them, so the
+// data edges cause no log singularities) and Hilbert-transformed by FFT, O(N log N) instead of
+// the O(N²) direct integral. Absorption outside the measured range only adds a slowly varying
+// term to ε₁ in range; it is modelled as a + b/ω² and fitted by least squares. The remaining
+// deviation from the measured ε₁, normalized by |ε| like the fit error, is reported for
+// 'regions' equal energy bands; a band is inconsistent when its RMS exceeds 'tolerance'.
+KKCheckResult kramersKronigCheck(const Material& material, size_t points, size_t regions, double tolerance) {
+    ScopedTimer timer ("kk_check");
+    const std::vector<double>& energy = material.getEnergy();
+    auto [lowest, highest] = std::minmax_element(energy.begin(), energy.end());
+    const double e_lo = *lowest, e_hi = *highest;
+    if (!(e_hi > e_lo) || points < 8 || regions == 0)
+        throw std::runtime_error("Error: The Kramers-Kronig check needs a data range and at least 8 points");
 
-    // Normalized least-squares error:
-    // Σ [ (Re_model − Re_data)² + (Im_model − Im_data)² ] / (|ε_data|²)
-    double real_error = std::real(eps_model) - eps1_data[i];
-    double img_error = std::imag(eps_model)  - eps2_data[i];
+    // Uniform grid j*de from 0; the data cover j = first ... last
+    const size_t last = static_cast<size_t>(std::ceil((points - 1) * e_hi / (e_hi - e_lo)));
+    const double de = e_hi / last;
+    const size_t first = static_cast<size_t>(std::ceil(e_lo / de - 1e-9));
+    const ResampledSpectrum& r = material.resample(last - first + 1, first * de, last * de);
+    const size_t count = r.energy.size();
+    std::vector<double> eps1 (count), eps2 (count);
+    for (size_t i = 0; i < count; ++i) {
+        eps1[i] = r.n[i] * r.n[i] - r.k[i] * r.k[i];
+        eps2[i] = 2 * r.n[i] * r.k[i];
+    }
 
-    double norm = eps1_data[i]*eps1_data[i] + eps2_data[i]*eps2_data[i] + 1e-12;
-    error += (real_error*real_error + img_error*img_error) / norm;
+    // Odd extension over 2L samples, zero padded to twice the data range against wrap-around
+    size_t half = 1;
+    while (half < 2 * (last + 1)) half <<= 1;
+    std::vector<std::complex<double>> f (2 * half);
+    for (size_t j = 1; j < half; ++j) {
+        double value;
+        if (j < first)
+            value = eps2.front() * j / first;
+        else if (j <= last)
+            value = eps2[j - first];
+        else {
+            const double x = kPi / 2 * (j - last) / (half - last);
+            value = eps2.back() * std::cos(x) * std::cos(x);
+        }
+        f[j] = value;
+        f[2 * half - j] = -value;
     }
-    return error;
-}
+    // ε₁ − 1 = −H[ε₂], H[f] having the spectrum −i·sgn(k) F(k)
+    fft(f);
+    for (size_t k = 1; k < 2 * half; ++k)
+        f[k] *= std::complex<double>(0.0, k < half ? -1.0 : (k > half ? 1.0 : 0.0));
+    f[0] = 0.0;
+    fft(f, true);
 
+    // Background a + b/ω² by least squares (ω in units of the top energy for conditioning)
+    std::vector<double> residual (count), scale (count), u (count);
+    double s00 = 0, s01 = 0, s11 = 0, t0 = 0, t1 = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const double kk = 1.0 - f[first + i].real();
+        const double x = r.energy[i] / e_hi;
+        u[i] = 1.0 / (x * x);
+        residual[i] = eps1[i] - kk;
+        scale[i] = 1.0 / std::hypot(eps1[i], eps2[i]);
+        const double w = scale[i] * scale[i];
+        s00 += w; s01 += w * u[i]; s11 += w * u[i] * u[i];
+        t0 += w * residual[i]; t1 += w * residual[i] * u[i];
+    }
+    const double det = s00 * s11 - s01 * s01;
+    const double a = det != 0.0 ? (t0 * s11 - t1 * s01) / det : 0.0;
+    const double b = det != 0.0 ? (t1 * s00 - t0 * s01) / det : 0.0;
 
-int main() {
+    KKCheckResult result;
+    result.points = count;
+    result.offset = a;
+    const double omega_hi = r.omega.back();
+    result.inverse_square = b * omega_hi * omega_hi;
+    result.regions.resize(regions);
+    const double band = (e_hi - e_lo) / regions;
+    for (size_t g = 0; g < regions; ++g) {
+        result.regions[g].energy_min = e_lo + g * band;
+        result.regions[g].energy_max = e_lo + (g + 1) * band;
+    }
+    double total = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        const double deviation = (residual[i] - a - b * u[i]) * scale[i];
+        KKRegion& region = result.regions[std::min(regions - 1, static_cast<size_t>((r.energy[i] - e_lo) / band))];
+        region.points++;
+        region.rms += deviation * deviation;
+        region.max = std::max(region.max, std::fabs(deviation));
+        total += deviation * deviation;
+    }
+    for (KKRegion& region : result.regions) {
+        region.rms = region.points ? std::sqrt(region.rms / region.points) : 0.0;
+        region.consistent = region.rms <= tolerance;
+        result.consistent = result.consistent && region.consistent;
+    }
+    result.rms = std::sqrt(total / count);
+    return result;
+}
 
-    // Default for this version of the code.
-    PlotLevel plotLevel = PlotLevel::Advanced;  // Change Advanced to Basic to display the version 1 figures.
+// The kk_check pipeline stage: checks 'material' when enabled and prints the bands (verbose).
+// False when the data have to be rejected.
+bool checkKramersKronig(const Material& material, bool verbose = true) {
+    if (kk_check == KKCheck::Off)
+        return true;
+    KKCheckResult kk = kramersKronigCheck(material, kk_points, kk_regions, kk_tolerance);
+    if (verbose) {
+        std::cout << "\n***Kramers-Kronig check***\n" << kk.points << " uniform points, out-of-range background "
+                  << kk.offset << " + (" << kk.inverse_square << " rad^2/s^2)/omega^2\n";
+        for (const KKRegion& region : kk.regions)
+            std::cout << region.energy_min << " - " << region.energy_max << " eV: rms deviation " << region.rms
+                      << ", max " << region.max << (region.consistent ? "" : "  (inconsistent)") << '\n';
+        std::cout << (kk.consistent ? "Consistent" : "Not consistent") << " within kk_tolerance " << kk_tolerance << '\n';
+    }
+    return kk.consistent || kk_check != KKCheck::Reject;
+}
 
-    Material Ag ("Silver");
-    Ag.loadData("data/Ag_Palik_400-900nm.txt");
-    std::string name = Ag.getName();
-    std::vector<double> wl = Ag.getWavelength();
-    std::vector<double> n = Ag.getN();
-    std::vector<double> k = Ag.getK();
-    std::vector<double> energy = Ag.getEnergy();
-    std::vector<double> omega = Ag.getOmega();
-
-    std::pair<std::vector<double>, std::vector<double>> eps = Ag.computeEpsilon();
-    std::vector<double> eps1_data = eps.first;
-    std::vector<double> eps2_data = eps.second;
-    
-    // Grid search over plasma frequency and damping rate
-    // to minimize squared error between experimental and model permittivity
-    double best_error = 1e300;
-    double best_omega_p = 0.0;
-    double best_gamma = 0.0;
-    for (double omega_p = omega_p_min ; omega_p < omega_p_max ; omega_p+=domega_p){
-        for (double gamma = gamma_min ; gamma < gamma_max ; gamma+=dgamma){
-            double err = computeError(omega, eps_inf, omega_p, gamma, eps1_data, eps2_data);
-            if (err < best_error){
-                best_error = err;
-                best_omega_p = omega_p;
-                best_gamma = gamma;
-            }
+// Min/max decimation for plotting.
+// The samples are split into equal buckets; each bucket keeps only the points where y1 or y2
+// reach their minimum or maximum (in x order), plus the first and last sample overall. Peaks
+// and edges, such as the interband edge in ε₂, therefore survive in both series, which share
+// one x array. At most about max_points points remain.
+void decimateMinMax(const std::vector<double>& x, const std::vector<double>& y1, const std::vector<double>& y2,
+                    size_t max_points,
+                    std::vector<double>& x_out, std::vector<double>& y1_out, std::vector<double>& y2_out) {
+    const size_t n = std::min({x.size(), y1.size(), y2.size()});
+    x_out.clear();
+    y1_out.clear();
+    y2_out.clear();
+    auto keep = [&](size_t i) {
+        x_out.push_back(x[i]);
+        y1_out.push_back(y1[i]);
+        y2_out.push_back(y2[i]);
+    };
+    if (max_points == 0 || n <= std::max<size_t>(max_points, 6)) {
+        for (size_t i = 0; i < n; ++i) keep(i);
+        return;
+    }
+
+    const size_t interior = n - 2;
+    const size_t buckets = (max_points - 2) / 4;
+    x_out.reserve(4 * buckets + 2);
+    y1_out.reserve(4 * buckets + 2);
+    y2_out.reserve(4 * buckets + 2);
+    keep(0);
+    for (size_t b = 0; b < buckets; ++b) {
+        const size_t begin = 1 + interior * b / buckets;
+        const size_t end   = 1 + interior * (b + 1) / buckets;
+        if (begin == end)
+            continue;
+        size_t picks[4] = {begin, begin, begin, begin};   // argmin/argmax of y1, argmin/argmax of y2
+        for (size_t i = begin + 1; i < end; ++i) {
+            if (y1[i] < y1[picks[0]]) picks[0] = i;
+            if (y1[i] > y1[picks[1]]) picks[1] = i;
+            if (y2[i] < y2[picks[2]]) picks[2] = i;
+            if (y2[i] > y2[picks[3]]) picks[3] = i;
         }
+        std::sort(picks, picks + 4);
+        for (int p = 0; p < 4; ++p)
+            if (p == 0 || picks[p] != picks[p - 1]) keep(picks[p]);
     }
+    keep(n - 1);
+}
 
-    // Reporting best parameters found in the grid search
-    std::cout << "\n***Drude model***\nFitted only within "
-          << omega_min << " < omega < " << omega_max << " rad/s with the following fitting parameters:\n";
-    std::cout << "omega_p: " << best_omega_p << "  rad/sec \n";
-    std::cout << "gamma: " << best_gamma << "  1/s \n";
+// One figure layer handed from Plot::dispersionPlot() to the render thread.
+struct PlotDataset {
+    int number;
+    std::vector<double> x, y1, y2;
+    std::string title, labelx, labely, legend1, legend2, linestyle;
+};
 
-    std::cout << "Best normalized error is : " << best_error << '\n';
-    
-    // Calculating the model permittivities based on the best fitting parameters
-    std::vector<std::complex<double>> eps_model(omega.size());
-    for(size_t i = 0; i<omega.size(); i++){
-        eps_model[i]= drude_eps(omega[i], eps_inf, best_omega_p, best_gamma);
+#ifndef METAL_DISPERSION_HEADLESS
+// Dedicated render thread that owns the embedded Python interpreter.
+// Every matplotlib call, including interpreter start-up and shutdown, runs on this one
+// thread, so the GIL never changes hands; the calling thread only queues finished datasets
+// and carries on (loading or fitting) while Python starts and the figures are built.
+class PlotRenderer {
+public:
+    static PlotRenderer& instance() {
+        static PlotRenderer renderer;
+        return renderer;
     }
 
-    std::vector<double> eps1_model(eps_model.size());
-    std::vector<double> eps2_model(eps_model.size());
-    for (size_t i = 0; i < omega.size(); i++){
-    eps1_model[i] = eps_model[i].real();
-    eps2_model[i] = eps_model[i].imag();
+    // Starts the render thread and the interpreter ahead of the first plot.
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!thread_.joinable())
+            thread_ = std::thread([this] { render(); });
     }
 
-    // Plotting the results
-    if (plotLevel == PlotLevel::Advanced) {
-        Plot::dispersionPlot(1, energy, eps1_model, eps2_model,
-                           "Drude Fit vs Palik Data (" + name + ")" + " ",
-                           "energy  (eV)", "Permittivity (ε)",
-                           "ε₁ Drude fit", "ε₂ Drude fit",
-                           "--");
-
+    void submit(PlotDataset dataset) {
+        start();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push(std::move(dataset));
+        }
+        ready_.notify_one();
+    }
 
-        Plot::dispersionPlot(1, energy, eps1_data, eps2_data,
-                           "Drude Fit vs Palik Data (" + name + ")" + " ",
-                           "energy  (eV)", "Permittivity (ε)",
-                           "ε₁ data", "ε₂ data");
+    // Renders everything queued, shows the figures (blocking until they are closed),
+    // shuts the interpreter down and joins the render thread.
+    void showAndWait() {
+        if (!thread_.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            show_ = true;
+        }
+        ready_.notify_one();
+        thread_.join();
     }
 
-    if (plotLevel == PlotLevel::Basic) {   
-        Plot::dispersionPlot(1, wl, n, k,
-                            "Refractive Index of " + name + " (Palik, 400–900 nm)",
-                            "Wavelength λ (nm)", "Refractive index (n)",
-                            "n data", "k data");
+private:
+    PlotRenderer() = default;
 
-        Plot::dispersionPlot(2, wl, eps1_data, eps2_data,
-                            "Complex Permittivity of " + name + " (Palik, 400–900 nm)",
-                            "Wavelength λ (nm)", "Permittivity (ε)",
-                            "ε₁ data", "ε₂ data");
+    ~PlotRenderer() {
+        if (thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                show_ = true;
+            }
+            ready_.notify_one();
+            thread_.join();
+        }
     }
 
-    std::cout << "\nDispersion analysis complete. Figures displayed successfully.\n"
-              << "*************************************************************";
-    plt::show();
-
-    return 0;
-}
\ No newline at end of file
+    void render() {
+        bool started = false;
+        bool failed = false;
+        try {
+            ScopedTimer timer ("python_start");
+            plt::detail::_interpreter::get();
+            started = true;
+        } catch (const std::exception& e) {
+            std::cerr << "\nPlotting disabled: " << e.what() << '\n';
+            failed = true;
+        }
+        while (true) {
+            PlotDataset d;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return show_ || !queue_.empty(); });
+                if (queue_.empty())
+                    break;
+                d = std::move(queue_.front());
+                queue_.pop();
+            }
+            if (failed)
+                continue;
+            ScopedTimer timer ("plot_render");
+            try {
+                plt::figure(d.number);
+                plt::named_plot(d.legend1, d.x, d.y1, d.linestyle);
+                plt::named_plot(d.legend2, d.x, d.y2, d.linestyle);
+                plt::title(d.title);
+                plt::xlabel(d.labelx);
+                plt::ylabel(d.labely);
+                plt::legend();
+            } catch (const std::exception& e) {
+                std::cerr << "\nPlotting failed: " << e.what() << '\n';
+                failed = true;
+            }
+        }
+        if (!failed) {
+            try {
+                plt::show();
+            } catch (const std::exception& e) {
+                std::cerr << "\nPlotting failed: " << e.what() << '\n';
+            }
+        }
+        // The interpreter must be finalized by the thread that holds the GIL
+        if (started)
+            plt::detail::_interpreter::kill();
+    }
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::queue<PlotDataset> queue_;
+    bool show_ = false;
+};
+#endif
+
+class Plot {
+public:
+
+    // Starts the plotting back end early (Python start-up then overlaps with the fit).
+    static void prepare(){
+#ifndef METAL_DISPERSION_HEADLESS
+        if (!headless)
+            PlotRenderer::instance().start();
+#endif
+    }
+
+    // Plots two datasets (i.e. real and imaginary parts of refractive index) against x axis (i.e. wavelength).
+    // Series longer than plot_max_points are decimated first; the (reduced) data are then
+    // copied and drawn asynchronously on the render thread.
+    static void dispersionPlot(const int number,
+                               const std::vector<double>& x,
+                               const std::vector<double>& y1, const std::vector<double>& y2,
+                               const std::string& title = " ",
+                               const std::string& labelx = " ", const std::string& labely = " ", 
+                               const std::string& legend1 = "Real", const std::string& legend2 = "Imag",
+                               const std::string& linestyle = "-"){
+#ifndef METAL_DISPERSION_HEADLESS
+        if (headless)
+            return;
+        ScopedTimer timer ("plot_queue");
+        PlotDataset dataset {number, {}, {}, {}, title, labelx, labely, legend1, legend2, linestyle};
+        decimateMinMax(x, y1, y2, plot_max_points, dataset.x, dataset.y1, dataset.y2);
+        PlotRenderer::instance().submit(std::move(dataset));
+#else
+        (void)number; (void)x; (void)y1; (void)y2; (void)title; (void)labelx; (void)labely;
+        (void)legend1; (void)legend2; (void)linestyle;
+#endif
+    }
+
+    // Displays all figures and waits until they are closed; does nothing in headless mode.
+    static void show(){
+#ifndef METAL_DISPERSION_HEADLESS
+        if (!headless)
+            PlotRenderer::instance().showAndWait();
+#endif
+    }
+};
+
+// Drude model:
+// ε(ω) = ε∞ − ωp² / (ω² + iγω)
+std::complex<double> drude_eps(double omega , double eps_inf , double omega_p , double gamma){
+    std::complex<double> denom = {omega*omega, gamma*omega};
+    return eps_inf - (omega_p * omega_p)/denom;
+}
+
+// Lorentz oscillator for an interband transition: Δε ω0² / (ω0² − ω² − iΓω)
+struct LorentzOscillator {
+    double strength;   // Δε
+    double omega0;     // resonance frequency ω0 (rad/s)
+    double gamma;      // width Γ (s^-1)
+};
+
+// Starting oscillators of the Drude–Lorentz fit (ModelType::DrudeLorentz). The default is a
+// single transition above the 400–900 nm range, near the 4 eV interband edge of Ag and Au.
+std::vector<LorentzOscillator> lorentz_seed = {{1.0, 6.5e15, 1.0e15}};
+
+// Drude–Lorentz model:
+// ε(ω) = ε∞ − ωp² / (ω² + iγω) + Σⱼ Δεⱼ ω0ⱼ² / (ω0ⱼ² − ω² − iΓⱼω)
+// Without oscillators this is drude_eps().
+std::complex<double> drude_lorentz_eps(double omega , double eps_inf , double omega_p , double gamma,
+                                       const std::vector<LorentzOscillator>& oscillators){
+    std::complex<double> eps = drude_eps(omega, eps_inf, omega_p, gamma);
+    for (const LorentzOscillator& o : oscillators) {
+        double w02 = o.omega0 * o.omega0;
+        eps += o.strength * w02 / std::complex<double>(w02 - omega*omega, -o.gamma*omega);
+    }
+    return eps;
+}
+
+// Dispersion model policies for the generic kernels and fitter.
+// Each model fixes its parameter count kParams at compile time, so parameter vectors, Jacobian
+// rows and normal matrices are std::arrays on the stack, and its per-sample functions are
+// inlined into the sample loops (no virtual call per sample). A policy provides
+//   eps(x, ω, ω², 1/ω, re, im)          model ε at one sample
+//   derivatives(x, ω, ω², 1/ω, d1, d2)  ∂Re ε/∂xᵢ and ∂Im ε/∂xᵢ at one sample, i < kParams
+//   feasible(x)                         parameter bounds enforced by the fitter
+// and the index kEpsInf of ε∞ among its parameters.
+
+// Drude model, parameters (ωp, γ, ε∞). Closed forms with d = ω² + γ²:
+//   Re ε = ε∞ − ωp²/d,  Im ε = ωp²γ/(ωd)
+struct DrudeModel {
+    static constexpr size_t kParams = 3;
+    static constexpr size_t kEpsInf = 2;
+    static constexpr const char* name = "Drude";
+    using Params = std::array<double, kParams>;
+
+    static void eps(const Params& x, double w, double w2, double inv_w, double& re, double& im) {
+        (void)w;
+        const double wp2 = x[0] * x[0];
+        const double inv_d = 1.0 / (w2 + x[1] * x[1]);
+        re = x[2] - wp2 * inv_d;
+        im = wp2 * x[1] * inv_d * inv_w;
+    }
+
+    // ∂ε/∂ωp = (−2ωp/d, 2ωpγ/(ωd)),  ∂ε/∂γ = (2ωp²γ/d², ωp²(ω² − γ²)/(ωd²)),  ∂ε/∂ε∞ = (1, 0)
+    static void derivatives(const Params& x, double w, double w2, double inv_w, double* d1, double* d2) {
+        (void)w;
+        const double wp = x[0], g = x[1];
+        const double inv_d = 1.0 / (w2 + g * g);
+        d1[0] = -2.0 * wp * inv_d;
+        d2[0] = 2.0 * wp * g * inv_d * inv_w;
+        d1[1] = 2.0 * wp * wp * g * inv_d * inv_d;
+        d2[1] = wp * wp * (w2 - g * g) * inv_d * inv_d * inv_w;
+        d1[2] = 1.0;
+        d2[2] = 0.0;
+    }
+
+    static bool feasible(const Params& x) {
+        return x[0] > 0.0 && x[1] > 0.0;
+    }
+};
+
+// N Lorentz oscillators stored as (Δε, ω0, Γ) triples from parameter index Offset on.
+// With dr = ω0² − ω², di = Γω, Q = dr² + di² and s = Δε ω0²:
+//   ε = s (dr + i·di)/Q
+//   ∂ε/∂Δε = ω0² (dr + i·di)/Q,  ∂ε/∂ω0 = −2ω0Δε (ω² + i·di)/D²,  ∂ε/∂Γ = iωs/D²
+// where 1/D² = (dr² − di² + 2i·dr·di)/Q².
+template <size_t N, size_t Offset>
+struct LorentzTerms {
+    template <class Params>
+    static void add(const Params& x, double w, double w2, double& re, double& im) {
+        for (size_t j = 0; j < N; ++j) {
+            const double strength = x[Offset + 3*j], w0 = x[Offset + 3*j + 1], width = x[Offset + 3*j + 2];
+            const double w02 = w0 * w0;
+            const double dr = w02 - w2;
+            const double di = width * w;
+            const double s = strength * w02 / (dr*dr + di*di);
+            re += s * dr;
+            im += s * di;
+        }
+    }
+
+    template <class Params>
+    static void derivatives(const Params& x, double w, double w2, double* d1, double* d2) {
+        for (size_t j = 0; j < N; ++j) {
+            const size_t k = Offset + 3*j;
+            const double strength = x[k], w0 = x[k + 1], width = x[k + 2];
+            const double w02 = w0 * w0;
+            const double dr = w02 - w2;
+            const double di = width * w;
+            const double inv_q = 1.0 / (dr*dr + di*di);
+            const double u = (dr*dr - di*di) * inv_q * inv_q;   // Re 1/D²
+            const double v = 2.0 * dr * di * inv_q * inv_q;     // Im 1/D²
+            const double s = strength * w02;
+            d1[k] = w02 * dr * inv_q;
+            d2[k] = w02 * di * inv_q;
+            d1[k + 1] = -2.0 * w0 * strength * (w2 * u - di * v);
+            d2[k + 1] = -2.0 * w0 * strength * (w2 * v + di * u);
+            d1[k + 2] = -s * w * v;
+            d2[k + 2] = s * w * u;
+        }
+    }
+
+    // ω0 and Γ positive, strengths non-negative.
+    template <class Params>
+    static bool feasible(const Params& x) {
+        for (size_t j = 0; j < N; ++j)
+            if (!(x[Offset + 3*j] >= 0.0 && x[Offset + 3*j + 1] > 0.0 && x[Offset + 3*j + 2] > 0.0))
+                return false;
+        return true;
+    }
+};
+
+// Drude–Lorentz model with N oscillators, parameters (ωp, γ, ε∞, Δε₁, ω0₁, Γ₁, …): 3N+3 in total.
+template <size_t N>
+struct DrudeLorentzModel {
+    static constexpr size_t kOscillators = N;
+    static constexpr size_t kParams = 3 + 3 * N;
+    static constexpr size_t kEpsInf = 2;
+    static constexpr const char* name = "DrudeLorentz";
+    using Params = std::array<double, kParams>;
+    using Oscillators = LorentzTerms<N, 3>;
+
+    static void eps(const Params& x, double w, double w2, double inv_w, double& re, double& im) {
+        const double wp2 = x[0] * x[0];
+        const double inv_d = 1.0 / (w2 + x[1] * x[1]);
+        re = x[2] - wp2 * inv_d;
+        im = wp2 * x[1] * inv_d * inv_w;
+        Oscillators::add(x, w, w2, re, im);
+    }
+
+    static void derivatives(const Params& x, double w, double w2, double inv_w, double* d1, double* d2) {
+        DrudeModel::derivatives({x[0], x[1], x[2]}, w, w2, inv_w, d1, d2);
+        Oscillators::derivatives(x, w, w2, d1, d2);
+    }
+
+    // Also ε∞ >= 1: when the data stop below the interband edge, an oscillator can otherwise
+    // drift to ω0 → ∞ while its strength and −ε∞ grow without limit.
+    static bool feasible(const Params& x) {
+        return x[0] > 0.0 && x[1] > 0.0 && x[2] >= 1.0 && Oscillators::feasible(x);
+    }
+};
+
+// Lorentz oscillators only (insulators, or interband terms alone), parameters (ε∞, Δε₁, ω0₁, Γ₁, …).
+template <size_t N>
+struct LorentzModel {
+    static constexpr size_t kOscillators = N;
+    static constexpr size_t kParams = 1 + 3 * N;
+    static constexpr size_t kEpsInf = 0;
+    static constexpr const char* name = "Lorentz";
+    using Params = std::array<double, kParams>;
+    using Oscillators = LorentzTerms<N, 1>;
+
+    static void eps(const Params& x, double w, double w2, double inv_w, double& re, double& im) {
+        (void)inv_w;
+        re = x[0];
+        im = 0.0;
+        Oscillators::add(x, w, w2, re, im);
+    }
+
+    static void derivatives(const Params& x, double w, double w2, double inv_w, double* d1, double* d2) {
+        (void)inv_w;
+        d1[0] = 1.0;
+        d2[0] = 0.0;
+        Oscillators::derivatives(x, w, w2, d1, d2);
+    }
+
+    static bool feasible(const Params& x) {
+        return x[0] >= 1.0 && Oscillators::feasible(x);
+    }
+};
+
+// find error of data vs drude model
+// (reference version on the full arrays; the fitters use the FitProblem overload below)
+double computeError (const std::vector<double>& omega , double eps_inf , double omega_p , double gamma, const std::vector<double>& eps1_data, const std::vector<double>& eps2_data){
+    std::complex<double> eps_model;
+    double error = 0.0;
+    for (size_t i = 0 ; i < omega.size() ; i++){
+        if (omega[i] < omega_min || omega[i] > omega_max)// Frequency window where Drude model is valid
+        continue;
+    eps_model = drude_eps(omega[i] , eps_inf , omega_p , gamma);
+
+    // Normalized least-squares error:
+    // Σ [ (Re_model − Re_data)² + (Im_model − Im_data)² ] / (|ε_data|²)
+    double real_error = std::real(eps_model) - eps1_data[i];
+    double img_error = std::imag(eps_model)  - eps2_data[i];
+
+    double norm = eps1_data[i]*eps1_data[i] + eps2_data[i]*eps2_data[i] + 1e-12;
+    error += (real_error*real_error + img_error*img_error) / norm;
+    }
+    return error;
+}
+
+// Fitting data prepared once from a Material.
+// Only the samples inside the fitting window are kept, as contiguous arrays, together with
+// their least-squares weights 1/|ε_data|². The objective loops therefore need neither the
+// window test nor the norm computation and run branch-free over every stored sample.
+struct FitProblem {
+    std::vector<double> omega;    // ω (rad/s)
+    std::vector<double> omega2;   // ω²
+    std::vector<double> eps1;     // measured ε₁
+    std::vector<double> eps2;     // measured ε₂
+    std::vector<double> weight;   // 1 / (ε₁² + ε₂² + 1e-12)
+    std::vector<double> inv_omega;  // 1/ω
+    double weight_sum = 0.0;        // Σ weight
+
+    FitProblem() = default;
+
+    FitProblem(const std::vector<double>& omega_data,
+               const std::vector<double>& eps1_data, const std::vector<double>& eps2_data,
+               double window_min = omega_min, double window_max = omega_max) {
+        addWindow(omega_data, eps1_data, eps2_data, window_min, window_max);
+    }
+
+    FitProblem(const Material& material, double window_min = omega_min, double window_max = omega_max) {
+        addWindow(material, window_min, window_max);
+    }
+
+    // Appends the samples with window_min <= ω <= window_max.
+    void addWindow(const std::vector<double>& omega_data,
+                   const std::vector<double>& eps1_data, const std::vector<double>& eps2_data,
+                   double window_min, double window_max) {
+        for (size_t i = 0; i < omega_data.size(); ++i)
+            if (omega_data[i] >= window_min && omega_data[i] <= window_max)
+                add(omega_data[i], eps1_data[i], eps2_data[i]);
+    }
+
+    void addWindow(const Material& material, double window_min, double window_max) {
+        addWindow(material.getOmega(), material.computeEpsilon().first, material.computeEpsilon().second,
+                  window_min, window_max);
+    }
+
+    void add(double w, double e1, double e2) {
+        omega.push_back(w);
+        omega2.push_back(w * w);
+        eps1.push_back(e1);
+        eps2.push_back(e2);
+        weight.push_back(1.0 / (e1*e1 + e2*e2 + 1e-12));
+        inv_omega.push_back(1.0 / w);
+        weight_sum += weight.back();
+    }
+
+    size_t size() const {
+        return omega.size();
+    }
+
+    // Removes all samples, keeping the allocated capacity.
+    void clear() {
+        for (std::vector<double>* values : {&omega, &omega2, &eps1, &eps2, &weight, &inv_omega})
+            values->clear();
+        weight_sum = 0.0;
+    }
+};
+
+// Sequential reader returning a data file in chunks of at most chunk_points points.
+// The file is read through a fixed-size buffer, so memory use does not depend on the
+// file size. Lines follow the same rules as Material::loadData().
+class SpectrumReader {
+public:
+    SpectrumReader(const std::string& filename, size_t chunk_points = 1 << 16)
+        : filename_(filename), chunk_points_(std::max<size_t>(chunk_points, 1)), buffer_(1 << 20) {
+        file_ = std::fopen(filename.c_str(), "rb");
+        if (!file_) {
+            throw std::runtime_error("Error: Could not open file " + filename);
+        }
+    }
+
+    ~SpectrumReader() {
+        std::fclose(file_);
+    }
+
+    SpectrumReader(const SpectrumReader&) = delete;
+    SpectrumReader& operator=(const SpectrumReader&) = delete;
+
+    // Replaces the data of 'chunk' by the next points of the file; false once the file is exhausted.
+    bool next(Material& chunk) {
+        chunk.clearData();
+        size_t count = 0;
+        const char* first;
+        const char* last;
+        while (count < chunk_points_ && nextLine(first, last)) {
+            ++line_number_;
+            double values[3];
+            int status = parseDataLine(first, last, values);
+            if (status < 0) {
+                throw std::runtime_error("Error: Malformed data on line " + std::to_string(line_number_)
+                                         + " of " + filename_ + ": '" + std::string(first, last) + "'");
+            }
+            if (status > 0) {
+                chunk.addPoint(values[0], values[1], values[2]);
+                ++count;
+            }
+        }
+        points_ += count;
+        Profiler::count(Profiler::PointsParsed, count);
+        return count > 0;
+    }
+
+    // Number of points returned so far.
+    size_t points() const {
+        return points_;
+    }
+
+private:
+    // Next line without its '\n'; the pointers stay valid until the next call.
+    bool nextLine(const char*& first, const char*& last) {
+        while (true) {
+            char* data = buffer_.data();
+            const char* eol = static_cast<const char*>(std::memchr(data + pos_, '\n', end_ - pos_));
+            if (eol) {
+                first = data + pos_;
+                last = eol;
+                pos_ = eol - data + 1;
+                return true;
+            }
+            if (eof_) {
+                if (pos_ == end_)
+                    return false;
+                first = data + pos_;
+                last = data + end_;
+                pos_ = end_;
+                return true;
+            }
+            // Keep the partial line, then refill; grow only for a line longer than the buffer
+            std::memmove(data, data + pos_, end_ - pos_);
+            end_ -= pos_;
+            pos_ = 0;
+            if (end_ == buffer_.size())
+                buffer_.resize(2 * buffer_.size());
+            size_t got = std::fread(buffer_.data() + end_, 1, buffer_.size() - end_, file_);
+            end_ += got;
+            eof_ = (got == 0);
+        }
+    }
+
+    std::string filename_;
+    size_t chunk_points_;
+    std::FILE* file_ = nullptr;
+    std::vector<char> buffer_;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+    bool eof_ = false;
+    size_t line_number_ = 0;
+    size_t points_ = 0;
+};
+
+// Streaming pipeline: reads 'filename' chunk by chunk, computes ω and ε per chunk and keeps
+// only the samples inside the fitting window. Peak memory is one chunk plus the window data.
+FitProblem streamFitProblem(const std::string& name, const std::string& filename,
+                            size_t chunk_points = 1 << 16,
+                            double window_min = omega_min, double window_max = omega_max,
+                            bool verbose = true) {
+    ScopedTimer timer ("stream");
+    SpectrumReader reader (filename, chunk_points);
+    Material chunk (name);
+    FitProblem problem;
+    while (reader.next(chunk)) {
+        problem.addWindow(chunk, window_min, window_max);
+    }
+    if (reader.points() == 0) {
+        throw std::runtime_error("Error: No data points found in " + filename);
+    }
+    if (verbose) {
+        std::cout << "\n***Imported data information***\nStreamed "<< reader.points() << " data points for " << name
+                  << ", " << problem.size() << " inside the fitting window\n";
+    }
+    return problem;
+}
+
+// Residual kernels for the Drude model.
+// Instead of the complex division in drude_eps(), the kernels use the closed form
+//   Re ε = ε∞ − ωp² / (ω² + γ²),   Im ε = ωp²γ / (ω (ω² + γ²))
+// on the FitProblem arrays, which needs a single division per sample and vectorizes.
+// All kernels agree with the reference computeError() to within 1e-13 relative error
+// (about 3e-15 on the Palik Ag data). The differences come from rounding of the closed
+// form, FMA contraction and the lane-wise summation order.
+// The *FitEpsInf variants also accumulate Σ w·(Re ε − ε₁) and return the error at the best
+// ε∞ for each candidate (fitEpsInf()), for one extra FMA per sample.
+namespace kernels {
+
+// Batched evaluation: the samples are processed in blocks small enough to stay in L1
+// (5 arrays × 512 doubles = 20 KB), and every block is reused for all candidates of a
+// tile before moving on. Inside a block, groups of kGroup candidates share each loaded
+// sample vector (register blocking), so large spectra are streamed once per tile instead
+// of once per candidate.
+constexpr size_t kBlock = 512;
+constexpr size_t kGroup = 4;
+
+// Bounded (pruning) kernels: partial errors are compared with the bound every kCheck samples,
+// a whole number of SIMD vectors, for at most kBoundedTile candidates per call.
+constexpr size_t kCheck = 64;
+constexpr size_t kBoundedTile = 64;
+
+// Scalar kernel over samples [begin, end); also used for the tails of the SIMD kernels.
+// With Sums, Σ w·(Re ε − ε₁) is added to *re_sum as well (see fitEpsInf()).
+template <bool Sums = false>
+inline double drudeErrorRange(const FitProblem& p, size_t begin, size_t end,
+                              double eps_inf, double omega_p, double gamma, double* re_sum = nullptr) {
+    const double wp2 = omega_p * omega_p;
+    const double g2 = gamma * gamma;
+    const double wp2g = wp2 * gamma;
+    double error = 0.0;
+    double sum = 0.0;
+    for (size_t i = begin; i < end; ++i) {
+        double inv_d = 1.0 / (p.omega2[i] + g2);
+        double re = eps_inf - wp2 * inv_d - p.eps1[i];
+        double im = wp2g * inv_d * p.inv_omega[i] - p.eps2[i];
+        error += (re*re + im*im) * p.weight[i];
+        if constexpr (Sums)
+            sum += re * p.weight[i];
+    }
+    if constexpr (Sums)
+        *re_sum += sum;
+    return error;
+}
+
+// Shared tiling loop of the batch kernels. Range(begin, end, eps_inf, wp, g, re_sum*) evaluates
+// one candidate, Group(begin, end, eps_inf, wp*, g*, out*, re_sums*) adds kGroup candidates to
+// out (re_sum/re_sums are only used with Sums and are nullptr otherwise).
+template <bool Sums, class Range, class Group>
+inline void drudeErrorTile(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                           size_t count, double* errors, double* re_sums, Range range, Group group) {
+    for (size_t k = 0; k < count; ++k) {
+        errors[k] = 0.0;
+        if constexpr (Sums)
+            re_sums[k] = 0.0;
+    }
+    for (size_t begin = 0; begin < p.size(); begin += kBlock) {
+        const size_t end = std::min(begin + kBlock, p.size());
+        size_t k = 0;
+        for (; k + kGroup <= count; k += kGroup)
+            group(begin, end, eps_inf, omega_p + k, gamma + k, errors + k, Sums ? re_sums + k : nullptr);
+        for (; k < count; ++k)
+            errors[k] += range(begin, end, eps_inf, omega_p[k], gamma[k], Sums ? re_sums + k : nullptr);
+    }
+}
+
+// Bounded tiling loop: errors[k] is the exact error of candidate k (bit-identical to
+// drudeErrorTile()) if it does not exceed 'bound', and +inf otherwise. The weighted squares
+// are non-negative, so a partial sum above the bound proves the final error is above it too;
+// such candidates are abandoned, inside a block by the group kernel (a group is dropped when
+// all its candidates are above) and between blocks by compacting the surviving candidates.
+// Group(begin, end, eps_inf, wp*, g*, out*, bound) is a bounded kGroup kernel. Returns the
+// number of candidates rejected.
+template <class Group>
+inline size_t drudeErrorTileBounded(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                                    size_t count, double* errors, double bound, Group group) {
+    double wp[kBoundedTile + kGroup], g[kBoundedTile + kGroup], err[kBoundedTile + kGroup];
+    size_t index[kBoundedTile];
+    size_t active = std::min(count, kBoundedTile);
+    for (size_t k = 0; k < active; ++k) {
+        wp[k] = omega_p[k];
+        g[k] = gamma[k];
+        err[k] = 0.0;
+        index[k] = k;
+    }
+    for (size_t begin = 0; begin < p.size() && active > 0; begin += kBlock) {
+        const size_t end = std::min(begin + kBlock, p.size());
+        // Pad the last group with copies of the last candidate; their results are dropped.
+        const size_t padded = (active + kGroup - 1) / kGroup * kGroup;
+        for (size_t k = active; k < padded; ++k) {
+            wp[k] = wp[active - 1];
+            g[k] = g[active - 1];
+            err[k] = err[active - 1];
+        }
+        for (size_t k = 0; k < padded; k += kGroup)
+            group(begin, end, eps_inf, wp + k, g + k, err + k, bound);
+        size_t kept = 0;
+        for (size_t k = 0; k < active; ++k) {
+            if (err[k] > bound) {
+                errors[index[k]] = HUGE_VAL;
+                continue;
+            }
+            wp[kept] = wp[k];
+            g[kept] = g[k];
+            err[kept] = err[k];
+            index[kept] = index[k];
+            ++kept;
+        }
+        active = kept;
+    }
+    for (size_t k = 0; k < active; ++k)
+        errors[index[k]] = err[k];
+    return std::min(count, kBoundedTile) - active;
+}
+
+// The error is quadratic in ε∞: with R = Σ w·(Re ε − ε₁) at eps_inf and W = Σ w,
+//   E(eps_inf + δ) = E + 2δR + δ²W,
+// minimal at δ = −R/W with E − R²/W. Replaces error and re_sum by the error and ε∞ at that minimum.
+inline void fitEpsInf(const FitProblem& p, double eps_inf, double& error, double& re_sum) {
+    const double delta = -re_sum / p.weight_sum;
+    error = std::max(error + delta * re_sum, 0.0);
+    re_sum = eps_inf + delta;
+}
+
+// Error at (omega_p, gamma) with ε∞ fitted (see fitEpsInf()); the ε∞ goes to *eps_inf_out.
+template <class Range>
+inline double drudeErrorFitEpsInf(const FitProblem& p, double eps_inf, double omega_p, double gamma,
+                                  double* eps_inf_out, Range range) {
+    double sum = 0.0;
+    double error = range(0, p.size(), eps_inf, omega_p, gamma, &sum);
+    fitEpsInf(p, eps_inf, error, sum);
+    *eps_inf_out = sum;
+    return error;
+}
+
+inline void fitEpsInfTile(const FitProblem& p, double eps_inf, size_t count, double* errors, double* eps_inf_out) {
+    for (size_t k = 0; k < count; ++k)
+        fitEpsInf(p, eps_inf, errors[k], eps_inf_out[k]);
+}
+
+template <bool Sums>
+inline void drudeErrorsScalarT(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                               size_t count, double* errors, double* re_sums) {
+    auto range = [&p](size_t b, size_t e, double einf, double wp, double g, double* rs) {
+        return drudeErrorRange<Sums>(p, b, e, einf, wp, g, rs);
+    };
+    auto group = [&p](size_t b, size_t e, double einf, const double* wp, const double* g, double* out, double* rs) {
+        for (size_t c = 0; c < kGroup; ++c)
+            out[c] += drudeErrorRange<Sums>(p, b, e, einf, wp[c], g[c], Sums ? rs + c : nullptr);
+    };
+    drudeErrorTile<Sums>(p, eps_inf, omega_p, gamma, count, errors, re_sums, range, group);
+}
+
+// Scalar bounded group: the candidates are independent here, so each one is abandoned on its own.
+inline void drudeErrorGroupBoundedScalar(const FitProblem& p, size_t begin, size_t end, double eps_inf,
+                                         const double* omega_p, const double* gamma, double* out, double bound) {
+    for (size_t c = 0; c < kGroup; ++c) {
+        const double wp2 = omega_p[c] * omega_p[c];
+        const double g2 = gamma[c] * gamma[c];
+        const double wp2g = wp2 * gamma[c];
+        double error = 0.0;
+        for (size_t i = begin; i < end; ) {
+            for (const size_t stop = std::min(i + kCheck, end); i < stop; ++i) {
+                double inv_d = 1.0 / (p.omega2[i] + g2);
+                double re = eps_inf - wp2 * inv_d - p.eps1[i];
+                double im = wp2g * inv_d * p.inv_omega[i] - p.eps2[i];
+                error += (re*re + im*im) * p.weight[i];
+            }
+            if (i < end && out[c] + error > bound) {
+                error = HUGE_VAL;
+                break;
+            }
+        }
+        out[c] += error;
+    }
+}
+
+inline double drudeErrorScalar(const FitProblem& p, double eps_inf, double omega_p, double gamma) {
+    return drudeErrorRange(p, 0, p.size(), eps_inf, omega_p, gamma);
+}
+
+inline void drudeErrorsScalar(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                              size_t count, double* errors) {
+    drudeErrorsScalarT<false>(p, eps_inf, omega_p, gamma, count, errors, nullptr);
+}
+
+inline size_t drudeErrorsBoundedScalar(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                                       size_t count, double* errors, double bound) {
+    return drudeErrorTileBounded(p, eps_inf, omega_p, gamma, count, errors, bound, [&p](size_t b, size_t e, double einf,
+                                 const double* wp, const double* g, double* out, double bd) {
+        drudeErrorGroupBoundedScalar(p, b, e, einf, wp, g, out, bd);
+    });
+}
+
+inline double drudeErrorFitEpsInfScalar(const FitProblem& p, double eps_inf, double omega_p, double gamma,
+                                        double* eps_inf_out) {
+    auto range = [&p](size_t b, size_t e, double einf, double wp, double g, double* rs) {
+        return drudeErrorRange<true>(p, b, e, einf, wp, g, rs);
+    };
+    return drudeErrorFitEpsInf(p, eps_inf, omega_p, gamma, eps_inf_out, range);
+}
+
+inline void drudeErrorsFitEpsInfScalar(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                                       size_t count, double* errors, double* eps_inf_out) {
+    drudeErrorsScalarT<true>(p, eps_inf, omega_p, gamma, count, errors, eps_inf_out);
+    fitEpsInfTile(p, eps_inf, count, errors, eps_inf_out);
+}
+
+#ifdef METAL_DISPERSION_X86_SIMD
+template <bool Sums = false>
+__attribute__((target("avx2,fma")))
+inline double drudeErrorRangeAVX2(const FitProblem& p, size_t begin, size_t end,
+                                  double eps_inf, double omega_p, double gamma, double* re_sum = nullptr) {
+    const __m256d wp2 = _mm256_set1_pd(omega_p * omega_p);
+    const __m256d g2 = _mm256_set1_pd(gamma * gamma);
+    const __m256d wp2g = _mm256_set1_pd(omega_p * omega_p * gamma);
+    const __m256d einf = _mm256_set1_pd(eps_inf);
+    const __m256d one = _mm256_set1_pd(1.0);
+
+    __m256d acc = _mm256_setzero_pd();
+    __m256d sum = _mm256_setzero_pd();
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        const __m256d weight = _mm256_loadu_pd(&p.weight[i]);
+        __m256d inv_d = _mm256_div_pd(one, _mm256_add_pd(_mm256_loadu_pd(&p.omega2[i]), g2));
+        __m256d re = _mm256_sub_pd(_mm256_fnmadd_pd(wp2, inv_d, einf), _mm256_loadu_pd(&p.eps1[i]));
+        __m256d im = _mm256_fmsub_pd(_mm256_mul_pd(wp2g, inv_d), _mm256_loadu_pd(&p.inv_omega[i]),
+                                     _mm256_loadu_pd(&p.eps2[i]));
+        __m256d sq = _mm256_fmadd_pd(re, re, _mm256_mul_pd(im, im));
+        acc = _mm256_fmadd_pd(sq, weight, acc);
+        if constexpr (Sums)
+            sum = _mm256_fmadd_pd(re, weight, sum);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double error = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    if constexpr (Sums) {
+        _mm256_storeu_pd(lanes, sum);
+        *re_sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+    return error + drudeErrorRange<Sums>(p, i, end, eps_inf, omega_p, gamma, re_sum);
+}
+
+// With Bounded, the partial errors are checked every kCheck samples and the group is abandoned
+// (out[c] = +inf) as soon as all of its candidates exceed 'bound' (see drudeErrorTileBounded()).
+template <bool Sums, bool Bounded = false>
+__attribute__((target("avx2,fma")))
+inline void drudeErrorGroupAVX2(const FitProblem& p, size_t begin, size_t end, double eps_inf,
+                                const double* omega_p, const double* gamma, double* out, double* re_sums,
+                                double bound = 0.0) {
+    __m256d wp2[kGroup], g2[kGroup], wp2g[kGroup], acc[kGroup], sum[kGroup];
+    for (size_t c = 0; c < kGroup; ++c) {
+        wp2[c] = _mm256_set1_pd(omega_p[c] * omega_p[c]);
+        g2[c] = _mm256_set1_pd(gamma[c] * gamma[c]);
+        wp2g[c] = _mm256_set1_pd(omega_p[c] * omega_p[c] * gamma[c]);
+        acc[c] = _mm256_setzero_pd();
+        sum[c] = _mm256_setzero_pd();
+    }
+    const __m256d einf = _mm256_set1_pd(eps_inf);
+    const __m256d one = _mm256_set1_pd(1.0);
+
+    size_t i = begin;
+    size_t stop = Bounded ? std::min(begin + kCheck, end) : end;
+    while (true) {
+        for (; i + 4 <= stop; i += 4) {
+            const __m256d w2 = _mm256_loadu_pd(&p.omega2[i]);
+            const __m256d e1 = _mm256_loadu_pd(&p.eps1[i]);
+            const __m256d e2 = _mm256_loadu_pd(&p.eps2[i]);
+            const __m256d inv_w = _mm256_loadu_pd(&p.inv_omega[i]);
+            const __m256d weight = _mm256_loadu_pd(&p.weight[i]);
+            for (size_t c = 0; c < kGroup; ++c) {
+                __m256d inv_d = _mm256_div_pd(one, _mm256_add_pd(w2, g2[c]));
+                __m256d re = _mm256_sub_pd(_mm256_fnmadd_pd(wp2[c], inv_d, einf), e1);
+                __m256d im = _mm256_fmsub_pd(_mm256_mul_pd(wp2g[c], inv_d), inv_w, e2);
+                __m256d sq = _mm256_fmadd_pd(re, re, _mm256_mul_pd(im, im));
+                acc[c] = _mm256_fmadd_pd(sq, weight, acc[c]);
+                if constexpr (Sums)
+                    sum[c] = _mm256_fmadd_pd(re, weight, sum[c]);
+            }
+        }
+        if (!Bounded || stop == end)
+            break;
+        // Same lane reduction as below, so the partial errors never exceed the final ones.
+        bool above = true;
+        for (size_t c = 0; c < kGroup && above; ++c) {
+            double lanes[4];
+            _mm256_storeu_pd(lanes, acc[c]);
+            above = out[c] + ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) > bound;
+        }
+        if (above) {
+            for (size_t c = 0; c < kGroup; ++c)
+                out[c] = HUGE_VAL;
+            return;
+        }
+        stop = std::min(stop + kCheck, end);
+    }
+    for (size_t c = 0; c < kGroup; ++c) {
+        double lanes[4];
+        _mm256_storeu_pd(lanes, acc[c]);
+        out[c] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3])
+                + drudeErrorRange<Sums>(p, i, end, eps_inf, omega_p[c], gamma[c], Sums ? re_sums + c : nullptr);
+        if constexpr (Sums) {
+            _mm256_storeu_pd(lanes, sum[c]);
+            re_sums[c] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        }
+    }
+}
+
+template <bool Sums>
+__attribute__((target("avx2,fma")))
+inline void drudeErrorsAVX2T(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                             size_t count, double* errors, double* re_sums) {
+    auto range = [&p](size_t b, size_t e, double einf, double wp, double g, double* rs) {
+        return drudeErrorRangeAVX2<Sums>(p, b, e, einf, wp, g, rs);
+    };
+    auto group = [&p](size_t b, size_t e, double einf, const double* wp, const double* g, double* out, double* rs) {
+        drudeErrorGroupAVX2<Sums>(p, b, e, einf, wp, g, out, rs);
+    };
+    drudeErrorTile<Sums>(p, eps_inf, omega_p, gamma, count, errors, re_sums, range, group);
+}
+
+__attribute__((target("avx2,fma")))
+inline double drudeErrorAVX2(const FitProblem& p, double eps_inf, double omega_p, double gamma) {
+    return drudeErrorRangeAVX2(p, 0, p.size(), eps_inf, omega_p, gamma);
+}
+
+__attribute__((target("avx2,fma")))
+inline void drudeErrorsAVX2(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                            size_t count, double* errors) {
+    drudeErrorsAVX2T<false>(p, eps_inf, omega_p, gamma, count, errors, nullptr);
+}
+
+__attribute__((target("avx2,fma")))
+inline size_t drudeErrorsBoundedAVX2(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                                     size_t count, double* errors, double bound) {
+    return drudeErrorTileBounded(p, eps_inf, omega_p, gamma, count, errors, bound, [&p](size_t b, size_t e, double einf,
+                                 const double* wp, const double* g, double* out, double bd) {
+        drudeErrorGroupAVX2<false, true>(p, b, e, einf, wp, g, out, nullptr, bd);
+    });
+}
+
+__attribute__((target("avx2,fma")))
+inline double drudeErrorFitEpsInfAVX2(const FitProblem& p, double eps_inf, double omega_p, double gamma,
+                                      double* eps_inf_out) {
+    auto range = [&p](size_t b, size_t e, double einf, double wp, double g, double* rs) {
+        return drudeErrorRangeAVX2<true>(p, b, e, einf, wp, g, rs);
+    };
+    return drudeErrorFitEpsInf(p, eps_inf, omega_p, gamma, eps_inf_out, range);
+}
+
+__attribute__((target("avx2,fma")))
+inline void drudeErrorsFitEpsInfAVX2(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                                     size_t count, double* errors, double* eps_inf_out) {
+    drudeErrorsAVX2T<true>(p, eps_inf, omega_p, gamma, count, errors, eps_inf_out);
+    fitEpsInfTile(p, eps_inf, count, errors, eps_inf_out);
+}
+
+template <bool Sums = false>
+__attribute__((target("avx512f")))
+inline double drudeErrorRangeAVX512(const FitProblem& p, size_t begin, size_t end,
+                                    double eps_inf, double omega_p, double gamma, double* re_sum = nullptr) {
+    const __m512d wp2 = _mm512_set1_pd(omega_p * omega_p);
+    const __m512d g2 = _mm512_set1_pd(gamma * gamma);
+    const __m512d wp2g = _mm512_set1_pd(omega_p * omega_p * gamma);
+    const __m512d einf = _mm512_set1_pd(eps_inf);
+    const __m512d one = _mm512_set1_pd(1.0);
+
+    __m512d acc = _mm512_setzero_pd();
+    __m512d sum = _mm512_setzero_pd();
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        const __m512d weight = _mm512_loadu_pd(&p.weight[i]);
+        __m512d inv_d = _mm512_div_pd(one, _mm512_add_pd(_mm512_loadu_pd(&p.omega2[i]), g2));
+        __m512d re = _mm512_sub_pd(_mm512_fnmadd_pd(wp2, inv_d, einf), _mm512_loadu_pd(&p.eps1[i]));
+        __m512d im = _mm512_fmsub_pd(_mm512_mul_pd(wp2g, inv_d), _mm512_loadu_pd(&p.inv_omega[i]),
+                                     _mm512_loadu_pd(&p.eps2[i]));
+        __m512d sq = _mm512_fmadd_pd(re, re, _mm512_mul_pd(im, im));
+        acc = _mm512_fmadd_pd(sq, weight, acc);
+        if constexpr (Sums)
+            sum = _mm512_fmadd_pd(re, weight, sum);
+    }
+    double lanes[8];
+    _mm512_storeu_pd(lanes, acc);
+    double error = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    if constexpr (Sums) {
+        _mm512_storeu_pd(lanes, sum);
+        *re_sum += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    }
+    return error + drudeErrorRange<Sums>(p, i, end, eps_inf, omega_p, gamma, re_sum);
+}
+
+// With Bounded, the partial errors are checked every kCheck samples and the group is abandoned
+// (out[c] = +inf) as soon as all of its candidates exceed 'bound' (see drudeErrorTileBounded()).
+template <bool Sums, bool Bounded = false>
+__attribute__((target("avx512f")))
+inline void drudeErrorGroupAVX512(const FitProblem& p, size_t begin, size_t end, double eps_inf,
+                                  const double* omega_p, const double* gamma, double* out, double* re_sums,
+                                  double bound = 0.0) {
+    __m512d wp2[kGroup], g2[kGroup], wp2g[kGroup], acc[kGroup], sum[kGroup];
+    for (size_t c = 0; c < kGroup; ++c) {
+        wp2[c] = _mm512_set1_pd(omega_p[c] * omega_p[c]);
+        g2[c] = _mm512_set1_pd(gamma[c] * gamma[c]);
+        wp2g[c] = _mm512_set1_pd(omega_p[c] * omega_p[c] * gamma[c]);
+        acc[c] = _mm512_setzero_pd();
+        sum[c] = _mm512_setzero_pd();
+    }
+    const __m512d einf = _mm512_set1_pd(eps_inf);
+    const __m512d one = _mm512_set1_pd(1.0);
+
+    size_t i = begin;
+    size_t stop = Bounded ? std::min(begin + kCheck, end) : end;
+    while (true) {
+        for (; i + 8 <= stop; i += 8) {
+            const __m512d w2 = _mm512_loadu_pd(&p.omega2[i]);
+            const __m512d e1 = _mm512_loadu_pd(&p.eps1[i]);
+            const __m512d e2 = _mm512_loadu_pd(&p.eps2[i]);
+            const __m512d inv_w = _mm512_loadu_pd(&p.inv_omega[i]);
+            const __m512d weight = _mm512_loadu_pd(&p.weight[i]);
+            for (size_t c = 0; c < kGroup; ++c) {
+                __m512d inv_d = _mm512_div_pd(one, _mm512_add_pd(w2, g2[c]));
+                __m512d re = _mm512_sub_pd(_mm512_fnmadd_pd(wp2[c], inv_d, einf), e1);
+                __m512d im = _mm512_fmsub_pd(_mm512_mul_pd(wp2g[c], inv_d), inv_w, e2);
+                __m512d sq = _mm512_fmadd_pd(re, re, _mm512_mul_pd(im, im));
+                acc[c] = _mm512_fmadd_pd(sq, weight, acc[c]);
+                if constexpr (Sums)
+                    sum[c] = _mm512_fmadd_pd(re, weight, sum[c]);
+            }
+        }
+        if (!Bounded || stop == end)
+            break;
+        // Same lane reduction as below, so the partial errors never exceed the final ones.
+        bool above = true;
+        for (size_t c = 0; c < kGroup && above; ++c) {
+            double lanes[8];
+            _mm512_storeu_pd(lanes, acc[c]);
+            above = out[c] + (((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]))) > bound;
+        }
+        if (above) {
+            for (size_t c = 0; c < kGroup; ++c)
+                out[c] = HUGE_VAL;
+            return;
+        }
+        stop = std::min(stop + kCheck, end);
+    }
+    for (size_t c = 0; c < kGroup; ++c) {
+        double lanes[8];
+        _mm512_storeu_pd(lanes, acc[c]);
+        out[c] += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]))
+                + drudeErrorRange<Sums>(p, i, end, eps_inf, omega_p[c], gamma[c], Sums ? re_sums + c : nullptr);
+        if constexpr (Sums) {
+            _mm512_storeu_pd(lanes, sum[c]);
+            re_sums[c] += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+        }
+    }
+}
+
+template <bool Sums>
+__attribute__((target("avx512f")))
+inline void drudeErrorsAVX512T(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                               size_t count, double* errors, double* re_sums) {
+    auto range = [&p](size_t b, size_t e, double einf, double wp, double g, double* rs) {
+        return drudeErrorRangeAVX512<Sums>(p, b, e, einf, wp, g, rs);
+    };
+    auto group = [&p](size_t b, size_t e, double einf, const double* wp, const double* g, double* out, double* rs) {
+        drudeErrorGroupAVX512<Sums>(p, b, e, einf, wp, g, out, rs);
+    };
+    drudeErrorTile<Sums>(p, eps_inf, omega_p, gamma, count, errors, re_sums, range, group);
+}
+
+__attribute__((target("avx512f")))
+inline double drudeErrorAVX512(const FitProblem& p, double eps_inf, double omega_p, double gamma) {
+    return drudeErrorRangeAVX512(p, 0, p.size(), eps_inf, omega_p, gamma);
+}
+
+__attribute__((target("avx512f")))
+inline void drudeErrorsAVX512(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                              size_t count, double* errors) {
+    drudeErrorsAVX512T<false>(p, eps_inf, omega_p, gamma, count, errors, nullptr);
+}
+
+__attribute__((target("avx512f")))
+inline size_t drudeErrorsBoundedAVX512(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                                       size_t count, double* errors, double bound) {
+    return drudeErrorTileBounded(p, eps_inf, omega_p, gamma, count, errors, bound, [&p](size_t b, size_t e, double einf,
+                                 const double* wp, const double* g, double* out, double bd) {
+        drudeErrorGroupAVX512<false, true>(p, b, e, einf, wp, g, out, nullptr, bd);
+    });
+}
+
+__attribute__((target("avx512f")))
+inline double drudeErrorFitEpsInfAVX512(const FitProblem& p, double eps_inf, double omega_p, double gamma,
+                                        double* eps_inf_out) {
+    auto range = [&p](size_t b, size_t e, double einf, double wp, double g, double* rs) {
+        return drudeErrorRangeAVX512<true>(p, b, e, einf, wp, g, rs);
+    };
+    return drudeErrorFitEpsInf(p, eps_inf, omega_p, gamma, eps_inf_out, range);
+}
+
+__attribute__((target("avx512f")))
+inline void drudeErrorsFitEpsInfAVX512(const FitProblem& p, double eps_inf, const double* omega_p, const double* gamma,
+                                       size_t count, double* errors, double* eps_inf_out) {
+    drudeErrorsAVX512T<true>(p, eps_inf, omega_p, gamma, count, errors, eps_inf_out);
+    fitEpsInfTile(p, eps_inf, count, errors, eps_inf_out);
+}
+#endif
+
+// Generic kernels for the model policies. The samples are processed in groups of kLanes: the
+// model ε of a group is computed into small local arrays, then residuals and lane-wise error
+// sums are accumulated, each step a fixed-length loop without aliasing stores that the compiler
+// vectorizes after inlining the policy (compiled once per instruction set below).
+// Store selects whether the model ε of every sample is also written to eps1/eps2.
+constexpr size_t kLanes = 8;
+
+template <class Model, bool Store>
+inline double modelErrorRange(const FitProblem& p, const typename Model::Params& x, size_t begin, size_t end,
+                              double* eps1, double* eps2) {
+    double error = 0.0;
+    for (size_t i = begin; i < end; ++i) {
+        double re, im;
+        Model::eps(x, p.omega[i], p.omega2[i], p.inv_omega[i], re, im);
+        if constexpr (Store) {
+            eps1[i] = re;
+            eps2[i] = im;
+        }
+        double r1 = re - p.eps1[i];
+        double r2 = im - p.eps2[i];
+        error += (r1*r1 + r2*r2) * p.weight[i];
+    }
+    return error;
+}
+
+template <class Model, bool Store>
+METAL_DISPERSION_INLINE double modelErrorLanes(const FitProblem& p, const typename Model::Params& x,
+                                               double* eps1, double* eps2) {
+    const double* omega = p.omega.data();
+    const double* omega2 = p.omega2.data();
+    const double* inv_omega = p.inv_omega.data();
+    const double* data1 = p.eps1.data();
+    const double* data2 = p.eps2.data();
+    const double* weight = p.weight.data();
+    double acc[kLanes] = {};
+    size_t i = 0;
+    for (; i + kLanes <= p.size(); i += kLanes) {
+        double re[kLanes], im[kLanes];
+        for (size_t l = 0; l < kLanes; ++l)
+            Model::eps(x, omega[i + l], omega2[i + l], inv_omega[i + l], re[l], im[l]);
+        for (size_t l = 0; l < kLanes; ++l) {
+            double r1 = re[l] - data1[i + l];
+            double r2 = im[l] - data2[i + l];
+            acc[l] += (r1*r1 + r2*r2) * weight[i + l];
+        }
+        if constexpr (Store) {
+            for (size_t l = 0; l < kLanes; ++l) {
+                eps1[i + l] = re[l];
+                eps2[i + l] = im[l];
+            }
+        }
+    }
+    double error = ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+    return error + modelErrorRange<Model, Store>(p, x, i, p.size(), eps1, eps2);
+}
+
+// Error of the model at x; with eps1/eps2 non-null also the model ε of every sample.
+template <class Model>
+double modelErrorScalar(const FitProblem& p, const typename Model::Params& x, double* eps1, double* eps2) {
+    return eps1 ? modelErrorLanes<Model, true>(p, x, eps1, eps2) : modelErrorLanes<Model, false>(p, x, eps1, eps2);
+}
+
+#ifdef METAL_DISPERSION_X86_SIMD
+template <class Model>
+__attribute__((target("avx2,fma")))
+double modelErrorAVX2(const FitProblem& p, const typename Model::Params& x, double* eps1, double* eps2) {
+    return eps1 ? modelErrorLanes<Model, true>(p, x, eps1, eps2) : modelErrorLanes<Model, false>(p, x, eps1, eps2);
+}
+
+template <class Model>
+__attribute__((target("avx512f")))
+double modelErrorAVX512(const FitProblem& p, const typename Model::Params& x, double* eps1, double* eps2) {
+    return eps1 ? modelErrorLanes<Model, true>(p, x, eps1, eps2) : modelErrorLanes<Model, false>(p, x, eps1, eps2);
+}
+#endif
+
+} // namespace kernels
+
+// One set of residual kernels for a given instruction set.
+struct DrudeKernels {
+    const char* name;
+    double (*error)(const FitProblem&, double eps_inf, double omega_p, double gamma);
+    // Errors of 'count' candidates (omega_p[k], gamma[k]) in one tiled pass over the data.
+    void (*errors)(const FitProblem&, double eps_inf, const double* omega_p, const double* gamma,
+                   size_t count, double* errors);
+    // The same with ε∞ fitted in closed form per candidate: the errors are those at the best ε∞,
+    // which is stored in eps_inf_out (eps_inf is only the expansion point).
+    double (*error_fit_eps_inf)(const FitProblem&, double eps_inf, double omega_p, double gamma, double* eps_inf_out);
+    void (*errors_fit_eps_inf)(const FitProblem&, double eps_inf, const double* omega_p, const double* gamma,
+                               size_t count, double* errors, double* eps_inf_out);
+    // Errors of at most kernels::kBoundedTile candidates, +inf for those above 'bound' (abandoned
+    // early); returns how many were above.
+    size_t (*errors_bounded)(const FitProblem&, double eps_inf, const double* omega_p, const double* gamma,
+                             size_t count, double* errors, double bound);
+};
+
+// All kernel sets usable on this CPU, fastest first; the scalar set is always last.
+std::vector<DrudeKernels> availableDrudeKernels() {
+    std::vector<DrudeKernels> available;
+#ifdef METAL_DISPERSION_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        available.push_back({"avx512", kernels::drudeErrorAVX512, kernels::drudeErrorsAVX512,
+                             kernels::drudeErrorFitEpsInfAVX512, kernels::drudeErrorsFitEpsInfAVX512,
+                             kernels::drudeErrorsBoundedAVX512});
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        available.push_back({"avx2", kernels::drudeErrorAVX2, kernels::drudeErrorsAVX2,
+                             kernels::drudeErrorFitEpsInfAVX2, kernels::drudeErrorsFitEpsInfAVX2,
+                             kernels::drudeErrorsBoundedAVX2});
+#endif
+    available.push_back({"scalar", kernels::drudeErrorScalar, kernels::drudeErrorsScalar,
+                         kernels::drudeErrorFitEpsInfScalar, kernels::drudeErrorsFitEpsInfScalar,
+                         kernels::drudeErrorsBoundedScalar});
+    return available;
+}
+
+// Kernel set used by computeError(), chosen once on first use.
+const DrudeKernels& drudeKernels() {
+    static const DrudeKernels selected = availableDrudeKernels().front();
+    return selected;
+}
+
+// Generic model kernel for a given instruction set.
+template <class Model>
+struct ModelKernels {
+    const char* name;
+    // Error at x; with eps1/eps2 non-null (problem.size() each) also stores the model ε.
+    double (*error)(const FitProblem&, const typename Model::Params& x, double* eps1, double* eps2);
+};
+
+// Model kernels usable on this CPU, fastest first (same selection as availableDrudeKernels()).
+template <class Model>
+std::vector<ModelKernels<Model>> availableModelKernels() {
+    std::vector<ModelKernels<Model>> available;
+#ifdef METAL_DISPERSION_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        available.push_back({"avx512", kernels::modelErrorAVX512<Model>});
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        available.push_back({"avx2", kernels::modelErrorAVX2<Model>});
+#endif
+    available.push_back({"scalar", kernels::modelErrorScalar<Model>});
+    return available;
+}
+
+template <class Model>
+const ModelKernels<Model>& modelKernels() {
+    static const ModelKernels<Model> selected = availableModelKernels<Model>().front();
+    return selected;
+}
+
+// Normalized least-squares error of any model policy at parameters x,
+// e.g. computeError<DrudeLorentzModel<2>>(problem, x).
+template <class Model>
+double computeError (const FitProblem& problem , const typename Model::Params& x){
+    Profiler::count(Profiler::ErrorEvaluations);
+    return modelKernels<Model>().error(problem, x, nullptr, nullptr);
+}
+
+// Normalized least-squares error of the Drude model over a prepared FitProblem.
+double computeError (const FitProblem& problem , double eps_inf , double omega_p , double gamma){
+    Profiler::count(Profiler::ErrorEvaluations);
+    return drudeKernels().error(problem, eps_inf, omega_p, gamma);
+}
+
+// Batch version: errors[k] for the candidates (omega_p[k], gamma[k]), k < count,
+// computed in a single cache-blocked pass over the data.
+void computeErrors (const FitProblem& problem , double eps_inf , const double* omega_p , const double* gamma,
+                    size_t count , double* errors){
+    Profiler::count(Profiler::ErrorEvaluations, count);
+    drudeKernels().errors(problem, eps_inf, omega_p, gamma, count, errors);
+}
+
+// Bounded batch version: errors[k] as computeErrors() gives them if they are <= bound, +inf
+// otherwise. Candidates are abandoned as soon as their partial error exceeds the bound.
+void computeErrorsBounded (const FitProblem& problem , double eps_inf , const double* omega_p , const double* gamma,
+                           size_t count , double* errors , double bound){
+    Profiler::count(Profiler::ErrorEvaluations, count);
+    size_t pruned = 0;
+    for (size_t k = 0; k < count; k += kernels::kBoundedTile)
+        pruned += drudeKernels().errors_bounded(problem, eps_inf, omega_p + k, gamma + k,
+                                                std::min(kernels::kBoundedTile, count - k), errors + k, bound);
+    Profiler::count(Profiler::PrunedPoints, pruned);
+}
+
+// Error at (omega_p, gamma) minimized over ε∞ in closed form; the best ε∞ goes to best_eps_inf.
+double computeErrorFitEpsInf (const FitProblem& problem , double eps_inf , double omega_p , double gamma,
+                              double& best_eps_inf){
+    Profiler::count(Profiler::ErrorEvaluations);
+    return drudeKernels().error_fit_eps_inf(problem, eps_inf, omega_p, gamma, &best_eps_inf);
+}
+
+// Batch version of computeErrorFitEpsInf(): errors[k] and eps_inf_out[k] for each candidate.
+void computeErrorsFitEpsInf (const FitProblem& problem , double eps_inf , const double* omega_p , const double* gamma,
+                             size_t count , double* errors , double* eps_inf_out){
+    Profiler::count(Profiler::ErrorEvaluations, count);
+    drudeKernels().errors_fit_eps_inf(problem, eps_inf, omega_p, gamma, count, errors, eps_inf_out);
+}
+
+// Single-precision copy of a FitProblem for the coarse phases of the mixed-precision search
+// (mixed_precision): the same samples as float arrays, so a SIMD register holds twice as many.
+// Frequencies are in units of 'scale' (the largest ω of the window), which keeps ωp²γ
+// (~1e46 rad³/s³) inside the float range; ε is unchanged when ω, ωp and γ are scaled alike.
+// The arrays are padded to a whole number of kernel vectors with samples of zero weight.
+struct FloatFitProblem {
+    std::vector<float> omega2;      // (ω/scale)²
+    std::vector<float> inv_omega;   // scale/ω
+    std::vector<float> eps1;
+    std::vector<float> eps2;
+    std::vector<float> weight;
+    double scale = 1.0;             // rad/s
+
+    FloatFitProblem() = default;
+
+    explicit FloatFitProblem(const FitProblem& problem) {
+        for (double w : problem.omega)
+            scale = std::max(scale, w);
+        for (size_t i = 0; i < problem.size(); ++i) {
+            const double w = problem.omega[i] / scale;
+            omega2.push_back(static_cast<float>(w * w));
+            inv_omega.push_back(static_cast<float>(1.0 / w));
+            eps1.push_back(static_cast<float>(problem.eps1[i]));
+            eps2.push_back(static_cast<float>(problem.eps2[i]));
+            weight.push_back(static_cast<float>(problem.weight[i]));
+        }
+        while (omega2.size() % kPadding != 0) {
+            omega2.push_back(1.0f);
+            inv_omega.push_back(1.0f);
+            eps1.push_back(0.0f);
+            eps2.push_back(0.0f);
+            weight.push_back(0.0f);
+        }
+    }
+
+    size_t size() const {
+        return omega2.size();
+    }
+
+    static constexpr size_t kPadding = 16;
+};
+
+namespace kernels {
+
+// Float Drude kernels: each candidate over kFloatLanes float lanes (the sample count is a
+// multiple of them, see FloatFitProblem). As in the double tile kernels, the samples are
+// processed in L1-sized blocks (5 arrays × kFloatBlock floats = 20 KB) that are reused for
+// all candidates. The lane sums are folded and added to a double total every kCheck samples,
+// which bounds the float rounding of long spectra and is also where a candidate above
+// 'bound' is abandoned (+inf). Returns the number of candidates abandoned.
+constexpr size_t kFloatLanes = FloatFitProblem::kPadding;
+constexpr size_t kFloatBlock = 2 * kBlock;
+
+METAL_DISPERSION_INLINE double drudeErrorFloatRange(const FloatFitProblem& p, size_t begin, size_t end, float eps_inf,
+                                                    float wp2, float g2, float wp2g, double error, double bound) {
+    const float* omega2 = p.omega2.data();
+    const float* inv_omega = p.inv_omega.data();
+    const float* data1 = p.eps1.data();
+    const float* data2 = p.eps2.data();
+    const float* weight = p.weight.data();
+    for (size_t check = begin; check < end && error <= bound; check += kCheck) {
+        const size_t check_end = std::min(check + kCheck, end);
+        float acc[kFloatLanes] = {};
+        for (size_t i = check; i < check_end; i += kFloatLanes)
+            for (size_t l = 0; l < kFloatLanes; ++l) {
+                const float inv_d = 1.0f / (omega2[i + l] + g2);
+                const float re = eps_inf - wp2 * inv_d - data1[i + l];
+                const float im = wp2g * inv_d * inv_omega[i + l] - data2[i + l];
+                acc[l] += (re*re + im*im) * weight[i + l];
+            }
+        float half[kFloatLanes / 2];
+        for (size_t l = 0; l < kFloatLanes / 2; ++l)
+            half[l] = acc[l] + acc[l + kFloatLanes / 2];
+        error += ((half[0] + half[1]) + (half[2] + half[3])) + ((half[4] + half[5]) + (half[6] + half[7]));
+    }
+    return error;
+}
+
+METAL_DISPERSION_INLINE size_t drudeErrorsFloatLanes(const FloatFitProblem& p, double eps_inf, const double* omega_p,
+                                                     const double* gamma, size_t count, double* errors, double bound) {
+    const float einf = static_cast<float>(eps_inf);
+    for (size_t k = 0; k < count; ++k)
+        errors[k] = 0.0;
+    for (size_t begin = 0; begin < p.size(); begin += kFloatBlock) {
+        const size_t end = std::min(begin + kFloatBlock, p.size());
+        bool active = false;
+        for (size_t k = 0; k < count; ++k) {
+            if (errors[k] > bound)
+                continue;
+            const double wp = omega_p[k] / p.scale;
+            const double g = gamma[k] / p.scale;
+            errors[k] = drudeErrorFloatRange(p, begin, end, einf, static_cast<float>(wp * wp),
+                                             static_cast<float>(g * g), static_cast<float>(wp * wp * g),
+                                             errors[k], bound);
+            active = true;
+        }
+        if (!active)
+            break;
+    }
+    size_t rejected = 0;
+    for (size_t k = 0; k < count; ++k)
+        if (errors[k] > bound) {
+            errors[k] = HUGE_VAL;
+            ++rejected;
+        }
+    return rejected;
+}
+
+inline size_t drudeErrorsFloatScalar(const FloatFitProblem& p, double eps_inf, const double* omega_p,
+                                     const double* gamma, size_t count, double* errors, double bound) {
+    return drudeErrorsFloatLanes(p, eps_inf, omega_p, gamma, count, errors, bound);
+}
+
+#ifdef METAL_DISPERSION_X86_SIMD
+__attribute__((target("avx2,fma")))
+inline size_t drudeErrorsFloatAVX2(const FloatFitProblem& p, double eps_inf, const double* omega_p,
+                                   const double* gamma, size_t count, double* errors, double bound) {
+    return drudeErrorsFloatLanes(p, eps_inf, omega_p, gamma, count, errors, bound);
+}
+
+__attribute__((target("avx512f")))
+inline size_t drudeErrorsFloatAVX512(const FloatFitProblem& p, double eps_inf, const double* omega_p,
+                                     const double* gamma, size_t count, double* errors, double bound) {
+    return drudeErrorsFloatLanes(p, eps_inf, omega_p, gamma, count, errors, bound);
+}
+#endif
+
+} // namespace kernels
+
+// Float Drude kernel for a given instruction set.
+struct FloatDrudeKernels {
+    const char* name;
+    // Errors of 'count' candidates, +inf for those above 'bound'; returns how many were above.
+    size_t (*errors)(const FloatFitProblem&, double eps_inf, const double* omega_p, const double* gamma,
+                     size_t count, double* errors, double bound);
+};
+
+// All float kernels usable on this CPU, fastest first; the scalar one is always last.
+std::vector<FloatDrudeKernels> availableFloatDrudeKernels() {
+    std::vector<FloatDrudeKernels> available;
+#ifdef METAL_DISPERSION_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        available.push_back({"avx512", kernels::drudeErrorsFloatAVX512});
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        available.push_back({"avx2", kernels::drudeErrorsFloatAVX2});
+#endif
+    available.push_back({"scalar", kernels::drudeErrorsFloatScalar});
+    return available;
+}
+
+const FloatDrudeKernels& floatDrudeKernels() {
+    static const FloatDrudeKernels selected = availableFloatDrudeKernels().front();
+    return selected;
+}
+
+// Single-precision Drude errors of 'count' candidates (float rounding, ~1e-6 relative); errors
+// above 'bound' come back as +inf.
+void computeErrorsFloat (const FloatFitProblem& problem , double eps_inf , const double* omega_p , const double* gamma,
+                         size_t count , double* errors , double bound = HUGE_VAL){
+    Profiler::count(Profiler::ErrorEvaluations, count);
+    Profiler::count(Profiler::PrunedPoints,
+                    floatDrudeKernels().errors(problem, eps_inf, omega_p, gamma, count, errors, bound));
+}
+
+// Drude objective for the searches: single points or whole tiles of candidates.
+// With fit_eps_inf every point is scored at its own best ε∞ (a 3-parameter fit at the cost
+// of the 2-parameter search); bestEpsInf() recovers that ε∞ for the point finally chosen.
+struct DrudeObjective {
+    const FitProblem& problem;
+    double eps_inf;
+    bool fit_eps_inf = false;
+
+    double operator()(double omega_p, double gamma) const {
+        if (fit_eps_inf) {
+            double best;
+            return computeErrorFitEpsInf(problem, eps_inf, omega_p, gamma, best);
+        }
+        return computeError(problem, eps_inf, omega_p, gamma);
+    }
+
+    void operator()(const double* omega_p, const double* gamma, size_t count, double* errors) const {
+        if (!fit_eps_inf) {
+            computeErrors(problem, eps_inf, omega_p, gamma, count, errors);
+            return;
+        }
+        constexpr size_t kChunk = 64;
+        double best[kChunk];
+        for (size_t k = 0; k < count; k += kChunk)
+            computeErrorsFitEpsInf(problem, eps_inf, omega_p + k, gamma + k, std::min(kChunk, count - k),
+                                   errors + k, best);
+    }
+
+    // Tile with a cutoff: errors above 'bound' may be reported as +inf (see computeErrorsBounded()).
+    // The fitted-ε∞ error E − R²/W is not monotone in the partial sums, so it is not pruned.
+    void operator()(const double* omega_p, const double* gamma, size_t count, double* errors, double bound) const {
+        if (fit_eps_inf)
+            (*this)(omega_p, gamma, count, errors);
+        else
+            computeErrorsBounded(problem, eps_inf, omega_p, gamma, count, errors, bound);
+    }
+
+    double bestEpsInf(double omega_p, double gamma) const {
+        double best = eps_inf;
+        if (fit_eps_inf)
+            computeErrorFitEpsInf(problem, eps_inf, omega_p, gamma, best);
+        return best;
+    }
+};
+
+// Drude objective on the float samples, for the coarse phases of the mixed-precision search
+// (fixed ε∞ only); fitDrude() finishes them with DrudeObjective.
+struct FloatDrudeObjective {
+    const FloatFitProblem& problem;
+    double eps_inf;
+
+    double operator()(double omega_p, double gamma) const {
+        double error;
+        computeErrorsFloat(problem, eps_inf, &omega_p, &gamma, 1, &error);
+        return error;
+    }
+
+    void operator()(const double* omega_p, const double* gamma, size_t count, double* errors) const {
+        computeErrorsFloat(problem, eps_inf, omega_p, gamma, count, errors);
+    }
+
+    void operator()(const double* omega_p, const double* gamma, size_t count, double* errors, double bound) const {
+        computeErrorsFloat(problem, eps_inf, omega_p, gamma, count, errors, bound);
+    }
+};
+
+
+// Result of a parameter search: the smallest normalized error and where it was found.
+struct FitResult {
+    double error   = 1e300;
+    double omega_p = 0.0;
+    double gamma   = 0.0;
+    size_t evaluations = 0;   // number of objective (computeError) calls
+};
+
+// Rectangular (omega_p, gamma) search grid.
+// Grid points are generated as min + i*step (instead of accumulating the step) so that
+// every worker thread sees exactly the same parameter values however the grid is split.
+struct ParameterGrid {
+    double omega_p_min, omega_p_max, domega_p;
+    double gamma_min, gamma_max, dgamma;
+
+    double omegaP(size_t i) const { return omega_p_min + i * domega_p; }
+    double gamma(size_t j)  const { return gamma_min + j * dgamma; }
+
+    size_t omegaPCount() const { return countPoints(omega_p_min, omega_p_max, domega_p); }
+    size_t gammaCount()  const { return countPoints(gamma_min, gamma_max, dgamma); }
+    size_t size() const { return omegaPCount() * gammaCount(); }
+
+    // Number of points min + i*step that lie strictly below max.
+    static size_t countPoints(double min, double max, double step) {
+        if (!(step > 0.0) || !(max > min))
+            return 0;
+        size_t count = static_cast<size_t>((max - min) / step);
+        while (count > 0 && min + (count - 1) * step >= max) --count;
+        while (min + count * step < max) ++count;
+        return count;
+    }
+};
+
+// Exhaustive grid search distributed over worker threads.
+// The flattened grid is split into contiguous blocks, one per thread. Each thread keeps its
+// own best point and writes it to its own slot once at the end, so no locking is needed.
+// Blocks are reduced in order with a strict '<', which reproduces the serial loop exactly:
+// among equal errors the point visited first (lowest omega_p, then lowest gamma) wins.
+class GridSearch {
+public:
+    GridSearch(const ParameterGrid& grid, unsigned threads = 0) : grid_(grid) {
+        threads_ = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    unsigned threads() const {
+        return threads_;
+    }
+
+    // Candidates handed to a batch objective at once.
+    static constexpr size_t kTile = 64;
+
+    // Grids with at least this many points locate the start of the pruned search with a
+    // kPilotAxis × kPilotAxis pilot lattice (one tile).
+    static constexpr size_t kPilotAxis = 8;
+    static constexpr size_t kPilotMinPoints = 64 * kTile;
+
+    // objective(omega_p, gamma) must be safe to call concurrently from several threads.
+    // If the objective can also evaluate tiles, objective(const double* omega_p,
+    // const double* gamma, size_t count, double* errors), the grid is processed in tiles
+    // of kTile candidates instead of point by point. If it also takes a cutoff as a fifth
+    // argument (errors above it may come back as any larger value) and grid_pruning is set,
+    // the pruned search is used instead; it returns the same point as the full one.
+    template <class Objective>
+    FitResult run(const Objective& objective) const {
+        ScopedTimer timer ("grid_search");
+        const size_t total = grid_.size();
+        const size_t workers = std::min<size_t>(threads_, std::max<size_t>(total, 1));
+
+        FitResult best;
+        bool pruned = false;
+        if constexpr (std::is_invocable_v<const Objective&, const double*, const double*, size_t, double*, double>) {
+            if (grid_pruning && total > 0) {
+                best = searchPruned(objective, workers);
+                pruned = true;
+            }
+        }
+        if (!pruned)
+            best = searchAll(objective, workers);
+        best.evaluations = total;
+        Profiler::count(Profiler::GridPoints, total);
+        return best;
+    }
+
+    // Runs fn(0) .. fn(workers - 1) on 'workers' threads, fn(0) on the calling one.
+    template <class Fn>
+    static void parallel(size_t workers, const Fn& fn) {
+        std::vector<std::thread> pool;
+        for (size_t t = 1; t < workers; ++t)
+            pool.emplace_back(fn, t);
+        fn(0);
+        for (std::thread& worker : pool)
+            worker.join();
+    }
+
+    // Smallest error offered and its index, the lowest index among equal errors (the point the
+    // full search, visiting the grid in index order, would return).
+    struct IndexedBest {
+        double error = FitResult().error;
+        size_t index = std::numeric_limits<size_t>::max();
+
+        void offer(double e, size_t i) {
+            if (e < error || (e == error && i < index)) {
+                error = e;
+                index = i;
+            }
+        }
+    };
+
+    // Tile loop of the pruned searches (searchPruned(), scanErrorSurface()): worker t of
+    // 'workers' evaluates the tiles t, t + workers, ... with evaluate(tile, cutoff, best), which
+    // offers the error of every point of the tile to 'best'. The cutoff is the smallest error
+    // found so far by any worker (at first 'initial'), so evaluate() may abandon points above it.
+    // Returns the best point over all workers.
+    template <class Evaluate>
+    static IndexedBest searchTiles(size_t tiles, size_t workers, double initial, const Evaluate& evaluate) {
+        std::atomic<double> cutoff {initial};
+        std::vector<IndexedBest> partial(workers);
+        parallel(workers, [&](size_t t) {
+            IndexedBest best;
+            for (size_t tile = t; tile < tiles; tile += workers) {
+                evaluate(tile, cutoff.load(std::memory_order_relaxed), best);
+                double current = cutoff.load(std::memory_order_relaxed);
+                while (best.error < current && !cutoff.compare_exchange_weak(current, best.error, std::memory_order_relaxed)) {}
+            }
+            partial[t] = best;
+        });
+        IndexedBest best;
+        for (const IndexedBest& p : partial)
+            best.offer(p.error, p.index);
+        return best;
+    }
+
+private:
+    // Every grid point in index order, the grid split into one contiguous block per worker.
+    template <class Objective>
+    FitResult searchAll(const Objective& objective, size_t workers) const {
+        const size_t n_gamma = grid_.gammaCount();
+        const size_t total = grid_.size();
+        std::vector<FitResult> partial(workers);
+        auto searchBlock = [&](size_t t) {
+            const size_t begin = total * t / workers;
+            const size_t end   = total * (t + 1) / workers;
+            FitResult best;
+            if constexpr (std::is_invocable_v<const Objective&, const double*, const double*, size_t, double*>) {
+                double omega_p[kTile], gamma[kTile], errors[kTile];
+                for (size_t tile = begin; tile < end; tile += kTile) {
+                    const size_t count = std::min(kTile, end - tile);
+                    for (size_t k = 0; k < count; ++k) {
+                        omega_p[k] = grid_.omegaP((tile + k) / n_gamma);
+                        gamma[k]   = grid_.gamma((tile + k) % n_gamma);
+                    }
+                    objective(omega_p, gamma, count, errors);
+                    for (size_t k = 0; k < count; ++k) {
+                        if (errors[k] < best.error) {
+                            best.error = errors[k];
+                            best.omega_p = omega_p[k];
+                            best.gamma = gamma[k];
+                        }
+                    }
+                }
+            } else {
+                for (size_t idx = begin; idx < end; ++idx) {
+                    double omega_p = grid_.omegaP(idx / n_gamma);
+                    double gamma   = grid_.gamma(idx % n_gamma);
+                    double err = objective(omega_p, gamma);
+                    if (err < best.error) {
+                        best.error = err;
+                        best.omega_p = omega_p;
+                        best.gamma = gamma;
+                    }
+                }
+            }
+            partial[t] = best;
+        };
+        parallel(workers, searchBlock);
+
+        FitResult best;
+        for (const FitResult& r : partial)
+            if (r.error < best.error)
+                best = r;
+        return best;
+    }
+
+    // Pruned search: the objective gets the smallest error found so far (shared by all workers)
+    // as its cutoff, and the grid is visited from a promising start cell outwards, rows and
+    // columns in order of distance from it, so that the cutoff is tight from the first tiles on.
+    // Workers take interleaved tiles of that order. As the full search returns the first of
+    // equal minima in index order, ties are broken by grid index.
+    template <class Objective>
+    FitResult searchPruned(const Objective& objective, size_t workers) const {
+        const size_t n_wp = grid_.omegaPCount();
+        const size_t n_gamma = grid_.gammaCount();
+        const size_t total = n_wp * n_gamma;
+
+        // Start at the best point of a pilot lattice (whose error is a valid first cutoff),
+        // or at the centre of small grids such as the windows of RefiningSearch.
+        size_t start = (n_wp / 2) * n_gamma + n_gamma / 2;
+        double initial = HUGE_VAL;
+        if (total >= kPilotMinPoints) {
+            double omega_p[kTile], gamma[kTile], errors[kTile];
+            size_t cells[kTile];
+            size_t n = 0;
+            for (size_t a = 0; a < kPilotAxis; ++a)
+                for (size_t b = 0; b < kPilotAxis; ++b, ++n) {
+                    const size_t row = (2 * a + 1) * n_wp / (2 * kPilotAxis);
+                    const size_t col = (2 * b + 1) * n_gamma / (2 * kPilotAxis);
+                    omega_p[n] = grid_.omegaP(row);
+                    gamma[n] = grid_.gamma(col);
+                    cells[n] = row * n_gamma + col;
+                }
+            objective(omega_p, gamma, n, errors);
+            size_t pick = 0;
+            for (size_t k = 1; k < n; ++k)
+                if (errors[k] < errors[pick])
+                    pick = k;
+            start = cells[pick];
+            initial = errors[pick];
+        }
+        const std::vector<size_t> rows = distanceOrder(n_wp, start / n_gamma);
+        const std::vector<size_t> cols = distanceOrder(n_gamma, start % n_gamma);
+
+        const size_t tiles = (total + kTile - 1) / kTile;
+        IndexedBest best = searchTiles(tiles, workers, initial, [&](size_t tile, double cutoff, IndexedBest& out) {
+            double omega_p[kTile] = {}, gamma[kTile] = {}, errors[kTile];
+            size_t cells[kTile];
+            const size_t first = tile * kTile;
+            const size_t count = std::min(kTile, total - first);
+            for (size_t k = 0; k < count; ++k) {
+                const size_t row = rows[(first + k) / n_gamma];
+                const size_t col = cols[(first + k) % n_gamma];
+                omega_p[k] = grid_.omegaP(row);
+                gamma[k] = grid_.gamma(col);
+                cells[k] = row * n_gamma + col;
+            }
+            objective(omega_p, gamma, count, errors, cutoff);
+            for (size_t k = 0; k < count; ++k)
+                out.offer(errors[k], cells[k]);
+        });
+
+        FitResult result;
+        if (best.index < total) {
+            result.error = best.error;
+            result.omega_p = grid_.omegaP(best.index / n_gamma);
+            result.gamma = grid_.gamma(best.index % n_gamma);
+        }
+        return result;
+    }
+
+    // 0 .. n-1 by distance from 'start' (start, start + 1, start - 1, start + 2, ...).
+    static std::vector<size_t> distanceOrder(size_t n, size_t start) {
+        std::vector<size_t> order {start};
+        order.reserve(n);
+        for (size_t d = 1; order.size() < n; ++d) {
+            if (start + d < n)
+                order.push_back(start + d);
+            if (d <= start)
+                order.push_back(start - d);
+        }
+        return order;
+    }
+
+    ParameterGrid grid_;
+    unsigned threads_;
+};
+
+// Tuning of the coarse-to-fine search.
+struct RefineOptions {
+    size_t coarse_points = 16;  // points per axis on the first (coarse) level
+    double zoom = 4.0;          // step reduction from one level to the next
+    double radius = 2.0;        // half-width of the next window, in steps of the current level
+};
+
+// Coarse-to-fine (hierarchical) search.
+// The first level covers the whole range of 'grid' with coarse_points per axis. Each later
+// level is a finer grid over a small window centred on the best point found so far, until
+// the steps of 'grid' (the target resolution) are reached on both axes. Every level is
+// evaluated with GridSearch, so levels are multi-threaded as well.
+class RefiningSearch {
+public:
+    RefiningSearch(const ParameterGrid& grid, const RefineOptions& options = {}, unsigned threads = 0)
+        : grid_(grid), options_(options), threads_(threads) {}
+
+    template <class Objective>
+    FitResult run(const Objective& objective) const {
+        return run(objective, objective);
+    }
+
+    // The same with the levels before the last one evaluated by 'coarse' (an approximation of
+    // 'objective', e.g. FloatDrudeObjective) and the last one, at the target resolution, by
+    // 'objective'. The best point of the earlier levels is rescored with 'objective' before it
+    // is compared with the last level, so the reported error is always one of 'objective'.
+    template <class Coarse, class Objective>
+    FitResult run(const Coarse& coarse, const Objective& objective) const {
+        const size_t points = std::max<size_t>(options_.coarse_points, 2);
+        double step_wp = std::max((grid_.omega_p_max - grid_.omega_p_min) / points, grid_.domega_p);
+        double step_g  = std::max((grid_.gamma_max - grid_.gamma_min) / points, grid_.dgamma);
+        ParameterGrid level {grid_.omega_p_min, grid_.omega_p_max, step_wp,
+                             grid_.gamma_min, grid_.gamma_max, step_g};
+
+        FitResult best;
+        size_t evaluations = 0;
+        while (true) {
+            const bool last = step_wp <= grid_.domega_p && step_g <= grid_.dgamma;
+            if (last && !std::is_same_v<Coarse, Objective> && best.error < FitResult().error) {
+                best.error = objective(best.omega_p, best.gamma);
+                ++evaluations;
+            }
+            FitResult r = last ? GridSearch(level, threads_).run(objective) : GridSearch(level, threads_).run(coarse);
+            evaluations += r.evaluations;
+            if (r.error < best.error)
+                best = r;
+            if (last)
+                break;
+
+            double next_wp = std::max(step_wp / options_.zoom, grid_.domega_p);
+            double next_g  = std::max(step_g / options_.zoom, grid_.dgamma);
+            level = window(best.omega_p, options_.radius * step_wp, next_wp, grid_.omega_p_min, grid_.omega_p_max,
+                           best.gamma, options_.radius * step_g, next_g, grid_.gamma_min, grid_.gamma_max);
+            step_wp = next_wp;
+            step_g = next_g;
+        }
+        best.evaluations = evaluations;
+        return best;
+    }
+
+private:
+    // Grid of the given steps covering [center - half_width, center + half_width] on each axis,
+    // clipped to the search range. The upper edge is included unless it is the range limit.
+    static ParameterGrid window(double wp, double half_wp, double step_wp, double wp_min, double wp_max,
+                                double g, double half_g, double step_g, double g_min, double g_max) {
+        double lo_wp = std::max(wp - half_wp, wp_min);
+        double lo_g  = std::max(g - half_g, g_min);
+        double hi_wp = std::min(wp + half_wp + 0.5 * step_wp, wp_max);
+        double hi_g  = std::min(g + half_g + 0.5 * step_g, g_max);
+        return ParameterGrid {lo_wp, hi_wp, step_wp, lo_g, hi_g, step_g};
+    }
+
+    ParameterGrid grid_;
+    RefineOptions options_;
+    unsigned threads_;
+};
+
+// Three-parameter scan grid: the (omega_p, gamma) plane for every eps_inf value.
+struct ScanGrid {
+    ParameterGrid plane;
+    double eps_inf_min, eps_inf_max, deps_inf;
+
+    double epsInf(size_t k) const { return eps_inf_min + k * deps_inf; }
+    size_t epsInfCount() const { return ParameterGrid::countPoints(eps_inf_min, eps_inf_max, deps_inf); }
+    size_t size() const { return epsInfCount() * plane.size(); }
+};
+
+// Outcome of scanErrorSurface().
+struct ErrorScan {
+    FitResult best;                 // smallest error; evaluations = grid points
+    double eps_inf = 0.0;           // ε∞ of the best point
+    std::vector<double> surface;    // error of every point, [eps_inf][omega_p][gamma] (keep_surface only)
+};
+
+// Drude error over the whole ScanGrid: the best point, and with keep_surface every error.
+// The CPU backend evaluates tiles of GridSearch::kTile candidates of one ε∞ plane, distributed
+// over 'threads' workers; without keep_surface it prunes like GridSearch (identical best point).
+// Ties go to the lowest flat index on both backends. The CUDA backend computes each error
+// with a sequential sum, within a few 1e-15 relative of the CPU kernels; the error of its best
+// point is recomputed on the CPU, so both backends report the same value for the same point.
+ErrorScan scanErrorSurface(const FitProblem& problem, const ScanGrid& grid, ScanBackend backend,
+                           bool keep_surface, unsigned threads) {
+    ScopedTimer timer ("scan");
+    const size_t n_wp = grid.plane.omegaPCount();
+    const size_t n_gamma = grid.plane.gammaCount();
+    const size_t plane = n_wp * n_gamma;
+    const size_t total = grid.size();
+    ErrorScan result;
+    result.best.evaluations = total;
+    if (keep_surface)
+        result.surface.resize(total);
+    if (total == 0)
+        return result;
+    Profiler::count(Profiler::GridPoints, total);
+
+    auto setBest = [&](size_t index) {
+        const size_t k = index / plane, i = index % plane / n_gamma, j = index % n_gamma;
+        result.eps_inf = grid.epsInf(k);
+        result.best.omega_p = grid.plane.omegaP(i);
+        result.best.gamma = grid.plane.gamma(j);
+    };
+
+    if (backend == ScanBackend::CUDA) {
+#ifdef METAL_DISPERSION_CUDA
+        std::vector<double> omega_p (n_wp), gamma (n_gamma), eps_inf_values (grid.epsInfCount());
+        for (size_t i = 0; i < n_wp; ++i) omega_p[i] = grid.plane.omegaP(i);
+        for (size_t j = 0; j < n_gamma; ++j) gamma[j] = grid.plane.gamma(j);
+        for (size_t k = 0; k < eps_inf_values.size(); ++k) eps_inf_values[k] = grid.epsInf(k);
+        CudaScanSpectrum spectrum {problem.omega2.data(), problem.inv_omega.data(), problem.eps1.data(),
+                                   problem.eps2.data(), problem.weight.data(), problem.size()};
+        CudaScanGrid cuda_grid {omega_p.data(), n_wp, gamma.data(), n_gamma, eps_inf_values.data(), eps_inf_values.size()};
+        double best_error = 0.0;
+        uint64_t best_index = 0;
+        char message[256];
+        if (cudaScanErrorSurface(spectrum, cuda_grid, keep_surface ? result.surface.data() : nullptr,
+                                 &best_error, &best_index, message, sizeof(message)) != 0) {
+            throw std::runtime_error(std::string("Error: CUDA scan failed: ") + message);
+        }
+        if (best_index < total) {
+            setBest(best_index);
+            computeErrors(problem, result.eps_inf, &result.best.omega_p, &result.best.gamma, 1, &result.best.error);
+        }
+        return result;
+#else
+        throw std::runtime_error("Error: This build has no CUDA backend (build with -DMETAL_DISPERSION_CUDA"
+                                 " and link metal_dispersion_cuda.cu)");
+#endif
+    }
+
+    constexpr size_t kTile = GridSearch::kTile;
+    const size_t tiles_per_plane = (plane + kTile - 1) / kTile;
+    const size_t tiles = tiles_per_plane * grid.epsInfCount();
+    const bool prune = grid_pruning && !keep_surface;
+    const size_t workers = std::min<size_t>(threads ? threads : std::max(1u, std::thread::hardware_concurrency()), tiles);
+    GridSearch::IndexedBest best = GridSearch::searchTiles(tiles, workers, HUGE_VAL,
+                                                           [&](size_t tile, double cutoff, GridSearch::IndexedBest& out) {
+        double omega_p[kTile], gamma[kTile], errors[kTile];
+        const size_t k = tile / tiles_per_plane;
+        const size_t first = tile % tiles_per_plane * kTile;
+        const size_t count = std::min(kTile, plane - first);
+        for (size_t c = 0; c < count; ++c) {
+            omega_p[c] = grid.plane.omegaP((first + c) / n_gamma);
+            gamma[c] = grid.plane.gamma((first + c) % n_gamma);
+        }
+        double* errs = keep_surface ? result.surface.data() + k * plane + first : errors;
+        if (prune)
+            computeErrorsBounded(problem, grid.epsInf(k), omega_p, gamma, count, errs, cutoff);
+        else
+            computeErrors(problem, grid.epsInf(k), omega_p, gamma, count, errs);
+        for (size_t c = 0; c < count; ++c)
+            out.offer(errs[c], k * plane + first + c);
+    });
+    if (best.index < total) {
+        setBest(best.index);
+        result.best.error = best.error;
+    }
+    return result;
+}
+
+// Thin-film forward solver: reflectance and transmittance of a film (complex ε) between a
+// transparent ambient and substrate, by the characteristic-matrix (Airy) solution of the
+// three-layer stack. For polarization s the tilted admittance of layer j is Y = q_j and for p
+// (H-field amplitudes) Y = q_j / ε_j, with q_j = sqrt(ε_j − n₀² sin²θ₀); the film phase is
+// β = 2π q₁ d / λ, and with E = exp(iβ)
+//   r = (r₀₁ + r₁₂E²) / (1 + r₀₁r₁₂E²),   t = t₀₁t₁₂E / (1 + r₀₁r₁₂E²),
+//   R = |r|²,   T = Re Y₂ / Re Y₀ · |t|².
+
+// Optical constants of the film on a wavelength grid (SoA).
+struct FilmSpectrum {
+    std::vector<double> wavelength;   // nm
+    std::vector<double> eps1, eps2;
+};
+
+// Measured ε of 'material' at its data wavelengths.
+FilmSpectrum filmSpectrum(const Material& material) {
+    return {material.getWavelength(), material.computeEpsilon().first, material.computeEpsilon().second};
+}
+
+// Drude ε (drude_eps()) with the given parameters at 'wavelength' (nm).
+FilmSpectrum filmSpectrum(const std::vector<double>& wavelength, double eps_inf, double omega_p, double gamma) {
+    FilmSpectrum spectrum {wavelength, std::vector<double>(wavelength.size()), std::vector<double>(wavelength.size())};
+    for (size_t i = 0; i < wavelength.size(); ++i) {
+        std::complex<double> eps = drude_eps((2*pi*c) / (wavelength[i]*1e-9), eps_inf, omega_p, gamma);
+        spectrum.eps1[i] = eps.real();
+        spectrum.eps2[i] = eps.imag();
+    }
+    return spectrum;
+}
+
+// Sweep of thickness film.thickness(t) (nm) × angle of incidence angle(a) (degrees in the
+// ambient) × every spectrum wavelength; grid points are min + i*step strictly below max.
+struct FilmSweep {
+    double thickness_min, thickness_max, dthickness;
+    double angle_min, angle_max, dangle;
+    double ambient_index = 1.0;      // n₀ (real)
+    double substrate_index = 1.52;   // n₂ (real)
+
+    double thickness(size_t t) const { return thickness_min + t * dthickness; }
+    double angle(size_t a) const { return angle_min + a * dangle; }
+    size_t thicknessCount() const { return ParameterGrid::countPoints(thickness_min, thickness_max, dthickness); }
+    size_t angleCount() const { return ParameterGrid::countPoints(angle_min, angle_max, dangle); }
+};
+
+// Outcome of solveFilmSweep(): R and T per polarization, one block [thickness][angle][wavelength]
+// per quantity.
+struct FilmResult {
+    enum Quantity { Rs, Rp, Ts, Tp, QuantityCount };
+    size_t thicknesses = 0, angles = 0, wavelengths = 0;
+    std::vector<double> values;   // [quantity][thickness][angle][wavelength]
+
+    size_t size() const { return thicknesses * angles * wavelengths; }
+    size_t index(size_t t, size_t a, size_t w) const { return (t * angles + a) * wavelengths + w; }
+    double* data(Quantity q) { return values.data() + q * size(); }
+    double at(Quantity q, size_t t, size_t a, size_t w) const { return values[q * size() + index(t, a, w)]; }
+};
+
+namespace kernels {
+
+// Per-wavelength terms of one angle that do not depend on the thickness (SoA, one entry per
+// wavelength of a chunk): film phase per nm k₀q₁ and its factor exp(i k₀q₁ Δd) per thickness
+// step, and per polarization r₀₁, r₁₂, r₀₁r₁₂ and the factor Re Y₂/Re Y₀ · |t₀₁t₁₂|² of T.
+// e is the film phase factor exp(i k₀q₁ d) of the thickness being computed.
+struct FilmTerms {
+    std::vector<double> phase_re, phase_im, step_re, step_im, e_re, e_im;
+    std::vector<double> r01_re[2], r01_im[2], r12_re[2], r12_im[2], rho_re[2], rho_im[2], t_scale[2];
+
+    void resize(size_t n) {
+        for (std::vector<double>* v : {&phase_re, &phase_im, &step_re, &step_im, &e_re, &e_im})
+            v->resize(n);
+        for (int p = 0; p < 2; ++p)
+            for (std::vector<double>* v : {&r01_re[p], &r01_im[p], &r12_re[p], &r12_im[p],
+                                           &rho_re[p], &rho_im[p], &t_scale[p]})
+                v->resize(n);
+    }
+};
+
+// Film phase factors are advanced from one thickness to the next by one complex product
+// (uniform thickness steps) and recomputed exactly every kFilmReanchor thicknesses, which
+// bounds the rounding drift to a few ulp.
+constexpr size_t kFilmReanchor = 32;
+
+// R and T at one thickness of the Lanes wavelengths with terms at [j, j + Lanes), the first
+// 'valid' of them stored at results[quantity] + offset, then their phase factors e advanced to
+// the next thickness. Every lane loop has a fixed length and reads the terms or writes the
+// output, never both, so it vectorizes per instruction set without aliasing checks.
+template <size_t Lanes>
+METAL_DISPERSION_INLINE void filmLanes(FilmTerms& terms, size_t j, double* const* results, size_t offset,
+                                       size_t valid) {
+    double e_re[Lanes], e_im[Lanes], e2_re[Lanes], e2_im[Lanes], e_norm[Lanes];
+    for (size_t l = 0; l < Lanes; ++l) {
+        e_re[l] = terms.e_re[j + l];
+        e_im[l] = terms.e_im[j + l];
+        e2_re[l] = e_re[l]*e_re[l] - e_im[l]*e_im[l];
+        e2_im[l] = 2*e_re[l]*e_im[l];
+        e_norm[l] = e_re[l]*e_re[l] + e_im[l]*e_im[l];
+    }
+    for (int p = 0; p < 2; ++p) {
+        const double* r01_re = terms.r01_re[p].data() + j;
+        const double* r01_im = terms.r01_im[p].data() + j;
+        const double* r12_re = terms.r12_re[p].data() + j;
+        const double* r12_im = terms.r12_im[p].data() + j;
+        const double* rho_re = terms.rho_re[p].data() + j;
+        const double* rho_im = terms.rho_im[p].data() + j;
+        const double* t_scale = terms.t_scale[p].data() + j;
+        double r[Lanes], tr[Lanes];
+        for (size_t l = 0; l < Lanes; ++l) {
+            const double num_re = r01_re[l] + r12_re[l]*e2_re[l] - r12_im[l]*e2_im[l];
+            const double num_im = r01_im[l] + r12_re[l]*e2_im[l] + r12_im[l]*e2_re[l];
+            const double den_re = 1.0 + rho_re[l]*e2_re[l] - rho_im[l]*e2_im[l];
+            const double den_im = rho_re[l]*e2_im[l] + rho_im[l]*e2_re[l];
+            const double inv_den2 = 1.0 / (den_re*den_re + den_im*den_im);
+            r[l] = (num_re*num_re + num_im*num_im) * inv_den2;
+            tr[l] = t_scale[l] * e_norm[l] * inv_den2;
+        }
+        if (valid == Lanes) {
+            for (size_t l = 0; l < Lanes; ++l) {
+                results[p][offset + l] = r[l];
+                results[2 + p][offset + l] = tr[l];
+            }
+        } else {
+            std::memcpy(results[p] + offset, r, valid * sizeof(double));
+            std::memcpy(results[2 + p] + offset, tr, valid * sizeof(double));
+        }
+    }
+    const double* step_re = terms.step_re.data() + j;
+    const double* step_im = terms.step_im.data() + j;
+    double next_re[Lanes], next_im[Lanes];
+    for (size_t l = 0; l < Lanes; ++l) {
+        next_re[l] = e_re[l]*step_re[l] - e_im[l]*step_im[l];
+        next_im[l] = e_re[l]*step_im[l] + e_im[l]*step_re[l];
+    }
+    for (size_t l = 0; l < Lanes; ++l) {
+        terms.e_re[j + l] = next_re[l];
+        terms.e_im[j + l] = next_im[l];
+    }
+}
+
+// R and T of the chunk's wavelengths [w, w + count) at angle a for every thickness of 'sweep'
+// ('terms' sized to a multiple of Lanes). The thickness loop is the outer one, so each
+// thickness writes the chunk's part of every output row [thickness][angle][wavelength] in one
+// contiguous run. The last partial group of lanes runs on copies of the last wavelength's
+// terms and stores only its valid lanes.
+template <size_t Lanes>
+METAL_DISPERSION_INLINE void filmChunkLanes(FilmTerms& terms, const FilmSweep& sweep, size_t a, size_t w,
+                                            size_t count, FilmResult& out) {
+    const size_t padded = (count + Lanes - 1) / Lanes * Lanes;
+    for (size_t k = count; k < padded; ++k) {
+        for (std::vector<double>* v : {&terms.phase_re, &terms.phase_im})
+            (*v)[k] = (*v)[count - 1];
+        for (int p = 0; p < 2; ++p)
+            for (std::vector<double>* v : {&terms.r01_re[p], &terms.r01_im[p], &terms.r12_re[p], &terms.r12_im[p],
+                                           &terms.rho_re[p], &terms.rho_im[p], &terms.t_scale[p]})
+                (*v)[k] = (*v)[count - 1];
+    }
+    for (size_t i = 0; i < padded; ++i) {
+        const double decay = std::exp(-terms.phase_im[i] * sweep.dthickness);
+        terms.step_re[i] = decay * std::cos(terms.phase_re[i] * sweep.dthickness);
+        terms.step_im[i] = decay * std::sin(terms.phase_re[i] * sweep.dthickness);
+    }
+    double* results[4] = {out.data(FilmResult::Rs), out.data(FilmResult::Rp),
+                          out.data(FilmResult::Ts), out.data(FilmResult::Tp)};
+    for (size_t t = 0; t < out.thicknesses; ++t) {
+        if (t % kFilmReanchor == 0) {
+            const double d = sweep.thickness(t);
+            for (size_t i = 0; i < padded; ++i) {
+                const double decay = std::exp(-terms.phase_im[i] * d);
+                terms.e_re[i] = decay * std::cos(terms.phase_re[i] * d);
+                terms.e_im[i] = decay * std::sin(terms.phase_re[i] * d);
+            }
+        }
+        const size_t row = out.index(t, a, w);
+        size_t j = 0;
+        for (; j + Lanes <= count; j += Lanes)
+            filmLanes<Lanes>(terms, j, results, row + j, Lanes);
+        if (j < count)
+            filmLanes<Lanes>(terms, j, results, row + j, count - j);
+    }
+}
+
+void filmChunkScalar(FilmTerms& terms, const FilmSweep& sweep, size_t a, size_t w, size_t count, FilmResult& out) {
+    filmChunkLanes<2>(terms, sweep, a, w, count, out);
+}
+
+#ifdef METAL_DISPERSION_X86_SIMD
+__attribute__((target("avx2,fma")))
+void filmChunkAVX2(FilmTerms& terms, const FilmSweep& sweep, size_t a, size_t w, size_t count, FilmResult& out) {
+    filmChunkLanes<4>(terms, sweep, a, w, count, out);
+}
+
+__attribute__((target("avx512f")))
+void filmChunkAVX512(FilmTerms& terms, const FilmSweep& sweep, size_t a, size_t w, size_t count, FilmResult& out) {
+    filmChunkLanes<8>(terms, sweep, a, w, count, out);
+}
+#endif
+
+} // namespace kernels
+
+// Film kernel for one instruction set (same selection as availableDrudeKernels()).
+struct FilmKernels {
+    const char* name;
+    void (*chunk)(kernels::FilmTerms&, const FilmSweep&, size_t a, size_t w, size_t count, FilmResult&);
+};
+
+std::vector<FilmKernels> availableFilmKernels() {
+    std::vector<FilmKernels> available;
+#ifdef METAL_DISPERSION_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        available.push_back({"avx512", kernels::filmChunkAVX512});
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        available.push_back({"avx2", kernels::filmChunkAVX2});
+#endif
+    available.push_back({"scalar", kernels::filmChunkScalar});
+    return available;
+}
+
+const FilmKernels& filmKernels() {
+    static const FilmKernels selected = availableFilmKernels().front();
+    return selected;
+}
+
+// R and T of the film with optical constants 'spectrum' over the whole 'sweep'. Work items are
+// (angle, chunk of kFilmChunk wavelengths), taken by 'threads' workers from a shared counter;
+// within an item the kernel runs one register of wavelengths at a time using the
+// thickness-independent terms computed once per wavelength and angle.
+FilmResult solveFilmSweep(const FilmSpectrum& spectrum, const FilmSweep& sweep, unsigned threads,
+                          const FilmKernels& kernel = filmKernels()) {
+    ScopedTimer timer ("film");
+    constexpr size_t kFilmChunk = 256;
+    FilmResult out;
+    out.thicknesses = sweep.thicknessCount();
+    out.angles = sweep.angleCount();
+    out.wavelengths = spectrum.wavelength.size();
+    const size_t total = out.size();
+    out.values.resize(FilmResult::QuantityCount * total);
+    if (total == 0)
+        return out;
+
+    const size_t chunks = (out.wavelengths + kFilmChunk - 1) / kFilmChunk;
+    const size_t items = chunks * out.angles;
+    const size_t workers = std::min<size_t>(threads ? threads : std::max(1u, std::thread::hardware_concurrency()), items);
+    const double n0 = sweep.ambient_index, n2 = sweep.substrate_index;
+    std::atomic<size_t> next_item {0};
+    auto work = [&](size_t) {
+        kernels::FilmTerms terms;
+        terms.resize(kFilmChunk);
+        for (size_t item; (item = next_item++) < items; ) {
+            const size_t a = item / chunks;
+            const size_t first = item % chunks * kFilmChunk;
+            const size_t count = std::min(kFilmChunk, out.wavelengths - first);
+            const double sin0 = n0 * std::sin(sweep.angle(a) * (kPi / 180));
+            const std::complex<double> eps0 (n0 * n0, 0.0), eps2 (n2 * n2, 0.0);
+            const std::complex<double> q0 = std::sqrt(eps0 - sin0 * sin0), q2 = std::sqrt(eps2 - sin0 * sin0);
+            for (size_t i = 0; i < count; ++i) {
+                const size_t w = first + i;
+                const std::complex<double> eps1 (spectrum.eps1[w], spectrum.eps2[w]);
+                const std::complex<double> q1 = std::sqrt(eps1 - sin0 * sin0);   // Im q₁ >= 0: decaying
+                const std::complex<double> phase = (2*kPi / spectrum.wavelength[w]) * q1;
+                terms.phase_re[i] = phase.real();
+                terms.phase_im[i] = phase.imag();
+                for (int p = 0; p < 2; ++p) {
+                    const std::complex<double> y0 = p ? q0 / eps0 : q0, y1 = p ? q1 / eps1 : q1, y2 = p ? q2 / eps2 : q2;
+                    const std::complex<double> r01 = (y0 - y1) / (y0 + y1), r12 = (y1 - y2) / (y1 + y2);
+                    const std::complex<double> rho = r01 * r12;
+                    const std::complex<double> t012 = 4.0 * y0 * y1 / ((y0 + y1) * (y1 + y2));
+                    terms.r01_re[p][i] = r01.real();
+                    terms.r01_im[p][i] = r01.imag();
+                    terms.r12_re[p][i] = r12.real();
+                    terms.r12_im[p][i] = r12.imag();
+                    terms.rho_re[p][i] = rho.real();
+                    terms.rho_im[p][i] = rho.imag();
+                    terms.t_scale[p][i] = y0.real() > 0.0 ? y2.real() / y0.real() * std::norm(t012) : 0.0;
+                }
+            }
+            kernel.chunk(terms, sweep, a, first, count, out);
+        }
+    };
+    GridSearch::parallel(workers, work);
+    Profiler::count(Profiler::FilmPoints, total);
+    return out;
+}
+
+// Tuning of the Levenberg–Marquardt fitter.
+struct LMOptions {
+    bool fit_eps_inf = false;     // fit eps_inf too (otherwise it stays at its starting value)
+    size_t max_iterations = 100;
+    double ftol = 1e-12;          // converged when the relative error reduction drops below ftol
+    double xtol = 1e-10;          // ... or when every relative parameter change drops below xtol
+    double lambda0 = 1e-3;        // initial damping
+};
+
+// Outcome of a LevenbergMarquardt fit.
+template <class Model>
+struct ModelFit {
+    typename Model::Params params {};
+    double error = 1e300;
+    size_t evaluations = 0;       // passes over the data (model evaluations and Jacobian passes)
+    size_t iterations = 0;
+    bool converged = false;
+};
+
+// Gaussian elimination with partial pivoting on the leading n×n block of the K×K row-major
+// matrix M; b is overwritten with x.
+template <size_t K>
+bool solveLinearSystem(std::array<double, K * K>& M, std::array<double, K>& b, size_t n) {
+    for (size_t col = 0; col < n; ++col) {
+        size_t pivot = col;
+        for (size_t row = col + 1; row < n; ++row)
+            if (std::fabs(M[row*K + col]) > std::fabs(M[pivot*K + col])) pivot = row;
+        if (!(std::fabs(M[pivot*K + col]) > 0.0))
+            return false;
+        if (pivot != col) {
+            for (size_t k = 0; k < n; ++k) std::swap(M[pivot*K + k], M[col*K + k]);
+            std::swap(b[pivot], b[col]);
+        }
+        for (size_t row = col + 1; row < n; ++row) {
+            double f = M[row*K + col] / M[col*K + col];
+            for (size_t k = col; k < n; ++k) M[row*K + k] -= f * M[col*K + k];
+            b[row] -= f * b[col];
+        }
+    }
+    for (size_t row = n; row-- > 0;) {
+        for (size_t k = row + 1; k < n; ++k) b[row] -= M[row*K + k] * b[k];
+        b[row] /= M[row*K + row];
+    }
+    return true;
+}
+
+// Levenberg–Marquardt least-squares fit of a model policy (DrudeModel, DrudeLorentzModel<N>, ...).
+// Minimizes the same normalized error as computeError(): the residuals are
+// (Re ε_model − ε₁)/|ε_data| and (Im ε_model − ε₂)/|ε_data| over the FitProblem samples.
+// Trial points are scored by the vectorized model kernel, which also stores the model ε of
+// every sample; only accepted points get a Jacobian pass, which reuses those values for the
+// residuals and builds JᵀJ and Jᵀr from Model::derivatives(). All parameter-sized storage is
+// fixed by Model::kParams and lives on the stack. ε∞ is fitted only with options.fit_eps_inf.
+// Damping is scaled by diag(JᵀJ) (Marquardt's variant), which makes the steps independent
+// of the very different magnitudes of the parameters.
+template <class Model>
+class LevenbergMarquardt {
+public:
+    static constexpr size_t kParams = Model::kParams;
+    using Params = typename Model::Params;
+    using Vector = std::array<double, kParams>;
+    using Matrix = std::array<double, kParams * kParams>;
+
+    LevenbergMarquardt(const FitProblem& problem, const LMOptions& options = {})
+        : problem_(problem), options_(options) {
+        for (size_t i = 0; i < kParams; ++i)
+            if (options_.fit_eps_inf || i != Model::kEpsInf)
+                free_[free_count_++] = i;
+    }
+
+    // Model ε buffers of fit(); passing the same workspace to repeated fits (of problems of at
+    // most the same size) avoids allocating them every time.
+    struct Workspace {
+        std::vector<double> eps1, eps2, trial_eps1, trial_eps2;
+    };
+
+    ModelFit<Model> fit(const Params& start) const {
+        Workspace workspace;
+        return fit(start, workspace);
+    }
+
+    ModelFit<Model> fit(const Params& start, Workspace& workspace) const {
+        ScopedTimer timer ("levenberg_marquardt");
+        const size_t n = free_count_;
+        const size_t samples = problem_.size();
+        Params x = start;
+        std::vector<double>& eps1 = workspace.eps1;
+        std::vector<double>& eps2 = workspace.eps2;
+        std::vector<double>& trial_eps1 = workspace.trial_eps1;
+        std::vector<double>& trial_eps2 = workspace.trial_eps2;
+        for (std::vector<double>* buffer : {&eps1, &eps2, &trial_eps1, &trial_eps2})
+            buffer->resize(samples);
+        Matrix A {}, M {};
+        Vector g {}, delta {};
+
+        ModelFit<Model> result;
+        double cost = evaluate(x, eps1, eps2);
+        normalEquations(x, eps1, eps2, A, g);
+        size_t passes = 2;
+        double lambda = options_.lambda0;
+
+        while (result.iterations < options_.max_iterations && !result.converged) {
+            ++result.iterations;
+            Profiler::count(Profiler::FitterIterations);
+            bool accepted = false;
+            while (!accepted) {
+                // Solve (JᵀJ + λ·diag(JᵀJ)) δ = −Jᵀr over the free parameters
+                M = A;
+                for (size_t i = 0; i < n; ++i) {
+                    M[i*kParams + i] += lambda * A[i*kParams + i];
+                    delta[i] = -g[i];
+                }
+                bool solved = solveLinearSystem<kParams>(M, delta, n);
+
+                Params trial = x;
+                for (size_t i = 0; solved && i < n; ++i) trial[free_[i]] += delta[i];
+
+                double trial_cost = 1e300;
+                if (solved && Model::feasible(trial)) {
+                    trial_cost = evaluate(trial, trial_eps1, trial_eps2);
+                    ++passes;
+                }
+
+                if (trial_cost < cost) {
+                    bool small_step = true;
+                    for (size_t i = 0; i < n; ++i)
+                        small_step = small_step && std::fabs(delta[i]) <= options_.xtol * std::fabs(x[free_[i]]);
+                    result.converged = small_step || (cost - trial_cost) <= options_.ftol * cost;
+
+                    x = trial;
+                    eps1.swap(trial_eps1);
+                    eps2.swap(trial_eps2);
+                    cost = trial_cost;
+                    if (!result.converged) {
+                        normalEquations(x, eps1, eps2, A, g);
+                        ++passes;
+                    }
+                    lambda = std::max(lambda / 10.0, 1e-12);
+                    accepted = true;
+                } else {
+                    // No downhill step left even with heavy damping: we are at the minimum.
+                    lambda *= 10.0;
+                    if (lambda > 1e12) {
+                        result.converged = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        result.params = x;
+        result.error = cost;
+        result.evaluations = passes;
+        return result;
+    }
+
+private:
+    // Model ε of every sample and the error at x (one vectorized pass).
+    double evaluate(const Params& x, std::vector<double>& eps1, std::vector<double>& eps2) const {
+        Profiler::count(Profiler::ErrorEvaluations);
+        return modelKernels<Model>().error(problem_, x, eps1.data(), eps2.data());
+    }
+
+    // JᵀJ (A) and Jᵀr (g) of the free parameters at x, with the model values eps1/eps2 from evaluate().
+    void normalEquations(const Params& x, const std::vector<double>& eps1, const std::vector<double>& eps2,
+                         Matrix& A, Vector& g) const {
+        Profiler::count(Profiler::ErrorEvaluations);
+        const size_t n = free_count_;
+        const FitProblem& fp = problem_;
+        A.fill(0.0);
+        g.fill(0.0);
+        for (size_t i = 0; i < fp.size(); i++) {
+            double d1[kParams], d2[kParams];   // ∂Re ε/∂x, ∂Im ε/∂x of this sample
+            Model::derivatives(x, fp.omega[i], fp.omega2[i], fp.inv_omega[i], d1, d2);
+
+            const double inv_scale = std::sqrt(fp.weight[i]);
+            const double r1 = (eps1[i] - fp.eps1[i]) * inv_scale;
+            const double r2 = (eps2[i] - fp.eps2[i]) * inv_scale;
+            double j1[kParams], j2[kParams];
+            for (size_t a = 0; a < n; ++a) {
+                j1[a] = d1[free_[a]] * inv_scale;
+                j2[a] = d2[free_[a]] * inv_scale;
+                g[a] += j1[a] * r1 + j2[a] * r2;
+            }
+            for (size_t a = 0; a < n; ++a)
+                for (size_t b = a; b < n; ++b)
+                    A[a*kParams + b] += j1[a] * j1[b] + j2[a] * j2[b];
+        }
+        for (size_t a = 0; a < n; ++a)
+            for (size_t b = 0; b < a; ++b)
+                A[a*kParams + b] = A[b*kParams + a];
+    }
+
+    const FitProblem& problem_;
+    LMOptions options_;
+    std::array<size_t, kParams> free_ {};   // indices of the fitted parameters
+    size_t free_count_ = 0;
+};
+
+// Confidence interval of one fitted parameter.
+struct ParameterInterval {
+    double lower = 0.0;
+    double upper = 0.0;
+    double std_error = 0.0;   // standard deviation over the replicates
+};
+
+// Outcome of bootstrapDrude(). replicates == 0 when no bootstrap was run.
+struct BootstrapResult {
+    size_t replicates = 0;     // converged replicates the intervals are based on
+    size_t failed = 0;         // replicates whose fit did not converge (left out)
+    double confidence = 0.0;
+    ParameterInterval omega_p, gamma, eps_inf;
+};
+
+// Outcome of fitDrude(): the best point, the eps_inf used (or fitted) and fitter diagnostics.
+struct DrudeFit {
+    FitResult fit;
+    double eps_inf = 0.0;
+    size_t iterations = 0;      // Levenberg–Marquardt iterations (0 for the grid searches)
+    bool converged = true;
+    std::vector<LorentzOscillator> oscillators;   // Drude–Lorentz fits only
+    double window_min = omega_min;   // ω range of the fitted samples (rad/s)
+    double window_max = omega_max;
+    BootstrapResult bootstrap;       // set by bootstrapDrude()
+};
+
+// Grid points on each side of the float best point that polishDrude() rescores in double.
+constexpr size_t kPolishRadius = 2;
+
+// Double-precision end of a grid search run on FloatDrudeObjective: the (2·kPolishRadius + 1)²
+// points of 'grid' around the coarse best point (clipped to the grid) are rescored with
+// 'objective', and the best of them (the lowest index among equal errors, as in GridSearch)
+// is returned with its double error. The float errors only have to rank the grid to within
+// this window, which they do with a wide margin (~1e-6 relative against the error changes
+// between neighbouring points).
+FitResult polishDrude(const DrudeObjective& objective, const ParameterGrid& grid, const FitResult& coarse) {
+    ScopedTimer timer ("polish");
+    const size_t n_omega_p = grid.omegaPCount();
+    const size_t n_gamma = grid.gammaCount();
+    if (n_omega_p == 0 || n_gamma == 0)
+        return coarse;
+    auto nearest = [](double value, double min, double step, size_t count) {
+        double index = std::round((value - min) / step);
+        return static_cast<size_t>(std::clamp(index, 0.0, static_cast<double>(count - 1)));
+    };
+    const size_t ci = nearest(coarse.omega_p, grid.omega_p_min, grid.domega_p, n_omega_p);
+    const size_t cj = nearest(coarse.gamma, grid.gamma_min, grid.dgamma, n_gamma);
+
+    constexpr size_t kWindow = (2 * kPolishRadius + 1) * (2 * kPolishRadius + 1);
+    double wp[kWindow], g[kWindow], errors[kWindow];
+    size_t count = 0;
+    for (size_t i = ci - std::min(ci, kPolishRadius); i <= std::min(ci + kPolishRadius, n_omega_p - 1); ++i)
+        for (size_t j = cj - std::min(cj, kPolishRadius); j <= std::min(cj + kPolishRadius, n_gamma - 1); ++j) {
+            wp[count] = grid.omegaP(i);
+            g[count] = grid.gamma(j);
+            ++count;
+        }
+    objective(wp, g, count, errors);
+
+    FitResult best;
+    for (size_t k = 0; k < count; ++k)
+        if (errors[k] < best.error) {
+            best.error = errors[k];
+            best.omega_p = wp[k];
+            best.gamma = g[k];
+        }
+    best.evaluations = coarse.evaluations + count;
+    return best;
+}
+
+// Fits the Drude model to 'problem' with the given search strategy on 'threads' workers.
+DrudeFit fitDrude(const FitProblem& problem, SearchMode mode, unsigned threads) {
+    ScopedTimer timer ("fit");
+    // Grid search over plasma frequency and damping rate
+    // to minimize squared error between experimental and model permittivity
+    DrudeObjective objective {problem, eps_inf, fit_eps_inf};
+    // With mixed_precision the searches run in float: the grid search ends with polishDrude(),
+    // the coarse-to-fine search with a last level in double, LM refines its float seed in double.
+    const bool mixed = mixed_precision && !fit_eps_inf;
+    const FloatFitProblem float_problem = mixed ? FloatFitProblem(problem) : FloatFitProblem();
+    FloatDrudeObjective float_objective {float_problem, eps_inf};
+    DrudeFit result;
+    if (mode == SearchMode::LevenbergMarquardt) {
+        // Seed from a small coarse grid, then converge with Levenberg–Marquardt
+        size_t points = std::max<size_t>(lm_seed_points, 1);
+        ParameterGrid seed_grid {omega_p_min, omega_p_max, (omega_p_max - omega_p_min) / points,
+                                 gamma_min, gamma_max, (gamma_max - gamma_min) / points};
+        FitResult seed = mixed ? GridSearch(seed_grid, threads).run(float_objective)
+                               : GridSearch(seed_grid, threads).run(objective);
+
+        LMOptions options;
+        options.fit_eps_inf = fit_eps_inf;
+        ModelFit<DrudeModel> lm = LevenbergMarquardt<DrudeModel>(problem, options)
+                                      .fit({seed.omega_p, seed.gamma, objective.bestEpsInf(seed.omega_p, seed.gamma)});
+        result.fit.error = lm.error;
+        result.fit.omega_p = lm.params[0];
+        result.fit.gamma = lm.params[1];
+        result.fit.evaluations = lm.evaluations + seed.evaluations;
+        result.eps_inf = lm.params[DrudeModel::kEpsInf];
+        result.iterations = lm.iterations;
+        result.converged = lm.converged;
+    } else if (mode == SearchMode::Refine) {
+        ParameterGrid grid {omega_p_min, omega_p_max, refine_domega_p, gamma_min, gamma_max, refine_dgamma};
+        RefiningSearch search (grid, RefineOptions(), threads);
+        result.fit = mixed ? search.run(float_objective, objective) : search.run(objective);
+    } else {
+        ParameterGrid grid {omega_p_min, omega_p_max, domega_p, gamma_min, gamma_max, dgamma};
+        result.fit = mixed ? polishDrude(objective, grid, GridSearch(grid, threads).run(float_objective))
+                           : GridSearch(grid, threads).run(objective);
+    }
+    if (mode != SearchMode::LevenbergMarquardt)
+        result.eps_inf = objective.bestEpsInf(result.fit.omega_p, result.fit.gamma);
+    return result;
+}
+
+// Drude–Lorentz fit with a compile-time number of oscillators N == lorentz_seed.size().
+template <size_t N>
+DrudeFit fitDrudeLorentzModel(const FitProblem& problem, const DrudeFit& drude) {
+    using Model = DrudeLorentzModel<N>;
+    typename Model::Params start {drude.fit.omega_p, drude.fit.gamma, std::max(drude.eps_inf, 1.0)};
+    for (size_t j = 0; j < N; ++j) {
+        start[3 + 3*j] = lorentz_seed[j].strength;
+        start[3 + 3*j + 1] = lorentz_seed[j].omega0;
+        start[3 + 3*j + 2] = lorentz_seed[j].gamma;
+    }
+    LMOptions options;
+    options.fit_eps_inf = true;
+    ModelFit<Model> lm = LevenbergMarquardt<Model>(problem, options).fit(start);
+
+    DrudeFit result;
+    result.fit.error = lm.error;
+    result.fit.omega_p = lm.params[0];
+    result.fit.gamma = lm.params[1];
+    result.fit.evaluations = drude.fit.evaluations + lm.evaluations;
+    result.eps_inf = lm.params[Model::kEpsInf];
+    result.iterations = lm.iterations;
+    result.converged = lm.converged;
+    for (size_t j = 0; j < N; ++j)
+        result.oscillators.push_back({lm.params[3 + 3*j], lm.params[3 + 3*j + 1], lm.params[3 + 3*j + 2]});
+    return result;
+}
+
+// Largest lorentz_seed supported by fitDrudeLorentz() (one model instantiation per count).
+constexpr size_t max_lorentz_oscillators = 4;
+
+// Fits the Drude–Lorentz model to every sample of 'problem' (normally the full data range).
+// The Drude term starts from fitDrude() on the samples inside omega_min..omega_max, the
+// oscillators from lorentz_seed; ε∞ and all oscillator parameters are then fitted together.
+DrudeFit fitDrudeLorentz(const FitProblem& problem, SearchMode mode, unsigned threads) {
+    ScopedTimer timer ("fit");
+    FitProblem drude_window (problem.omega, problem.eps1, problem.eps2);
+    if (drude_window.size() == 0) {
+        throw std::runtime_error("Error: No data points inside the Drude window to seed the Drude-Lorentz fit");
+    }
+    DrudeFit drude = fitDrude(drude_window, mode, threads);
+
+    DrudeFit result;
+    switch (lorentz_seed.size()) {
+        case 0: result = fitDrudeLorentzModel<0>(problem, drude); break;
+        case 1: result = fitDrudeLorentzModel<1>(problem, drude); break;
+        case 2: result = fitDrudeLorentzModel<2>(problem, drude); break;
+        case 3: result = fitDrudeLorentzModel<3>(problem, drude); break;
+        case 4: result = fitDrudeLorentzModel<4>(problem, drude); break;
+        default:
+            throw std::runtime_error("Error: At most " + std::to_string(max_lorentz_oscillators)
+                                     + " Lorentz oscillators are supported");
+    }
+    result.window_min = *std::min_element(problem.omega.begin(), problem.omega.end());
+    result.window_max = *std::max_element(problem.omega.begin(), problem.omega.end());
+    return result;
+}
+
+// Linear interpolation between the order statistics of the sorted values (q in [0, 1]).
+double quantile(const std::vector<double>& sorted, double q) {
+    const double pos = q * (sorted.size() - 1);
+    const size_t lo = static_cast<size_t>(pos);
+    const size_t hi = std::min(lo + 1, sorted.size() - 1);
+    return sorted[lo] + (pos - lo) * (sorted[hi] - sorted[lo]);
+}
+
+// Percentile bootstrap of a Drude fit. Each replicate resamples the in-window points with
+// replacement, which for a weighted least-squares error is the same as multiplying every
+// sample weight by the number of times it was drawn; so a replicate only rewrites the weights
+// of a per-thread copy of 'problem' and nothing is reallocated. Replicates are refitted with
+// Levenberg–Marquardt started at the full-data optimum 'fit', which converges in a few
+// iterations (the grid searches would dominate the cost otherwise); ε∞ is refitted with
+// fit_eps_inf. Replicate r draws from its own generator seeded with (seed, r), so the result
+// does not depend on the number of threads.
+BootstrapResult bootstrapDrude(const FitProblem& problem, const DrudeFit& fit, size_t replicates,
+                               double confidence, uint64_t seed, unsigned threads) {
+    ScopedTimer timer ("bootstrap");
+    BootstrapResult result;
+    result.confidence = confidence;
+    const size_t samples = problem.size();
+    if (replicates == 0 || samples == 0)
+        return result;
+
+    LMOptions options;
+    options.fit_eps_inf = fit_eps_inf;
+    const DrudeModel::Params start {fit.fit.omega_p, fit.fit.gamma, fit.eps_inf};
+    std::vector<DrudeModel::Params> params (replicates);
+    std::vector<char> converged (replicates, 0);
+
+    const size_t workers = std::min<size_t>(threads ? threads : std::max(1u, std::thread::hardware_concurrency()),
+                                            replicates);
+    auto work = [&](size_t t) {
+        FitProblem sample = problem;
+        std::vector<uint32_t> counts (samples);
+        LevenbergMarquardt<DrudeModel> lm (sample, options);
+        LevenbergMarquardt<DrudeModel>::Workspace workspace;
+        std::uniform_int_distribution<size_t> pick (0, samples - 1);
+        for (size_t r = t; r < replicates; r += workers) {
+            std::seed_seq seq {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32),
+                               static_cast<uint32_t>(r), static_cast<uint32_t>(r >> 32)};
+            std::mt19937_64 rng (seq);
+            std::fill(counts.begin(), counts.end(), 0u);
+            for (size_t i = 0; i < samples; ++i)
+                ++counts[pick(rng)];
+            sample.weight_sum = 0.0;
+            for (size_t i = 0; i < samples; ++i) {
+                sample.weight[i] = problem.weight[i] * counts[i];
+                sample.weight_sum += sample.weight[i];
+            }
+            ModelFit<DrudeModel> replicate = lm.fit(start, workspace);
+            params[r] = replicate.params;
+            converged[r] = replicate.converged;
+        }
+    };
+    GridSearch::parallel(workers, work);
+
+    std::vector<double> values;
+    values.reserve(replicates);
+    auto interval = [&](size_t index) {
+        values.clear();
+        for (size_t r = 0; r < replicates; ++r)
+            if (converged[r])
+                values.push_back(params[r][index]);
+        ParameterInterval out;
+        if (values.empty())
+            return out;
+        std::sort(values.begin(), values.end());
+        out.lower = quantile(values, 0.5 * (1.0 - confidence));
+        out.upper = quantile(values, 0.5 * (1.0 + confidence));
+        double mean = 0.0, var = 0.0;
+        for (double v : values) mean += v;
+        mean /= values.size();
+        for (double v : values) var += (v - mean) * (v - mean);
+        out.std_error = values.size() > 1 ? std::sqrt(var / (values.size() - 1)) : 0.0;
+        return out;
+    };
+    result.omega_p = interval(0);
+    result.gamma = interval(1);
+    result.eps_inf = interval(DrudeModel::kEpsInf);
+    result.replicates = values.size();
+    result.failed = replicates - result.replicates;
+    return result;
+}
+
+// Record of the fit cache (<fit_cache_dir>/<key>.mdfit), followed by oscillator_count
+// LorentzOscillator records. Like the spectrum cache it is a local file in native byte order.
+struct FitCacheRecord {
+    char magic[8];              // "MDFIT1"
+    uint32_t header_size;
+    uint32_t oscillator_count;
+    uint64_t key;               // fitCacheKey() of the fit
+    double omega_p, gamma, eps_inf, error;
+    uint64_t evaluations;
+    uint64_t iterations;
+    uint32_t converged;
+    uint32_t reserved;
+    double window_min, window_max;
+    BootstrapResult bootstrap;
+};
+
+constexpr char fit_cache_magic[8] = "MDFIT1";
+
+// Cache key of a fit: fnv1a64 of the fitted samples (ω, ε₁, ε₂ inside the window, so the data
+// and the omega_min/omega_max window) and of every setting the result depends on. Thread
+// count and grid pruning leave the result unchanged and are not part of the key.
+uint64_t fitCacheKey(const FitProblem& problem, ModelType model, SearchMode mode) {
+    uint64_t hash = fnv1a64(fit_cache_magic, sizeof(fit_cache_magic));
+    auto add = [&hash](const auto& value) { hash = fnv1a64(&value, sizeof(value), hash); };
+    for (const std::vector<double>* values : {&problem.omega, &problem.eps1, &problem.eps2}) {
+        add(values->size());
+        hash = fnv1a64(values->data(), values->size() * sizeof(double), hash);
+    }
+    add(static_cast<int>(model));
+    add(static_cast<int>(mode));
+    for (double value : {eps_inf, omega_min, omega_max, omega_p_min, omega_p_max, gamma_min, gamma_max,
+                         domega_p, dgamma, refine_domega_p, refine_dgamma, bootstrap_confidence})
+        add(value);
+    for (size_t value : {lm_seed_points, bootstrap_replicates, bootstrap_seed})
+        add(value);
+    add(fit_eps_inf);
+    add(mixed_precision);
+    if (model == ModelType::DrudeLorentz) {
+        add(lorentz_seed.size());
+        for (const LorentzOscillator& o : lorentz_seed)
+            add(o);
+    }
+    return hash;
+}
+
+std::string fitCachePath(uint64_t key) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.mdfit", static_cast<unsigned long long>(key));
+    return (std::filesystem::path(fit_cache_dir) / name).string();
+}
+
+// Reads the cached fit for 'key' into fit; false if there is none or it is unreadable.
+bool readFitCache(uint64_t key, DrudeFit& fit) {
+    std::ifstream in (fitCachePath(key), std::ios::binary);
+    FitCacheRecord record;
+    if (!in || !in.read(reinterpret_cast<char*>(&record), sizeof(record))
+        || std::memcmp(record.magic, fit_cache_magic, sizeof(record.magic)) != 0
+        || record.header_size != sizeof(record) || record.key != key || record.oscillator_count > max_lorentz_oscillators)
+        return false;
+    std::vector<LorentzOscillator> oscillators (record.oscillator_count);
+    if (!in.read(reinterpret_cast<char*>(oscillators.data()), oscillators.size() * sizeof(LorentzOscillator)))
+        return false;
+    fit = DrudeFit();
+    fit.fit.omega_p = record.omega_p;
+    fit.fit.gamma = record.gamma;
+    fit.fit.error = record.error;
+    fit.fit.evaluations = record.evaluations;
+    fit.eps_inf = record.eps_inf;
+    fit.iterations = record.iterations;
+    fit.converged = record.converged != 0;
+    fit.oscillators = std::move(oscillators);
+    fit.window_min = record.window_min;
+    fit.window_max = record.window_max;
+    fit.bootstrap = record.bootstrap;
+    return true;
+}
+
+// Stores a fit under 'key' (written to a temporary file and renamed, so concurrent batch
+// workers never see a partial record). Failures only cost the speed-up and are reported.
+void writeFitCache(uint64_t key, const DrudeFit& fit) {
+    FitCacheRecord record {};
+    std::memcpy(record.magic, fit_cache_magic, sizeof(record.magic));
+    record.header_size = sizeof(record);
+    record.oscillator_count = static_cast<uint32_t>(fit.oscillators.size());
+    record.key = key;
+    record.omega_p = fit.fit.omega_p;
+    record.gamma = fit.fit.gamma;
+    record.eps_inf = fit.eps_inf;
+    record.error = fit.fit.error;
+    record.evaluations = fit.fit.evaluations;
+    record.iterations = fit.iterations;
+    record.converged = fit.converged;
+    record.window_min = fit.window_min;
+    record.window_max = fit.window_max;
+    record.bootstrap = fit.bootstrap;
+
+    const std::string path = fitCachePath(key);
+    const std::string tmp_path = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::error_code ec;
+    std::filesystem::create_directories(fit_cache_dir, ec);
+    {
+        std::ofstream out (tmp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        out.write(reinterpret_cast<const char*>(fit.oscillators.data()), fit.oscillators.size() * sizeof(LorentzOscillator));
+        if (!out) {
+            std::cerr << "Warning: could not write fit cache " << path << '\n';
+            return;
+        }
+    }
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        std::cerr << "Warning: could not write fit cache " << path << '\n';
+        std::filesystem::remove(tmp_path, ec);
+    }
+}
+
+// Fits 'problem' with the given model and search mode, bootstrap intervals included (Drude
+// model), or returns the cached result of an identical earlier fit when use_fit_cache is set;
+// *from_cache tells which.
+DrudeFit runFit(const FitProblem& problem, ModelType model, SearchMode mode, unsigned threads,
+                bool* from_cache = nullptr) {
+    uint64_t key = 0;
+    DrudeFit result;
+    if (use_fit_cache) {
+        key = fitCacheKey(problem, model, mode);
+        bool cached = readFitCache(key, result);
+        if (from_cache)
+            *from_cache = cached;
+        if (cached)
+            return result;
+    }
+    if (model == ModelType::DrudeLorentz) {
+        result = fitDrudeLorentz(problem, mode, threads);
+    } else {
+        result = fitDrude(problem, mode, threads);
+        result.bootstrap = bootstrapDrude(problem, result, bootstrap_replicates, bootstrap_confidence,
+                                          bootstrap_seed, threads);
+    }
+    if (use_fit_cache)
+        writeFitCache(key, result);
+    return result;
+}
+
+// Fixed set of worker threads running queued tasks. Tasks must not throw.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads = 0) {
+        unsigned count = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned t = 0; t < count; ++t)
+            workers_.emplace_back([this] { work(); });
+    }
+
+    // Finishes the queued tasks, then stops the workers.
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        ready_.notify_all();
+        for (std::thread& worker : workers_)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers_.size();
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push(std::move(task));
+        }
+        ready_.notify_one();
+    }
+
+    // Blocks until every submitted task has finished.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return tasks_.empty() && active_ == 0; });
+    }
+
+private:
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty())
+                    return;
+                task = std::move(tasks_.front());
+                tasks_.pop();
+                ++active_;
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --active_;
+                if (tasks_.empty() && active_ == 0)
+                    idle_.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable idle_;
+    size_t active_ = 0;
+    bool stop_ = false;
+};
+
+const char* searchModeName(SearchMode mode) {
+    switch (mode) {
+        case SearchMode::Grid: return "Grid";
+        case SearchMode::Refine: return "Refine";
+        case SearchMode::LevenbergMarquardt: return "LevenbergMarquardt";
+    }
+    return "Unknown";
+}
+
+std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\') escaped += '\\';
+        escaped += ch;
+    }
+    return escaped;
+}
+
+// Writes the fit and the data/model curves (what the Advanced plot shows) to 'path',
+// as JSON or, for a .csv extension, as a table with the fit parameters in '#' header lines.
+void writeResults(const std::string& path, const Material& material, const std::string& data_file,
+                  SearchMode mode, const DrudeFit& result, size_t window_points,
+                  const std::vector<double>& eps1_model, const std::vector<double>& eps2_model) {
+    std::ofstream out (path);
+    if (!out) {
+        throw std::runtime_error("Error: Could not write " + path);
+    }
+    out.precision(17);
+    const std::vector<double>& wl = material.getWavelength();
+    const std::vector<double>& energy = material.getEnergy();
+    const std::vector<double>& eps1 = material.computeEpsilon().first;
+    const std::vector<double>& eps2 = material.computeEpsilon().second;
+
+    if (std::filesystem::path(path).extension() == ".csv") {
+        out << "# material=" << material.getName() << "\n# data_file=" << data_file
+            << "\n# model=" << (result.oscillators.empty() ? "Drude" : "DrudeLorentz")
+            << "\n# search_mode=" << searchModeName(mode)
+            << "\n# omega_min=" << result.window_min << "\n# omega_max=" << result.window_max
+            << "\n# omega_p=" << result.fit.omega_p << "\n# gamma=" << result.fit.gamma
+            << "\n# eps_inf=" << result.eps_inf << "\n# error=" << result.fit.error
+            << "\n# evaluations=" << result.fit.evaluations << "\n# window_points=" << window_points << '\n';
+        if (const BootstrapResult& b = result.bootstrap; b.replicates > 0)
+            out << "# bootstrap=replicates:" << b.replicates << ",failed:" << b.failed << ",confidence:" << b.confidence
+                << "\n# omega_p_interval=" << b.omega_p.lower << ',' << b.omega_p.upper << ',' << b.omega_p.std_error
+                << "\n# gamma_interval=" << b.gamma.lower << ',' << b.gamma.upper << ',' << b.gamma.std_error
+                << "\n# eps_inf_interval=" << b.eps_inf.lower << ',' << b.eps_inf.upper << ',' << b.eps_inf.std_error << '\n';
+        for (size_t j = 0; j < result.oscillators.size(); ++j)
+            out << "# oscillator_" << j << "=strength:" << result.oscillators[j].strength
+                << ",omega0:" << result.oscillators[j].omega0 << ",gamma:" << result.oscillators[j].gamma << '\n';
+        out << "wavelength_nm,energy_eV,eps1_data,eps2_data,eps1_model,eps2_model\n";
+        for (size_t i = 0; i < wl.size(); ++i)
+            out << wl[i] << ',' << energy[i] << ',' << eps1[i] << ',' << eps2[i] << ','
+                << eps1_model[i] << ',' << eps2_model[i] << '\n';
+        return;
+    }
+
+    auto array = [&out](const char* key, const std::vector<double>& values, bool last = false) {
+        out << "    \"" << key << "\": [";
+        for (size_t i = 0; i < values.size(); ++i)
+            out << (i ? ", " : "") << values[i];
+        out << (last ? "]\n" : "],\n");
+    };
+    out << "{\n  \"material\": \"" << jsonEscape(material.getName()) << "\",\n"
+        << "  \"data_file\": \"" << jsonEscape(data_file) << "\",\n"
+        << "  \"model\": \"" << (result.oscillators.empty() ? "Drude" : "DrudeLorentz") << "\",\n"
+        << "  \"search_mode\": \"" << searchModeName(mode) << "\",\n"
+        << "  \"omega_min\": " << result.window_min << ",\n  \"omega_max\": " << result.window_max << ",\n"
+        << "  \"omega_p\": " << result.fit.omega_p << ",\n  \"gamma\": " << result.fit.gamma << ",\n"
+        << "  \"eps_inf\": " << result.eps_inf << ",\n  \"error\": " << result.fit.error << ",\n"
+        << "  \"evaluations\": " << result.fit.evaluations << ",\n"
+        << "  \"window_points\": " << window_points << ",\n"
+        << "  \"oscillators\": [";
+    for (size_t j = 0; j < result.oscillators.size(); ++j)
+        out << (j ? ", " : "") << "{\"strength\": " << result.oscillators[j].strength
+            << ", \"omega0\": " << result.oscillators[j].omega0 << ", \"gamma\": " << result.oscillators[j].gamma << "}";
+    out << "],\n";
+    if (const BootstrapResult& b = result.bootstrap; b.replicates > 0) {
+        auto interval = [&out](const char* key, const ParameterInterval& p) {
+            out << ", \"" << key << "\": {\"lower\": " << p.lower << ", \"upper\": " << p.upper
+                << ", \"std_error\": " << p.std_error << "}";
+        };
+        out << "  \"bootstrap\": {\"replicates\": " << b.replicates << ", \"failed\": " << b.failed
+            << ", \"confidence\": " << b.confidence;
+        interval("omega_p", b.omega_p);
+        interval("gamma", b.gamma);
+        interval("eps_inf", b.eps_inf);
+        out << "},\n";
+    }
+    out << "  \"spectrum\": {\n";
+    array("wavelength_nm", wl);
+    array("energy_eV", energy);
+    array("eps1_data", eps1);
+    array("eps2_data", eps2);
+    array("eps1_model", eps1_model);
+    array("eps2_model", eps2_model, true);
+    out << "  }\n}\n";
+}
+
+// Axis of a stored error surface: 'count' points min + i*step.
+struct SurfaceAxis {
+    double min = 0.0, step = 1.0;
+    size_t count = 0;
+};
+
+// Axes of a ScanGrid in storage order: eps_inf, omega_p, gamma.
+std::array<SurfaceAxis, 3> surfaceAxes(const ScanGrid& grid) {
+    return {{{grid.eps_inf_min, grid.deps_inf, grid.epsInfCount()},
+             {grid.plane.omega_p_min, grid.plane.domega_p, grid.plane.omegaPCount()},
+             {grid.plane.gamma_min, grid.plane.dgamma, grid.plane.gammaCount()}}};
+}
+
+// Position of the 'wanted' points on the 'stored' axis: point i of wanted is point
+// offset + i*stride of stored. False unless every wanted point is a stored point to rounding
+// (kSurfaceMatch relative to the point or the step, whichever is larger), i.e. wanted is a
+// window of stored with the same or a multiple step.
+constexpr double kSurfaceMatch = 1e-12;
+
+bool surfaceSubAxis(const SurfaceAxis& stored, const SurfaceAxis& wanted, size_t& offset, size_t& stride) {
+    if (wanted.count == 0 || stored.count == 0)
+        return false;
+    const double position = stored.count > 1 ? (wanted.min - stored.min) / stored.step : 0.0;
+    const double ratio = wanted.count > 1 ? wanted.step / stored.step : 1.0;
+    if (!(position > -0.5) || !(ratio > 0.5))
+        return false;
+    offset = static_cast<size_t>(std::round(position));
+    stride = static_cast<size_t>(std::round(ratio));
+    if (offset + (wanted.count - 1) * stride >= stored.count)
+        return false;
+    // The mismatch is affine in i, so it is within the tolerance everywhere if it is at both ends.
+    auto matches = [&](size_t i) {
+        const double w = wanted.min + i * wanted.step;
+        const double v = stored.min + (offset + i * stride) * stored.step;
+        return std::fabs(w - v) <= kSurfaceMatch * std::max({std::fabs(w), std::fabs(v), stored.step});
+    };
+    return matches(0) && matches(wanted.count - 1);
+}
+
+// Identifies the data of a surface: fnv1a64 of the fitted samples (ω, ε₁, ε₂), so the data
+// file and the omega_min/omega_max window. The search grid is described by the sidecar.
+uint64_t surfaceDataKey(const FitProblem& problem) {
+    static constexpr char kSeed[] = "MDSURF1";
+    uint64_t hash = fnv1a64(kSeed, sizeof(kSeed));
+    for (const std::vector<double>* values : {&problem.omega, &problem.eps1, &problem.eps2}) {
+        size_t size = values->size();
+        hash = fnv1a64(&size, sizeof(size), hash);
+        hash = fnv1a64(values->data(), values->size() * sizeof(double), hash);
+    }
+    return hash;
+}
+
+// NumPy dtype of a native double.
+const char* npyDoubleType() {
+    const uint16_t probe = 1;
+    unsigned char first;
+    std::memcpy(&first, &probe, 1);
+    return first == 1 ? "<f8" : ">f8";
+}
+
+// Writes 'data' as a C-order NumPy .npy array of the given shape (NPY format 1.0). The file
+// goes through a temporary, so readers never see half an array.
+void writeNpy(const std::string& path, const double* data, const std::vector<size_t>& shape) {
+    std::string dims;
+    size_t count = 1;
+    for (size_t extent : shape) {
+        dims += std::to_string(extent) + ", ";
+        count *= extent;
+    }
+    if (shape.size() > 1)
+        dims.erase(dims.size() - 2);
+    std::string header = std::string("{'descr': '") + npyDoubleType() + "', 'fortran_order': False, 'shape': ("
+                       + dims + "), }";
+    header.append(63 - (10 + header.size()) % 64, ' ');   // data start aligned to 64 bytes
+    header += '\n';
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out (tmp_path, std::ios::binary | std::ios::trunc);
+        const char magic[8] = {'\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0};
+        const unsigned char length[2] = {static_cast<unsigned char>(header.size() & 0xff),
+                                         static_cast<unsigned char>(header.size() >> 8)};
+        out.write(magic, sizeof(magic));
+        out.write(reinterpret_cast<const char*>(length), sizeof(length));
+        out << header;
+        out.write(reinterpret_cast<const char*>(data), count * sizeof(double));
+        if (!out)
+            throw std::runtime_error("Error: Could not write " + path);
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_path, ec);
+        throw std::runtime_error("Error: Could not write " + path);
+    }
+}
+
+// Writes the surface of 'scan' over 'grid' to 'path' as a NumPy .npy array of shape
+// (eps_inf, omega_p, gamma), and its axes, data key and best point to the JSON sidecar <path>.json.
+void writeErrorSurface(const std::string& path, const ScanGrid& grid, const ErrorScan& scan, uint64_t data_key,
+                       const std::string& material_name, const std::string& data_file) {
+    const std::array<SurfaceAxis, 3> axes = surfaceAxes(grid);
+    writeNpy(path, scan.surface.data(), {axes[0].count, axes[1].count, axes[2].count});
+
+    std::ofstream out (path + ".json");
+    out.precision(17);
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(data_key));
+    out << "{\n  \"array\": \"" << jsonEscape(std::filesystem::path(path).filename().string()) << "\",\n"
+        << "  \"layout\": \"float64 normalized error [eps_inf][omega_p][gamma]\",\n"
+        << "  \"material\": \"" << jsonEscape(material_name) << "\",\n"
+        << "  \"data_file\": \"" << jsonEscape(data_file) << "\",\n"
+        << "  \"data_key\": \"" << key << "\",\n"
+        << "  \"omega_min\": " << omega_min << ",\n  \"omega_max\": " << omega_max << ",\n";
+    const char* names[3] = {"eps_inf", "omega_p", "gamma"};
+    for (size_t a = 0; a < 3; ++a)
+        out << "  \"" << names[a] << "_min\": " << axes[a].min << ", \"" << names[a] << "_step\": " << axes[a].step
+            << ", \"" << names[a] << "_count\": " << axes[a].count << ",\n";
+    out << "  \"best_eps_inf\": " << scan.eps_inf << ", \"best_omega_p\": " << scan.best.omega_p
+        << ", \"best_gamma\": " << scan.best.gamma << ", \"best_error\": " << scan.best.error << "\n}\n";
+    if (!out)
+        throw std::runtime_error("Error: Could not write " + path + ".json");
+}
+
+// Errors of 'grid' taken from the surface stored at 'path' by writeErrorSurface(), best point
+// included (same tie rule as scanErrorSurface()). False when there is no readable surface,
+// it was computed from other data, or 'grid' is not a window of its grid.
+bool readErrorSurface(const std::string& path, uint64_t data_key, const ScanGrid& grid, ErrorScan& scan) {
+    std::ifstream meta (path + ".json");
+    std::stringstream buffer;
+    buffer << meta.rdbuf();
+    const std::string sidecar = buffer.str();
+    // Value text after "key": in the sidecar (flat, as written above).
+    auto field = [&sidecar](const std::string& key) -> const char* {
+        size_t at = sidecar.find("\"" + key + "\": ");
+        return at == std::string::npos ? nullptr : sidecar.c_str() + at + key.size() + 4;
+    };
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(data_key));
+    const char* stored_key = field("data_key");
+    if (!meta || !stored_key || std::strncmp(stored_key, (std::string("\"") + key + "\"").c_str(), 18) != 0)
+        return false;
+
+    const char* names[3] = {"eps_inf", "omega_p", "gamma"};
+    const std::array<SurfaceAxis, 3> wanted = surfaceAxes(grid);
+    std::array<SurfaceAxis, 3> stored;
+    size_t offset[3], stride[3];
+    for (size_t a = 0; a < 3; ++a) {
+        const char* min = field(std::string(names[a]) + "_min");
+        const char* step = field(std::string(names[a]) + "_step");
+        const char* count = field(std::string(names[a]) + "_count");
+        if (!min || !step || !count)
+            return false;
+        stored[a] = {std::strtod(min, nullptr), std::strtod(step, nullptr),
+                     static_cast<size_t>(std::strtoull(count, nullptr, 10))};
+        if (!surfaceSubAxis(stored[a], wanted[a], offset[a], stride[a]))
+            return false;
+    }
+
+    std::ifstream in (path, std::ios::binary);
+    unsigned char prefix[10];
+    if (!in.read(reinterpret_cast<char*>(prefix), sizeof(prefix)) || std::memcmp(prefix, "\x93NUMPY\x01", 7) != 0)
+        return false;
+    std::string header (prefix[8] | prefix[9] << 8, '\0');
+    const std::string shape = "(" + std::to_string(stored[0].count) + ", " + std::to_string(stored[1].count) + ", "
+                            + std::to_string(stored[2].count) + ")";
+    if (!in.read(header.data(), header.size()) || header.find(npyDoubleType()) == std::string::npos
+        || header.find("'fortran_order': False") == std::string::npos || header.find(shape) == std::string::npos)
+        return false;
+    const std::streamoff data_start = sizeof(prefix) + header.size();
+
+    const size_t n_wp = wanted[1].count, n_gamma = wanted[2].count;
+    const size_t span = (n_gamma - 1) * stride[2] + 1;
+    scan = ErrorScan();
+    scan.surface.resize(grid.size());
+    std::vector<double> row (span);
+    for (size_t k = 0; k < wanted[0].count; ++k) {
+        for (size_t i = 0; i < n_wp; ++i) {
+            const size_t stored_k = offset[0] + k * stride[0], stored_i = offset[1] + i * stride[1];
+            const size_t first = (stored_k * stored[1].count + stored_i) * stored[2].count + offset[2];
+            in.seekg(data_start + static_cast<std::streamoff>(first * sizeof(double)));
+            if (!in.read(reinterpret_cast<char*>(row.data()), span * sizeof(double)))
+                return false;
+            double* out = scan.surface.data() + (k * n_wp + i) * n_gamma;
+            for (size_t j = 0; j < n_gamma; ++j)
+                out[j] = row[j * stride[2]];
+        }
+    }
+
+    size_t best = scan.surface.size();
+    for (size_t index = 0; index < scan.surface.size(); ++index)
+        if (scan.surface[index] < scan.best.error)
+            scan.best.error = scan.surface[index], best = index;
+    if (best < scan.surface.size()) {
+        scan.eps_inf = grid.epsInf(best / (n_wp * n_gamma));
+        scan.best.omega_p = grid.plane.omegaP(best / n_gamma % n_wp);
+        scan.best.gamma = grid.plane.gamma(best % n_gamma);
+    }
+    return true;
+}
+
+// scanErrorSurface() through the surface_file store: the stored errors when they cover 'grid'
+// (no evaluations), otherwise the full surface is computed and replaces the store. Like the
+// caches, a store that cannot be written is only a warning; the computed surface is returned.
+ErrorScan storedErrorSurface(const FitProblem& problem, const ScanGrid& grid, ScanBackend backend, unsigned threads,
+                             const std::string& material_name, const std::string& data_file) {
+    const uint64_t key = surfaceDataKey(problem);
+    ErrorScan scan;
+    if (readErrorSurface(surface_file, key, grid, scan)) {
+        std::cout << "Error surface read from " << surface_file << '\n';
+        return scan;
+    }
+    scan = scanErrorSurface(problem, grid, backend, true, threads);
+    try {
+        writeErrorSurface(surface_file, grid, scan, key, material_name, data_file);
+        std::cout << "Error surface written to " << surface_file << '\n';
+    } catch (const std::exception&) {
+        std::cerr << "Warning: could not write error surface " << surface_file << '\n';
+    }
+    return scan;
+}
+
+// Exhaustive Drude grid fit at the fixed eps_inf (SearchMode::Grid) through the surface_file
+// store: the (omega_p, gamma) plane of a one-plane scan, bootstrap intervals included.
+DrudeFit fitDrudeSurface(const FitProblem& problem, unsigned threads, const std::string& material_name,
+                         const std::string& data_file) {
+    DrudeFit result;
+    {
+        ScopedTimer timer ("fit");
+        ScanGrid grid {{omega_p_min, omega_p_max, domega_p, gamma_min, gamma_max, dgamma}, eps_inf, eps_inf + 1.0, 1.0};
+        result.fit = storedErrorSurface(problem, grid, scan_backend, threads, material_name, data_file).best;
+        result.eps_inf = eps_inf;
+    }
+    result.bootstrap = bootstrapDrude(problem, result, bootstrap_replicates, bootstrap_confidence,
+                                      bootstrap_seed, threads);
+    return result;
+}
+
+// '*' and '?' wildcard match of a file name.
+bool wildcardMatch(const char* pattern, const char* text) {
+    if (*pattern == '\0')
+        return *text == '\0';
+    if (*pattern == '*')
+        return wildcardMatch(pattern + 1, text) || (*text != '\0' && wildcardMatch(pattern, text + 1));
+    return *text != '\0' && (*pattern == '?' || *pattern == *text) && wildcardMatch(pattern + 1, text + 1);
+}
+
+// Expands the batch inputs: a directory gives its *.txt and *.csv files, a name containing
+// '*' or '?' is matched against the files of its directory, anything else is a file name.
+std::vector<std::string> expandDataFiles(const std::vector<std::string>& inputs) {
+    namespace fs = std::filesystem;
+    std::vector<std::string> files;
+    for (const std::string& input : inputs) {
+        std::error_code ec;
+        std::vector<std::string> matches;
+        if (fs::is_directory(input, ec)) {
+            for (const fs::directory_entry& entry : fs::directory_iterator(input, ec)) {
+                std::string ext = entry.path().extension().string();
+                if (entry.is_regular_file() && (ext == ".txt" || ext == ".csv"))
+                    matches.push_back(entry.path().string());
+            }
+        } else if (input.find_first_of("*?") != std::string::npos) {
+            fs::path pattern (input);
+            fs::path dir = pattern.has_parent_path() ? pattern.parent_path() : fs::path(".");
+            std::string name = pattern.filename().string();
+            for (const fs::directory_entry& entry : fs::directory_iterator(dir, ec))
+                if (entry.is_regular_file() && wildcardMatch(name.c_str(), entry.path().filename().string().c_str()))
+                    matches.push_back(entry.path().string());
+        } else {
+            matches.push_back(input);
+        }
+        std::sort(matches.begin(), matches.end());
+        files.insert(files.end(), matches.begin(), matches.end());
+    }
+    return files;
+}
+
+// Material name taken from a data file name: "data/Ag_Palik_400-900nm.txt" -> "Ag".
+std::string materialNameFromPath(const std::string& path) {
+    std::string stem = std::filesystem::path(path).stem().string();
+    return stem.substr(0, stem.find('_'));
+}
+
+// Batch driver: loads and fits every input file on a shared thread pool (one file per task)
+// and writes one consolidated CSV table. Files that fail are reported in the table and skipped.
+int runBatch(const std::vector<std::string>& inputs, const std::string& output, SearchMode mode) {
+    std::vector<std::string> files = expandDataFiles(inputs);
+    if (files.empty()) {
+        std::cerr << "Error: no data files given for the batch run\n";
+        return 1;
+    }
+
+    struct BatchRow {
+        std::string file;
+        std::string material;
+        size_t points = 0;
+        size_t window_points = 0;
+        DrudeFit result;
+        double seconds = 0.0;
+        bool cached = false;        // result taken from the fit cache
+        std::string status = "ok";
+    };
+    std::vector<BatchRow> rows(files.size());
+    std::mutex print_mutex;
+    size_t done = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        ThreadPool pool (num_threads);
+        std::cout << "\n***Batch run***\nFitting " << files.size() << " files on " << pool.size() << " threads\n";
+        for (size_t i = 0; i < files.size(); ++i) {
+            pool.submit([&, i] {
+                BatchRow& row = rows[i];
+                row.file = files[i];
+                row.material = materialNameFromPath(files[i]);
+                auto t0 = std::chrono::steady_clock::now();
+                ScopedTimer timer ("batch_file");
+                try {
+                    Material material (row.material);
+                    FitProblem problem;
+                    if (stream_data) {
+                        problem = streamFitProblem(row.material, row.file, stream_chunk_points, omega_min, omega_max, false);
+                    } else {
+                        material.loadData(row.file, use_data_cache, false);
+                        applyResampling(material, false);
+                        if (!checkKramersKronig(material, false))
+                            throw std::runtime_error("data fail the Kramers-Kronig check");
+                        row.points = material.getWavelength().size();
+                        problem = FitProblem(material);
+                    }
+                    row.window_points = problem.size();
+                    if (problem.size() == 0)
+                        throw std::runtime_error("no data points inside the fitting window");
+                    row.result = runFit(problem, ModelType::Drude, mode, 1, &row.cached);
+                } catch (const std::exception& e) {
+                    row.status = e.what();
+                }
+                row.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cout << "[" << ++done << "/" << files.size() << "] " << row.file << ": ";
+                if (row.status == "ok")
+                    std::cout << "omega_p " << row.result.fit.omega_p << ", gamma " << row.result.fit.gamma
+                              << ", error " << row.result.fit.error << (row.cached ? " (cached)" : "") << '\n';
+                else
+                    std::cout << row.status << '\n';
+            });
+        }
+        pool.wait();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::ofstream out (output);
+    if (!out) {
+        std::cerr << "Error: Could not write " << output << '\n';
+        return 1;
+    }
+    out.precision(10);
+    const bool intervals = bootstrap_replicates > 0;
+    out << "file,material,points,window_points,omega_p,gamma,eps_inf,error,evaluations,"
+        << (intervals ? "omega_p_lower,omega_p_upper,gamma_lower,gamma_upper," : "") << "seconds,status\n";
+    size_t failed = 0;
+    for (const BatchRow& row : rows) {
+        std::string status = row.status;
+        std::replace(status.begin(), status.end(), '"', '\'');
+        out << '"' << row.file << "\"," << row.material << ',' << row.points << ',' << row.window_points << ',';
+        if (row.status == "ok")
+            out << row.result.fit.omega_p << ',' << row.result.fit.gamma << ',' << row.result.eps_inf << ','
+                << row.result.fit.error << ',' << row.result.fit.evaluations << ',';
+        else
+            out << ",,,,,";
+        if (intervals && row.status == "ok") {
+            const BootstrapResult& b = row.result.bootstrap;
+            out << b.omega_p.lower << ',' << b.omega_p.upper << ',' << b.gamma.lower << ',' << b.gamma.upper << ',';
+        } else if (intervals) {
+            out << ",,,,";
+        }
+        out << row.seconds << ",\"" << status << "\"\n";
+        failed += (row.status != "ok");
+    }
+    std::cout << "Batch complete: " << files.size() - failed << " fitted, " << failed << " failed in "
+              << seconds << " s. Results written to " << output << '\n';
+    return failed == files.size() ? 1 : 0;
+}
+
+// Shortest text that reads back to the same double.
+std::string formatNumber(double value) {
+    char buffer[32];
+    std::to_chars_result r = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    return std::string(buffer, r.ptr);
+}
+
+// Runtime configuration.
+// Every tunable value is registered under a key and can be set from a config file
+// (--config run.toml) or on the command line (--set key=value), applied in the order given,
+// so parameter sweeps need no rebuild. The file format is a flat TOML subset: one
+// key = value per line, '#' comments, strings optionally in double quotes, true/false.
+// --print-config writes the effective settings in the same format.
+class Settings {
+public:
+    void add(const char* key, double& value, const char* help) {
+        addCustom(key, help, [&value, key](const std::string& text) { value = parseNumber<double>(key, text); },
+                  [&value]() { return formatNumber(value); });
+    }
+
+    void add(const char* key, unsigned& value, const char* help) {
+        addCustom(key, help, [&value, key](const std::string& text) { value = parseNumber<unsigned>(key, text); },
+                  [&value]() { return std::to_string(value); });
+    }
+
+    void add(const char* key, size_t& value, const char* help) {
+        addCustom(key, help, [&value, key](const std::string& text) { value = parseNumber<size_t>(key, text); },
+                  [&value]() { return std::to_string(value); });
+    }
+
+    void add(const char* key, bool& value, const char* help) {
+        addCustom(key, help, [&value, key](const std::string& text) {
+            if (text == "true" || text == "1" || text == "yes" || text == "on") value = true;
+            else if (text == "false" || text == "0" || text == "no" || text == "off") value = false;
+            else throw std::runtime_error("Error: " + std::string(key) + " expects true or false, got '" + text + "'");
+        }, [&value]() { return std::string(value ? "true" : "false"); });
+    }
+
+    void add(const char* key, std::string& value, const char* help) {
+        addCustom(key, help, [&value](const std::string& text) { value = text; },
+                  [&value]() { return '"' + value + '"'; });
+    }
+
+    // Enumeration set by name, e.g. addEnum("search_mode", mode, {{"grid", SearchMode::Grid}, ...}).
+    template <class E>
+    void addEnum(const char* key, E& value, std::vector<std::pair<std::string, E>> names, const char* help) {
+        std::string choices;
+        for (const auto& [name, v] : names)
+            choices += (choices.empty() ? "" : "|") + name;
+        addCustom(key, (std::string(help) + " (" + choices + ")").c_str(), [&value, names, key, choices](const std::string& text) {
+            for (const auto& [name, v] : names)
+                if (name == text) {
+                    value = v;
+                    return;
+                }
+            throw std::runtime_error("Error: " + std::string(key) + " expects " + choices + ", got '" + text + "'");
+        }, [&value, names]() {
+            for (const auto& [name, v] : names)
+                if (v == value) return '"' + name + '"';
+            return std::string("\"\"");
+        });
+    }
+
+    void addCustom(const char* key, const std::string& help, std::function<void(const std::string&)> set,
+                   std::function<std::string()> get) {
+        entries_.push_back({key, help, std::move(set), std::move(get)});
+    }
+
+    void set(const std::string& key, const std::string& value) {
+        for (Entry& entry : entries_)
+            if (entry.key == key) {
+                entry.set(value);
+                return;
+            }
+        throw std::runtime_error("Error: Unknown setting '" + key + "' (see --print-config)");
+    }
+
+    // "key=value" (command line) or "key = value" (config file line, comment already removed).
+    void assign(const std::string& assignment) {
+        size_t eq = assignment.find('=');
+        if (eq == std::string::npos) {
+            throw std::runtime_error("Error: Expected key=value, got '" + assignment + "'");
+        }
+        set(trim(assignment.substr(0, eq)), unquote(trim(assignment.substr(eq + 1))));
+    }
+
+    void load(const std::string& path) {
+        std::ifstream in (path);
+        if (!in) {
+            throw std::runtime_error("Error: Could not open config file " + path);
+        }
+        std::string line;
+        for (size_t number = 1; std::getline(in, line); ++number) {
+            line = trim(stripComment(line));
+            if (line.empty() || line.front() == '[')   // blank, comment or TOML table header
+                continue;
+            try {
+                assign(line);
+            } catch (const std::exception& e) {
+                throw std::runtime_error(std::string(e.what()) + " in " + path + ":" + std::to_string(number));
+            }
+        }
+    }
+
+    void print(std::ostream& out) const {
+        for (const Entry& entry : entries_)
+            out << entry.key << " = " << entry.get() << "   # " << entry.help << '\n';
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::string help;
+        std::function<void(const std::string&)> set;
+        std::function<std::string()> get;
+    };
+
+    template <class T>
+    static T parseNumber(const char* key, const std::string& text) {
+        T value {};
+        const char* first = text.data();
+        const char* last = first + text.size();
+        if (first != last && *first == '+') ++first;
+        std::from_chars_result r = std::from_chars(first, last, value);
+        if (first == last || r.ec != std::errc() || r.ptr != last) {
+            throw std::runtime_error("Error: " + std::string(key) + " expects a number, got '" + text + "'");
+        }
+        return value;
+    }
+
+    static std::string trim(const std::string& text) {
+        size_t first = text.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos)
+            return "";
+        size_t last = text.find_last_not_of(" \t\r\n");
+        return text.substr(first, last - first + 1);
+    }
+
+    static std::string unquote(const std::string& text) {
+        if (text.size() >= 2 && text.front() == '"' && text.back() == '"')
+            return text.substr(1, text.size() - 2);
+        return text;
+    }
+
+    // Drops a '#' comment that is not inside a quoted string.
+    static std::string stripComment(const std::string& line) {
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); ++i) {
+            if (line[i] == '"') quoted = !quoted;
+            else if (line[i] == '#' && !quoted) return line.substr(0, i);
+        }
+        return line;
+    }
+
+    std::vector<Entry> entries_;
+};
+
+// Lorentz oscillators as text: "strength, omega0, gamma; strength, omega0, gamma; ..."
+std::vector<LorentzOscillator> parseOscillators(const std::string& text) {
+    std::vector<LorentzOscillator> oscillators;
+    size_t begin = 0;
+    while (begin < text.size()) {
+        size_t end = text.find(';', begin);
+        if (end == std::string::npos) end = text.size();
+        std::string item = text.substr(begin, end - begin);
+        begin = end + 1;
+        if (item.find_first_not_of(" \t") == std::string::npos)
+            continue;
+        LorentzOscillator o {};
+        std::replace(item.begin(), item.end(), ',', ' ');
+        std::istringstream in (item);
+        std::string rest;
+        if (!(in >> o.strength >> o.omega0 >> o.gamma) || (in >> rest)) {
+            throw std::runtime_error("Error: lorentz_seed expects 'strength, omega0, gamma; ...', got '" + text + "'");
+        }
+        oscillators.push_back(o);
+    }
+    return oscillators;
+}
+
+std::string formatOscillators(const std::vector<LorentzOscillator>& oscillators) {
+    std::string text;
+    for (size_t j = 0; j < oscillators.size(); ++j)
+        text += (j ? "; " : "") + formatNumber(oscillators[j].strength) + ", " + formatNumber(oscillators[j].omega0)
+              + ", " + formatNumber(oscillators[j].gamma);
+    return '"' + text + '"';
+}
+
+// Rejects settings the fitters cannot work with (empty ranges, non-positive steps).
+void validateSettings() {
+    auto require = [](bool ok, const std::string& message) {
+        if (!ok) throw std::runtime_error("Error: " + message);
+    };
+    require(omega_min < omega_max, "omega_min must be smaller than omega_max");
+    require(omega_p_min > 0.0 && omega_p_min < omega_p_max, "need 0 < omega_p_min < omega_p_max");
+    require(gamma_min > 0.0 && gamma_min < gamma_max, "need 0 < gamma_min < gamma_max");
+    require(domega_p > 0.0 && dgamma > 0.0, "domega_p and dgamma must be positive");
+    require(refine_domega_p > 0.0 && refine_dgamma > 0.0, "refine_domega_p and refine_dgamma must be positive");
+    require(stream_chunk_points > 0, "stream_chunk_points must be positive");
+    require(resample_points == 0 || (resample_points >= 2 && !stream_data),
+            "resample_points must be 0 or at least 2, and cannot be combined with stream_data");
+    require((resample_energy_min == 0.0 && resample_energy_max == 0.0)
+                || (resample_energy_min > 0.0 && resample_energy_min < resample_energy_max),
+            "need 0 < resample_energy_min < resample_energy_max (or both 0 for the data range)");
+    require(scan_deps_inf > 0.0 && scan_eps_inf_min < scan_eps_inf_max,
+            "need scan_deps_inf > 0 and scan_eps_inf_min < scan_eps_inf_max");
+#ifndef METAL_DISPERSION_CUDA
+    require(scan_backend == ScanBackend::CPU, "scan_backend cuda needs a build with -DMETAL_DISPERSION_CUDA");
+#endif
+    require(surface_file.empty() || std::filesystem::path(surface_file).extension() == ".npy",
+            "surface_file must be a .npy file name");
+    require(kk_points >= 8 && kk_regions > 0 && kk_tolerance > 0.0,
+            "need kk_points >= 8, kk_regions > 0 and kk_tolerance > 0");
+    require(film_dthickness > 0.0 && film_thickness_min >= 0.0 && film_thickness_min < film_thickness_max,
+            "need film_dthickness > 0 and 0 <= film_thickness_min < film_thickness_max");
+    require(film_dangle > 0.0 && film_angle_min >= 0.0 && film_angle_min < film_angle_max && film_angle_max <= 90.0,
+            "need film_dangle > 0 and 0 <= film_angle_min < film_angle_max <= 90");
+    require(film_ambient_index > 0.0 && film_substrate_index > 0.0, "film_ambient_index and film_substrate_index must be positive");
+    require(kk_check == KKCheck::Off || !stream_data, "kk_check cannot be combined with stream_data");
+    require(bootstrap_confidence > 0.0 && bootstrap_confidence < 1.0, "bootstrap_confidence must be between 0 and 1");
+    require(lorentz_seed.size() <= max_lorentz_oscillators,
+            "lorentz_seed holds at most " + std::to_string(max_lorentz_oscillators) + " oscillators");
+}
+
+// Spectra of a map or time series: pixel (row, col) holds the points
+// offsets[p] .. offsets[p + 1] of the arrays, p = row * cols + col.
+struct SpectralMap {
+    size_t rows = 0;
+    size_t cols = 0;
+    std::vector<size_t> offsets;
+    std::vector<double> wavelength, n, k;
+
+    size_t pixels() const {
+        return rows * cols;
+    }
+};
+
+// Reads a map file: one "row, col, wavelength (nm), n, k" line per data point, in any order
+// (a time series is a map with a single row, col being the step). Pixels without points
+// are reported as failed by runMap().
+SpectralMap loadMap(const std::string& filename) {
+    ScopedTimer timer ("load");
+    MappedFile file (filename);
+    std::vector<std::array<double, 5>> points;
+    SpectralMap map;
+    const char* pos = file.data();
+    const char* end = pos + file.size();
+    for (size_t line = 1; pos && pos < end; ++line) {
+        const char* eol = std::find(pos, end, '\n');
+        std::array<double, 5> values;
+        int status = parseDataLine(pos, eol, values.data(), 5);
+        bool valid_pixel = status <= 0 || (values[0] >= 0 && values[1] >= 0 && values[0] == std::floor(values[0])
+                                           && values[1] == std::floor(values[1]) && values[0] < 1e9 && values[1] < 1e9);
+        if (status < 0 || !valid_pixel) {
+            throw std::runtime_error("Error: Malformed map data on line " + std::to_string(line) + " of " + filename
+                                     + ": '" + std::string(pos, eol) + "'");
+        }
+        if (status > 0) {
+            points.push_back(values);
+            map.rows = std::max(map.rows, static_cast<size_t>(values[0]) + 1);
+            map.cols = std::max(map.cols, static_cast<size_t>(values[1]) + 1);
+        }
+        pos = eol + 1;
+    }
+    if (points.empty()) {
+        throw std::runtime_error("Error: No data points found in " + filename);
+    }
+    Profiler::count(Profiler::PointsParsed, points.size());
+
+    // Counting sort by pixel; the points of a pixel keep their order in the file.
+    map.offsets.assign(map.pixels() + 1, 0);
+    for (const auto& p : points)
+        ++map.offsets[static_cast<size_t>(p[0]) * map.cols + static_cast<size_t>(p[1]) + 1];
+    for (size_t p = 0; p < map.pixels(); ++p)
+        map.offsets[p + 1] += map.offsets[p];
+    std::vector<size_t> next (map.offsets.begin(), map.offsets.end() - 1);
+    map.wavelength.resize(points.size());
+    map.n.resize(points.size());
+    map.k.resize(points.size());
+    for (const auto& p : points) {
+        size_t i = next[static_cast<size_t>(p[0]) * map.cols + static_cast<size_t>(p[1])]++;
+        map.wavelength[i] = p[2];
+        map.n[i] = p[3];
+        map.k[i] = p[4];
+    }
+    return map;
+}
+
+// Warm-started fitting of every pixel of a map file (see map_tile); writes one CSV row per pixel.
+int runMap(const std::string& filename, const std::string& output, SearchMode mode) {
+    SpectralMap map;
+    try {
+        map = loadMap(filename);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    struct PixelFit {
+        DrudeFit result;
+        bool global = false;        // result of a global search (tile start or a better fallback)
+        std::string status = "ok";
+    };
+    std::vector<PixelFit> fits(map.pixels());
+
+    // Tiles in row-major order; each is walked as a serpentine (boustrophedon), so every pixel
+    // after the first is adjacent to the one fitted just before it.
+    const size_t side = std::max<size_t>(map_tile, 1);
+    const size_t tile_rows = map.rows == 1 ? 1 : side;
+    const size_t tile_cols = map.rows == 1 ? side * side : side;
+    const size_t tiles_down = (map.rows + tile_rows - 1) / tile_rows;
+    const size_t tiles_across = (map.cols + tile_cols - 1) / tile_cols;
+    std::atomic<size_t> next_tile {0};
+    std::atomic<size_t> global_fits {0};
+
+    LMOptions options;
+    options.fit_eps_inf = fit_eps_inf;
+    auto work = [&](size_t) {
+        Material material ("map");
+        FitProblem problem;
+        LevenbergMarquardt<DrudeModel> lm (problem, options);
+        LevenbergMarquardt<DrudeModel>::Workspace workspace;
+        for (size_t tile; (tile = next_tile++) < tiles_down * tiles_across; ) {
+            const size_t r0 = tile / tiles_across * tile_rows;
+            const size_t c0 = tile % tiles_across * tile_cols;
+            const size_t r1 = std::min(r0 + tile_rows, map.rows);
+            const size_t c1 = std::min(c0 + tile_cols, map.cols);
+            const PixelFit* previous = nullptr;
+            for (size_t r = r0; r < r1; ++r) {
+                for (size_t step = 0; step < c1 - c0; ++step) {
+                    const size_t col = (r - r0) % 2 == 0 ? c0 + step : c1 - 1 - step;
+                    const size_t pixel = r * map.cols + col;
+                    PixelFit& fit = fits[pixel];
+                    try {
+                        material.clearData();
+                        for (size_t i = map.offsets[pixel]; i < map.offsets[pixel + 1]; ++i)
+                            material.addPoint(map.wavelength[i], map.n[i], map.k[i]);
+                        problem.clear();
+                        problem.addWindow(material, omega_min, omega_max);
+                        if (problem.size() == 0)
+                            throw std::runtime_error("no data points inside the fitting window");
+
+                        bool fitted = false;
+                        if (previous) {
+                            const DrudeFit& start = previous->result;
+                            ModelFit<DrudeModel> local = lm.fit({start.fit.omega_p, start.fit.gamma, start.eps_inf},
+                                                                workspace);
+                            fit.result.fit.omega_p = local.params[0];
+                            fit.result.fit.gamma = local.params[1];
+                            fit.result.fit.error = local.error;
+                            fit.result.fit.evaluations = local.evaluations;
+                            fit.result.eps_inf = local.params[DrudeModel::kEpsInf];
+                            fit.result.iterations = local.iterations;
+                            fit.result.converged = local.converged;
+                            fitted = local.converged && local.error <= map_fallback_ratio * start.fit.error;
+                        }
+                        if (!fitted) {
+                            // Global search, polished by Levenberg–Marquardt so that all pixels
+                            // are fitted to the same (continuous) optimum
+                            DrudeFit global = fitDrude(problem, mode, 1);
+                            ModelFit<DrudeModel> local = lm.fit({global.fit.omega_p, global.fit.gamma, global.eps_inf},
+                                                                workspace);
+                            if (local.error < global.fit.error) {
+                                global.fit.omega_p = local.params[0];
+                                global.fit.gamma = local.params[1];
+                                global.fit.error = local.error;
+                                global.eps_inf = local.params[DrudeModel::kEpsInf];
+                            }
+                            global.fit.evaluations += local.evaluations + fit.result.fit.evaluations;
+                            if (!previous || global.fit.error < fit.result.fit.error) {
+                                fit.result = global;
+                                fit.global = true;
+                            } else {
+                                fit.result.fit.evaluations = global.fit.evaluations;
+                            }
+                            ++global_fits;
+                        }
+                        previous = &fit;
+                    } catch (const std::exception& e) {
+                        fit.status = e.what();
+                    }
+                }
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    const size_t workers = std::min<size_t>(num_threads ? num_threads : std::max(1u, std::thread::hardware_concurrency()),
+                                            tiles_down * tiles_across);
+    std::cout << "\n***Map fit***\nFitting " << map.rows << " x " << map.cols << " pixels from " << filename
+              << " in " << tiles_down * tiles_across << " tiles on " << workers << " threads\n";
+    {
+        ScopedTimer timer ("map_fit");
+        GridSearch::parallel(workers, work);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::ofstream out (output);
+    if (!out) {
+        std::cerr << "Error: Could not write " << output << '\n';
+        return 1;
+    }
+    out.precision(10);
+    out << "row,col,points,omega_p,gamma,eps_inf,error,evaluations,start,status\n";
+    size_t failed = 0;
+    for (size_t pixel = 0; pixel < map.pixels(); ++pixel) {
+        const PixelFit& fit = fits[pixel];
+        std::string status = fit.status;
+        std::replace(status.begin(), status.end(), '"', '\'');
+        out << pixel / map.cols << ',' << pixel % map.cols << ',' << map.offsets[pixel + 1] - map.offsets[pixel] << ',';
+        if (fit.status == "ok")
+            out << fit.result.fit.omega_p << ',' << fit.result.fit.gamma << ',' << fit.result.eps_inf << ','
+                << fit.result.fit.error << ',' << fit.result.fit.evaluations << ',' << (fit.global ? "global" : "warm");
+        else
+            out << ",,,,,";
+        out << ",\"" << status << "\"\n";
+        failed += (fit.status != "ok");
+    }
+    std::cout << "Map complete: " << map.pixels() - failed << " fitted (" << global_fits.load() << " global searches), "
+              << failed << " failed in " << seconds << " s. Results written to " << output << '\n';
+    return failed == map.pixels() ? 1 : 0;
+}
+
+// Error-surface scan of the configured data file over the ScanGrid of the current settings.
+int runScan(const std::string& material_name, const std::string& data_file) {
+    try {
+        Material material (material_name);
+        if (!stream_data) {
+            material.loadData(data_file, use_data_cache);
+            applyResampling(material);
+        }
+        FitProblem problem = stream_data ? streamFitProblem(material_name, data_file, stream_chunk_points,
+                                                            omega_min, omega_max)
+                                         : FitProblem(material, omega_min, omega_max);
+        if (problem.size() == 0)
+            throw std::runtime_error("Error: No data points inside the fitting window");
+
+        ScanGrid grid {{omega_p_min, omega_p_max, domega_p, gamma_min, gamma_max, dgamma},
+                       scan_eps_inf_min, scan_eps_inf_max, scan_deps_inf};
+        std::cout << "\n***Error-surface scan***\n" << grid.plane.omegaPCount() << " omega_p x " << grid.plane.gammaCount()
+                  << " gamma x " << grid.epsInfCount() << " eps_inf = " << grid.size() << " points on the "
+                  << (scan_backend == ScanBackend::CUDA ? "CUDA" : "CPU") << " backend\n";
+        auto start = std::chrono::steady_clock::now();
+        ErrorScan scan = surface_file.empty()
+                             ? scanErrorSurface(problem, grid, scan_backend, false, num_threads)
+                             : storedErrorSurface(problem, grid, scan_backend, num_threads, material_name, data_file);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Smallest error " << scan.best.error << " at omega_p " << scan.best.omega_p << " rad/sec, gamma "
+                  << scan.best.gamma << " 1/s, eps_inf " << scan.eps_inf << " (" << seconds << " s)\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+// Thin-film sweep of the configured data file (--film): R and T written to 'output' as a NumPy
+// array [Rs, Rp, Ts, Tp][thickness][angle][wavelength] with a JSON sidecar <output>.json.
+int runFilm(const std::string& material_name, const std::string& data_file, const std::string& output,
+            SearchMode mode) {
+    try {
+        Material material (material_name);
+        material.loadData(data_file, use_data_cache);
+        applyResampling(material);
+        FilmSpectrum spectrum;
+        if (film_source == FilmSource::Drude) {
+            FitProblem problem (material);
+            if (problem.size() == 0)
+                throw std::runtime_error("Error: No data points inside the fitting window");
+            DrudeFit fit = runFit(problem, ModelType::Drude, mode, num_threads);
+            std::cout << "Drude fit: omega_p " << fit.fit.omega_p << " rad/sec, gamma " << fit.fit.gamma
+                      << " 1/s, eps_inf " << fit.eps_inf << '\n';
+            spectrum = filmSpectrum(material.getWavelength(), fit.eps_inf, fit.fit.omega_p, fit.fit.gamma);
+        } else {
+            spectrum = filmSpectrum(material);
+        }
+
+        FilmSweep sweep {film_thickness_min, film_thickness_max, film_dthickness, film_angle_min, film_angle_max,
+                         film_dangle, film_ambient_index, film_substrate_index};
+        auto start = std::chrono::steady_clock::now();
+        FilmResult result = solveFilmSweep(spectrum, sweep, num_threads);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "\n***Thin-film sweep***\n" << result.thicknesses << " thicknesses x " << result.angles
+                  << " angles x " << result.wavelengths << " wavelengths = " << result.size() << " points (s and p) in "
+                  << seconds << " s (" << filmKernels().name << " kernel)\n";
+
+        writeNpy(output, result.values.data(), {FilmResult::QuantityCount, result.thicknesses, result.angles,
+                                               result.wavelengths});
+        std::ofstream out (output + ".json");
+        out.precision(17);
+        out << "{\n  \"array\": \"" << jsonEscape(std::filesystem::path(output).filename().string()) << "\",\n"
+            << "  \"layout\": \"float64 [Rs, Rp, Ts, Tp][thickness][angle][wavelength]\",\n"
+            << "  \"material\": \"" << jsonEscape(material_name) << "\",\n"
+            << "  \"data_file\": \"" << jsonEscape(data_file) << "\",\n"
+            << "  \"film_source\": \"" << (film_source == FilmSource::Drude ? "drude" : "data") << "\",\n"
+            << "  \"ambient_index\": " << sweep.ambient_index << ", \"substrate_index\": " << sweep.substrate_index << ",\n"
+            << "  \"thickness_nm_min\": " << sweep.thickness_min << ", \"thickness_nm_step\": " << sweep.dthickness
+            << ", \"thickness_count\": " << result.thicknesses << ",\n"
+            << "  \"angle_deg_min\": " << sweep.angle_min << ", \"angle_deg_step\": " << sweep.dangle
+            << ", \"angle_count\": " << result.angles << ",\n"
+            << "  \"wavelength_nm\": [";
+        for (size_t i = 0; i < spectrum.wavelength.size(); ++i)
+            out << (i ? ", " : "") << spectrum.wavelength[i];
+        out << "]\n}\n";
+        if (!out)
+            throw std::runtime_error("Error: Could not write " + output + ".json");
+        std::cout << "Results written to " << output << " (axes in " << output << ".json)\n";
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+// The whole program for one command line; returns the exit status. The settings and options
+// it is given change the tunable globals, which stay changed after it returns.
+int runCommandLine(int argc, char* argv[]) {
+
+    // Default for this version of the code.
+    PlotLevel plotLevel = PlotLevel::Advanced;  // Change Advanced to Basic to display the version 1 figures.
+    SearchMode searchMode = SearchMode::Grid;   // Change Grid to Refine or LevenbergMarquardt for a faster search.
+    ModelType modelType = ModelType::Drude;     // Change Drude to DrudeLorentz to fit the full data range.
+    std::string data_file = "data/Ag_Palik_400-900nm.txt";
+    std::string material_name = "Silver";
+
+    // All of the above and the tunable globals can also be changed at run time
+    Settings settings;
+    settings.add("data_file", data_file, "n,k data file: wavelength (nm), n, k per line");
+    settings.add("material", material_name, "material name for the report, figures and results");
+    settings.addEnum("plot_level", plotLevel, {{"basic", PlotLevel::Basic}, {"advanced", PlotLevel::Advanced}},
+                     "figures to draw");
+    settings.addEnum("search_mode", searchMode, {{"grid", SearchMode::Grid}, {"refine", SearchMode::Refine},
+                                                 {"levenberg-marquardt", SearchMode::LevenbergMarquardt}},
+                     "parameter search");
+    settings.addEnum("model", modelType, {{"drude", ModelType::Drude}, {"drude-lorentz", ModelType::DrudeLorentz}},
+                     "dispersion model");
+    settings.add("omega_min", omega_min, "Drude fitting window, lower end (rad/s)");
+    settings.add("omega_max", omega_max, "Drude fitting window, upper end (rad/s)");
+    settings.add("omega_p_min", omega_p_min, "omega_p search range, lower end (rad/s)");
+    settings.add("omega_p_max", omega_p_max, "omega_p search range, upper end (rad/s)");
+    settings.add("gamma_min", gamma_min, "gamma search range, lower end (1/s)");
+    settings.add("gamma_max", gamma_max, "gamma search range, upper end (1/s)");
+    settings.add("domega_p", domega_p, "omega_p step of the grid search (rad/s)");
+    settings.add("dgamma", dgamma, "gamma step of the grid search (1/s)");
+    settings.add("refine_domega_p", refine_domega_p, "final omega_p step of the refine search (rad/s)");
+    settings.add("refine_dgamma", refine_dgamma, "final gamma step of the refine search (1/s)");
+    settings.add("lm_seed_points", lm_seed_points, "points per axis of the Levenberg-Marquardt seed grid");
+    settings.add("eps_inf", eps_inf, "high-frequency permittivity (starting value when fitted)");
+    settings.add("fit_eps_inf", fit_eps_inf, "fit eps_inf together with omega_p and gamma");
+    settings.addCustom("lorentz_seed", "starting Lorentz oscillators: strength, omega0 (rad/s), gamma (1/s); ...",
+                       [](const std::string& text) { lorentz_seed = parseOscillators(text); },
+                       []() { return formatOscillators(lorentz_seed); });
+    settings.add("map_tile", map_tile, "tile side of the map fit (pixels); single-row sequences use map_tile^2 steps");
+    settings.add("map_fallback_ratio", map_fallback_ratio, "global search when a warm-started pixel's error exceeds this times its neighbour's");
+    settings.add("scan_eps_inf_min", scan_eps_inf_min, "eps_inf range of --scan, lower end");
+    settings.add("scan_eps_inf_max", scan_eps_inf_max, "eps_inf range of --scan, upper end (excluded)");
+    settings.add("scan_deps_inf", scan_deps_inf, "eps_inf step of --scan");
+    settings.add("surface_file", surface_file, "error surface store of --scan and Grid fits (.npy, empty = off)");
+    settings.addEnum("scan_backend", scan_backend, {{"cpu", ScanBackend::CPU}, {"cuda", ScanBackend::CUDA}},
+                     "where --scan evaluates the error surface");
+    settings.add("bootstrap_replicates", bootstrap_replicates, "bootstrap replicates for confidence intervals (0 = off)");
+    settings.add("bootstrap_confidence", bootstrap_confidence, "coverage of the bootstrap intervals, e.g. 0.95");
+    settings.add("bootstrap_seed", bootstrap_seed, "random seed of the bootstrap resampling");
+    settings.add("num_threads", num_threads, "worker threads (0 = all hardware threads)");
+    settings.add("grid_pruning", grid_pruning, "abandon grid candidates whose partial error exceeds the best so far");
+    settings.add("mixed_precision", mixed_precision, "run the grid searches in float and polish the best point in double");
+    settings.add("use_data_cache", use_data_cache, "keep a binary .mdbin copy of parsed data files");
+    settings.add("use_fit_cache", use_fit_cache, "reuse stored results of fits with unchanged data and settings");
+    settings.add("fit_cache_dir", fit_cache_dir, "directory of the fit result cache");
+    settings.add("stream_data", stream_data, "stream the data file in chunks (no full-spectrum plots)");
+    settings.add("stream_chunk_points", stream_chunk_points, "points per chunk in streaming mode");
+    settings.add("resample_points", resample_points, "resample n, k onto this many uniform energies (0 = off)");
+    settings.add("resample_energy_min", resample_energy_min, "lower end of the resampling grid in eV (0 = data range)");
+    settings.add("resample_energy_max", resample_energy_max, "upper end of the resampling grid in eV (0 = data range)");
+    settings.addEnum("kk_check", kk_check, {{"off", KKCheck::Off}, {"warn", KKCheck::Warn}, {"reject", KKCheck::Reject}},
+                     "Kramers-Kronig check of the data before the fit");
+    settings.add("kk_points", kk_points, "uniform points of the Kramers-Kronig check");
+    settings.add("kk_regions", kk_regions, "energy bands reported by the Kramers-Kronig check");
+    settings.add("kk_tolerance", kk_tolerance, "largest RMS deviation of a band, relative to |eps|");
+    settings.addEnum("film_source", film_source, {{"data", FilmSource::Data}, {"drude", FilmSource::Drude}},
+                     "film permittivity of --film: measured data or the Drude fit");
+    settings.add("film_thickness_min", film_thickness_min, "film thickness range of --film in nm, lower end");
+    settings.add("film_thickness_max", film_thickness_max, "film thickness range of --film in nm, upper end (excluded)");
+    settings.add("film_dthickness", film_dthickness, "film thickness step of --film in nm");
+    settings.add("film_angle_min", film_angle_min, "angle of incidence range of --film in degrees, lower end");
+    settings.add("film_angle_max", film_angle_max, "angle of incidence range of --film in degrees, upper end (excluded)");
+    settings.add("film_dangle", film_dangle, "angle of incidence step of --film in degrees");
+    settings.add("film_ambient_index", film_ambient_index, "refractive index of the ambient medium of --film");
+    settings.add("film_substrate_index", film_substrate_index, "refractive index of the substrate of --film");
+    settings.add("headless", headless, "no figures and no Python; results are written to results_file");
+    settings.add("results_file", results_file, "results written in headless mode or with --results (.json or .csv)");
+    settings.add("plot_max_points", plot_max_points, "plotted points per series before decimation (0 = all)");
+
+    // Command line (settings and options are applied in the order given):
+    //   metal_dispersion [--config run.toml] [--set key=value ...] [--print-config] [--model drude|drude-lorentz]
+    //                    [--eps-inf <value>] [--fit-eps-inf] [--bootstrap <replicates>] [--no-plot]
+    //                    [--results fit.json|fit.csv]
+    //   metal_dispersion --batch <files, directories or patterns...> [--output results.csv]
+    //   metal_dispersion --map <map file> [--output map_results.csv]
+    //   metal_dispersion --scan [--set scan_backend=cuda]
+    //   metal_dispersion --film [--output film_results.npy]
+    std::vector<std::string> args (argv + 1, argv + argc);
+    std::vector<std::string> inputs;
+    std::string output;   // --output, default batch_results.csv / map_results.csv / film_results.npy
+    std::string map_file;
+    bool scan = false;
+    bool film = false;
+    bool batch = false;
+    bool write_results = false;
+    bool print_config = false;
+    std::string trace_file;
+    // Any error, from the command line to the last output file, ends the run with its message
+    // and status 1
+    try {
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "--batch") {
+                batch = true;
+            } else if (args[i] == "--output" && i + 1 < args.size()) {
+                output = args[++i];
+            } else if (args[i] == "--map" && i + 1 < args.size()) {
+                map_file = args[++i];
+            } else if (args[i] == "--scan") {
+                scan = true;
+            } else if (args[i] == "--film") {
+                film = true;
+            } else if (args[i] == "--config" && i + 1 < args.size()) {
+                settings.load(args[++i]);
+            } else if (args[i] == "--set" && i + 1 < args.size()) {
+                settings.assign(args[++i]);
+            } else if (args[i] == "--print-config") {
+                print_config = true;
+            } else if (args[i] == "--profile") {
+                Profiler::enabled = true;
+            } else if (args[i] == "--trace" && i + 1 < args.size()) {
+                trace_file = args[++i];
+                Profiler::enabled = true;
+            } else if (args[i] == "--model" && i + 1 < args.size()) {
+                settings.set("model", args[++i]);
+            } else if (args[i] == "--eps-inf" && i + 1 < args.size()) {
+                settings.set("eps_inf", args[++i]);
+            } else if (args[i] == "--fit-eps-inf") {
+                fit_eps_inf = true;
+            } else if (args[i] == "--bootstrap" && i + 1 < args.size()) {
+                settings.set("bootstrap_replicates", args[++i]);
+            } else if (args[i] == "--no-plot") {
+                headless = true;
+            } else if (args[i] == "--results" && i + 1 < args.size()) {
+                results_file = args[++i];
+                write_results = true;
+            } else if (batch) {
+                inputs.push_back(args[i]);
+            } else {
+                std::cerr << "Unknown argument: " << args[i] << '\n'
+                          << "Usage: " << argv[0] << " [--config run.toml] [--set key=value ...] [--print-config]"
+                          << " [--model drude|drude-lorentz] [--eps-inf <value>] [--fit-eps-inf]"
+                          << " [--bootstrap <replicates>] [--no-plot]"
+                          << " [--results fit.json|fit.csv] [--profile] [--trace trace.json]\n"
+                          << "       " << argv[0] << " --batch <files, directories or patterns...> [--output results.csv]"
+                          << " [same options]\n"
+                          << "       " << argv[0] << " --map <map file> [--output map_results.csv] [same options]\n"
+                          << "       " << argv[0] << " --scan [same options]\n"
+                          << "       " << argv[0] << " --film [--output film_results.npy] [same options]\n";
+                return 1;
+            }
+        }
+        validateSettings();
+#ifdef METAL_DISPERSION_HEADLESS
+        headless = true;   // no plotting code in this build
+#endif
+        if (print_config) {
+            settings.print(std::cout);
+            return 0;
+        }
+
+        // Profile summary (--profile) and/or Chrome trace (--trace) at the end of the run; like the
+        // caches, a trace that cannot be written is only a warning, never a failed run
+        auto reportProfile = [&trace_file]() {
+            if (!Profiler::enabled)
+                return;
+            Profiler::printSummary(std::cout);
+            if (!trace_file.empty()) {
+                try {
+                    Profiler::writeTrace(trace_file);
+                    std::cout << "Trace written to " << trace_file << " (open in chrome://tracing or Perfetto)\n";
+                } catch (const std::exception&) {
+                    std::cerr << "Warning: could not write trace " << trace_file << '\n';
+                }
+            }
+        };
+
+        if (batch) {
+            if (modelType != ModelType::Drude) {
+                std::cerr << "Error: --batch fits the Drude model only (model = drude-lorentz is not supported)\n";
+                return 1;
+            }
+            int status = runBatch(inputs, output.empty() ? "batch_results.csv" : output, searchMode);
+            reportProfile();
+            return status;
+        }
+        if (!map_file.empty()) {
+            if (modelType != ModelType::Drude) {
+                std::cerr << "Error: --map fits the Drude model only (model = drude-lorentz is not supported)\n";
+                return 1;
+            }
+            int status = runMap(map_file, output.empty() ? "map_results.csv" : output, searchMode);
+            reportProfile();
+            return status;
+        }
+        if (scan) {
+            int status = runScan(material_name, data_file);
+            reportProfile();
+            return status;
+        }
+        if (film) {
+            int status = runFilm(material_name, data_file, output.empty() ? "film_results.npy" : output, searchMode);
+            reportProfile();
+            return status;
+        }
+
+        // Start Python on the render thread while the data are loaded and fitted
+        Plot::prepare();
+
+        Material Ag (material_name);
+        if (!stream_data) {
+            Ag.loadData(data_file, use_data_cache);
+            applyResampling(Ag);
+            if (!checkKramersKronig(Ag)) {
+                std::cerr << "Error: The data fail the Kramers-Kronig check (kk_check = reject)\n";
+                return 1;
+            }
+        }
+        std::string name = Ag.getName();
+        const std::vector<double>& wl = Ag.getWavelength();
+        const std::vector<double>& n = Ag.getN();
+        const std::vector<double>& k = Ag.getK();
+        const std::vector<double>& energy = Ag.getEnergy();
+        const std::vector<double>& omega = Ag.getOmega();
+
+        const std::vector<double>& eps1_data = Ag.computeEpsilon().first;
+        const std::vector<double>& eps2_data = Ag.computeEpsilon().second;
+
+        // In-window samples and weights, prepared once for all fitters
+        // (the Drude–Lorentz model uses every sample)
+        const bool drude_lorentz = modelType == ModelType::DrudeLorentz;
+        const double window_min = drude_lorentz ? 0.0 : omega_min;
+        const double window_max = drude_lorentz ? std::numeric_limits<double>::max() : omega_max;
+        FitProblem problem = stream_data ? streamFitProblem(name, data_file, stream_chunk_points, window_min, window_max)
+                                         : FitProblem(Ag, window_min, window_max);
+        if (problem.size() == 0)
+            throw std::runtime_error("Error: No data points inside the fitting window");
+        
+        bool from_cache = false;
+        const bool surface_fit = !surface_file.empty() && !drude_lorentz && searchMode == SearchMode::Grid && !fit_eps_inf;
+        DrudeFit result = surface_fit ? fitDrudeSurface(problem, num_threads, name, data_file)
+                                      : runFit(problem, modelType, searchMode, num_threads, &from_cache);
+        if (from_cache)
+            std::cout << "\nFit result loaded from the fit cache (" << fit_cache_dir << ")\n";
+        if (drude_lorentz && bootstrap_replicates > 0)
+            std::cout << "\nBootstrap intervals are only computed for the Drude model.\n";
+        const FitResult& fit = result.fit;
+        double best_eps_inf = result.eps_inf;
+        if (searchMode == SearchMode::LevenbergMarquardt || drude_lorentz) {
+            std::cout << "\nLevenberg-Marquardt " << (result.converged ? "converged" : "stopped") << " after "
+                      << result.iterations << " iterations\n";
+        }
+        double best_error = fit.error;
+        double best_omega_p = fit.omega_p;
+        double best_gamma = fit.gamma;
+
+        // Reporting best parameters found in the grid search
+        if (drude_lorentz) {
+            std::cout << "\n***Drude-Lorentz model***\nFitted over the full data range "
+                  << result.window_min << " < omega < " << result.window_max << " rad/s (" << problem.size()
+                  << " points) with the following fitting parameters:\n";
+        } else {
+            std::cout << "\n***Drude model***\nFitted only within "
+                  << omega_min << " < omega < " << omega_max << " rad/s with the following fitting parameters:\n";
+        }
+        std::cout << "omega_p: " << best_omega_p << "  rad/sec \n";
+        std::cout << "gamma: " << best_gamma << "  1/s \n";
+        std::cout << "eps_inf: " << best_eps_inf
+                  << (fit_eps_inf || drude_lorentz ? " (fitted)" : "") << '\n';
+        for (size_t j = 0; j < result.oscillators.size(); ++j) {
+            const LorentzOscillator& o = result.oscillators[j];
+            std::cout << "oscillator " << j + 1 << ": strength " << o.strength << ", omega0 " << o.omega0
+                      << " rad/sec, gamma " << o.gamma << " 1/s\n";
+        }
+
+        std::cout << "Best normalized error is : " << best_error << '\n';
+        std::cout << "Error evaluations: " << fit.evaluations << " (" << drudeKernels().name << " kernel)\n";
+        if (const BootstrapResult& b = result.bootstrap; b.replicates > 0) {
+            std::cout << "\n***Bootstrap***\n" << b.confidence * 100 << "% intervals from " << b.replicates << " replicates";
+            if (b.failed)
+                std::cout << " (" << b.failed << " did not converge)";
+            std::cout << ":\n";
+            auto line = [](const char* name, const ParameterInterval& p, const char* unit) {
+                std::cout << name << ": [" << p.lower << ", " << p.upper << "]" << unit
+                          << " (standard error " << p.std_error << ")\n";
+            };
+            line("omega_p", b.omega_p, "  rad/sec");
+            line("gamma", b.gamma, "  1/s");
+            if (fit_eps_inf)
+                line("eps_inf", b.eps_inf, "");
+        }
+        
+        // Calculating the model permittivities based on the best fitting parameters
+        std::vector<std::complex<double>> eps_model(omega.size());
+        for(size_t i = 0; i<omega.size(); i++){
+            eps_model[i]= drude_lorentz_eps(omega[i], best_eps_inf, best_omega_p, best_gamma, result.oscillators);
+        }
+
+        std::vector<double> eps1_model(eps_model.size());
+        std::vector<double> eps2_model(eps_model.size());
+        for (size_t i = 0; i < omega.size(); i++){
+        eps1_model[i] = eps_model[i].real();
+        eps2_model[i] = eps_model[i].imag();
+        }
+
+        // Plotting the results (the full spectrum is not kept in streaming mode)
+        if (stream_data) {
+            std::cout << "\nStreaming mode: full-spectrum plots are skipped.\n";
+        }
+
+        if (!stream_data && plotLevel == PlotLevel::Advanced) {
+            const std::string model = drude_lorentz ? "Drude-Lorentz" : "Drude";
+            Plot::dispersionPlot(1, energy, eps1_model, eps2_model,
+                               model + " Fit vs Palik Data (" + name + ")" + " ",
+                               "energy  (eV)", "Permittivity (ε)",
+                               "ε₁ " + model + " fit", "ε₂ " + model + " fit",
+                               "--");
+
+
+            Plot::dispersionPlot(1, energy, eps1_data, eps2_data,
+                               model + " Fit vs Palik Data (" + name + ")" + " ",
+                               "energy  (eV)", "Permittivity (ε)",
+                               "ε₁ data", "ε₂ data");
+        }
+
+        if (!stream_data && plotLevel == PlotLevel::Basic) {   
+            Plot::dispersionPlot(1, wl, n, k,
+                                "Refractive Index of " + name + " (Palik, 400–900 nm)",
+                                "Wavelength λ (nm)", "Refractive index (n)",
+                                "n data", "k data");
+
+            Plot::dispersionPlot(2, wl, eps1_data, eps2_data,
+                                "Complex Permittivity of " + name + " (Palik, 400–900 nm)",
+                                "Wavelength λ (nm)", "Permittivity (ε)",
+                                "ε₁ data", "ε₂ data");
+        }
+
+        // Headless runs write the results instead of showing them; a file that cannot be written
+        // fails the run (status 1) but still leaves the fit on the console and in the figures
+        int status = 0;
+        if (headless || write_results) {
+            if (stream_data) {
+                std::cerr << "Streaming mode keeps no spectrum: results are not written to " << results_file << '\n';
+            } else {
+                try {
+                    writeResults(results_file, Ag, data_file, searchMode, result, problem.size(), eps1_model, eps2_model);
+                    std::cout << "\nResults written to " << results_file << '\n';
+                } catch (const std::exception& e) {
+                    std::cerr << e.what() << '\n';
+                    status = 1;
+                }
+            }
+        }
+
+        std::cout << "\nDispersion analysis complete. " << (headless ? "No figures (headless mode)." : "Figures displayed successfully.") << "\n"
+                  << "*************************************************************";
+        Plot::show();
+        reportProfile();
+
+        return status;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
+
+// Define METAL_DISPERSION_NO_MAIN to include this file into another program (e.g. the
+// benchmarks in bench/) without its main().
+#ifndef METAL_DISPERSION_NO_MAIN
+int main(int argc, char* argv[]) {
+    return runCommandLine(argc, argv);
+}
+#endif
@@ -0,0 +1,199 @@
+// Metal Dispersion Analyzer - CUDA backend of the error-surface scan
+// Optional: compile with
+//   nvcc -O3 -std=c++17 -c metal_dispersion_cuda.cu -o metal_dispersion_cuda.o
+// and link the object into metal_dispersion.cpp built with -DMETAL_DISPERSION_CUDA (-lcudart).
+//
+// One thread per grid point. The threads of a block walk the samples in the same order, so
+// every sample load is a broadcast: straight from constant memory when the spectrum fits
+// (kConstantSamples), otherwise staged through shared memory kChunk samples at a time.
+// Each point is summed sequentially like the scalar CPU kernel, so with the GPU's FMA
+// contraction the errors should agree with the CPU kernels to rounding.
+// Experimental: this file has not yet been compiled and run on a GPU (see README).
+
+#include "metal_dispersion_cuda.h"
+
+#include <cuda_runtime.h>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr int kThreads = 256;
+constexpr size_t kConstantSamples = 1536;   // 5 arrays × 1536 doubles = 60 KB of the 64 KB
+constexpr size_t kChunk = 256;              // samples per shared-memory stage (10 KB)
+constexpr double kNoError = 1e300;          // same start value as the CPU searches (FitResult)
+constexpr unsigned long long kNoIndex = ~0ull;
+
+// Samples as 5 arrays of kConstantSamples: ω², 1/ω, ε₁, ε₂, weight.
+__constant__ double c_spectrum[5 * kConstantSamples];
+
+struct Point {
+    double error;
+    unsigned long long index;
+};
+
+// Order of the CPU scan: smaller error first, then lower index.
+__host__ __device__ inline bool before(const Point& a, const Point& b) {
+    return a.error < b.error || (a.error == b.error && a.index < b.index);
+}
+
+__device__ __forceinline__ double term(double omega2, double inv_omega, double eps1, double eps2, double weight,
+                                       double eps_inf, double wp2, double g2, double wp2g) {
+    const double inv_d = 1.0 / (omega2 + g2);
+    const double re = eps_inf - wp2 * inv_d - eps1;
+    const double im = wp2g * inv_d * inv_omega - eps2;
+    return (re*re + im*im) * weight;
+}
+
+// Errors of blockDim.x consecutive grid points and the best of them per block.
+// 'spectrum' (5 arrays of 'count') is only read when Constant is false.
+template <bool Constant>
+__global__ void scanKernel(const double* __restrict__ spectrum, size_t count,
+                           const double* __restrict__ omega_p, size_t n_omega_p,
+                           const double* __restrict__ gamma, size_t n_gamma,
+                           const double* __restrict__ eps_inf, size_t total,
+                           double* __restrict__ surface, Point* __restrict__ block_best) {
+    __shared__ double s_spectrum[5 * kChunk];
+    __shared__ Point s_best[kThreads];
+
+    const size_t idx = blockIdx.x * static_cast<size_t>(blockDim.x) + threadIdx.x;
+    const bool active = idx < total;
+    const size_t plane = n_omega_p * n_gamma;
+    const double einf = active ? eps_inf[idx / plane] : 0.0;
+    const double wp = active ? omega_p[idx % plane / n_gamma] : 0.0;
+    const double g = active ? gamma[idx % n_gamma] : 0.0;
+    const double wp2 = wp * wp;
+    const double g2 = g * g;
+    const double wp2g = wp2 * g;
+
+    double error = 0.0;
+    if (Constant) {
+        for (size_t s = 0; s < count; ++s)
+            error += term(c_spectrum[s], c_spectrum[kConstantSamples + s], c_spectrum[2*kConstantSamples + s],
+                          c_spectrum[3*kConstantSamples + s], c_spectrum[4*kConstantSamples + s],
+                          einf, wp2, g2, wp2g);
+    } else {
+        // Inactive threads still help staging, so every thread reaches the barriers.
+        for (size_t base = 0; base < count; base += kChunk) {
+            const size_t n = count - base < kChunk ? count - base : kChunk;
+            __syncthreads();
+            for (size_t t = threadIdx.x; t < 5 * kChunk; t += blockDim.x) {
+                const size_t array = t / kChunk, s = t % kChunk;
+                if (s < n)
+                    s_spectrum[t] = spectrum[array * count + base + s];
+            }
+            __syncthreads();
+            for (size_t s = 0; s < n; ++s)
+                error += term(s_spectrum[s], s_spectrum[kChunk + s], s_spectrum[2*kChunk + s],
+                              s_spectrum[3*kChunk + s], s_spectrum[4*kChunk + s], einf, wp2, g2, wp2g);
+        }
+    }
+
+    if (active && surface)
+        surface[idx] = error;
+    // Like the CPU scan, errors that are not below kNoError (including NaN) never win.
+    s_best[threadIdx.x] = (active && error < kNoError) ? Point {error, idx} : Point {kNoError, kNoIndex};
+    for (unsigned stride = blockDim.x / 2; stride > 0; stride /= 2) {
+        __syncthreads();
+        if (threadIdx.x < stride && before(s_best[threadIdx.x + stride], s_best[threadIdx.x]))
+            s_best[threadIdx.x] = s_best[threadIdx.x + stride];
+    }
+    if (threadIdx.x == 0)
+        block_best[blockIdx.x] = s_best[0];
+}
+
+// Device allocation freed on scope exit.
+struct DeviceBuffer {
+    void* ptr = nullptr;
+    ~DeviceBuffer() {
+        if (ptr)
+            cudaFree(ptr);
+    }
+    cudaError_t allocate(size_t bytes) {
+        return cudaMalloc(&ptr, bytes ? bytes : 1);
+    }
+    template <class T>
+    T* as() const {
+        return static_cast<T*>(ptr);
+    }
+};
+
+int fail(cudaError_t status, const char* what, char* error, size_t error_size) {
+    if (error && error_size)
+        std::snprintf(error, error_size, "%s: %s", what, cudaGetErrorString(status));
+    return static_cast<int>(status);
+}
+
+} // namespace
+
+#define METAL_DISPERSION_CUDA_CHECK(call)                          \
+    do {                                                           \
+        cudaError_t status_ = (call);                              \
+        if (status_ != cudaSuccess)                                \
+            return fail(status_, #call, error, error_size);        \
+    } while (0)
+
+int cudaScanErrorSurface(const CudaScanSpectrum& spectrum, const CudaScanGrid& grid, double* surface,
+                         double* best_error, uint64_t* best_index, char* error, size_t error_size) {
+    const size_t count = spectrum.count;
+    const size_t total = grid.eps_inf_count * grid.omega_p_count * grid.gamma_count;
+    *best_error = kNoError;
+    *best_index = kNoIndex;
+    if (error && error_size)
+        error[0] = '\0';
+    if (total == 0)
+        return 0;
+
+    const double* arrays[5] = {spectrum.omega2, spectrum.inv_omega, spectrum.eps1, spectrum.eps2, spectrum.weight};
+    const bool constant = count <= kConstantSamples;
+    DeviceBuffer d_spectrum, d_omega_p, d_gamma, d_eps_inf, d_surface, d_best;
+    if (constant) {
+        for (size_t a = 0; a < 5; ++a)
+            if (count)
+                METAL_DISPERSION_CUDA_CHECK(cudaMemcpyToSymbol(c_spectrum, arrays[a], count * sizeof(double),
+                                                               a * kConstantSamples * sizeof(double)));
+    } else {
+        METAL_DISPERSION_CUDA_CHECK(d_spectrum.allocate(5 * count * sizeof(double)));
+        for (size_t a = 0; a < 5; ++a)
+            METAL_DISPERSION_CUDA_CHECK(cudaMemcpy(d_spectrum.as<double>() + a * count, arrays[a],
+                                                   count * sizeof(double), cudaMemcpyHostToDevice));
+    }
+    const std::pair<DeviceBuffer*, std::pair<const double*, size_t>> axes[3] = {
+        {&d_omega_p, {grid.omega_p, grid.omega_p_count}},
+        {&d_gamma, {grid.gamma, grid.gamma_count}},
+        {&d_eps_inf, {grid.eps_inf, grid.eps_inf_count}}};
+    for (const auto& [buffer, axis] : axes) {
+        METAL_DISPERSION_CUDA_CHECK(buffer->allocate(axis.second * sizeof(double)));
+        METAL_DISPERSION_CUDA_CHECK(cudaMemcpy(buffer->ptr, axis.first, axis.second * sizeof(double),
+                                               cudaMemcpyHostToDevice));
+    }
+
+    const size_t blocks = (total + kThreads - 1) / kThreads;
+    if (surface)
+        METAL_DISPERSION_CUDA_CHECK(d_surface.allocate(total * sizeof(double)));
+    METAL_DISPERSION_CUDA_CHECK(d_best.allocate(blocks * sizeof(Point)));
+
+    if (constant)
+        scanKernel<true><<<static_cast<unsigned>(blocks), kThreads>>>(
+            nullptr, count, d_omega_p.as<double>(), grid.omega_p_count, d_gamma.as<double>(), grid.gamma_count,
+            d_eps_inf.as<double>(), total, d_surface.as<double>(), d_best.as<Point>());
+    else
+        scanKernel<false><<<static_cast<unsigned>(blocks), kThreads>>>(
+            d_spectrum.as<double>(), count, d_omega_p.as<double>(), grid.omega_p_count, d_gamma.as<double>(),
+            grid.gamma_count, d_eps_inf.as<double>(), total, d_surface.as<double>(), d_best.as<Point>());
+    METAL_DISPERSION_CUDA_CHECK(cudaGetLastError());
+    METAL_DISPERSION_CUDA_CHECK(cudaDeviceSynchronize());
+
+    std::vector<Point> best (blocks);
+    METAL_DISPERSION_CUDA_CHECK(cudaMemcpy(best.data(), d_best.ptr, blocks * sizeof(Point), cudaMemcpyDeviceToHost));
+    if (surface)
+        METAL_DISPERSION_CUDA_CHECK(cudaMemcpy(surface, d_surface.ptr, total * sizeof(double), cudaMemcpyDeviceToHost));
+    Point result {kNoError, kNoIndex};
+    for (const Point& p : best)
+        if (before(p, result))
+            result = p;
+    *best_error = result.error;
+    *best_index = result.index;
+    return 0;
+}
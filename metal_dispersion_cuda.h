@@ -0,0 +1,42 @@
+// Metal Dispersion Analyzer - CUDA backend of the error-surface scan
+// Interface between metal_dispersion.cpp (built with -DMETAL_DISPERSION_CUDA) and
+// metal_dispersion_cuda.cu (built with nvcc). Plain structs and pointers only, so the C++
+// side does not need the CUDA headers.
+
+#ifndef METAL_DISPERSION_CUDA_H
+#define METAL_DISPERSION_CUDA_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Prepared samples of a FitProblem (structure of arrays, 'count' values each).
+struct CudaScanSpectrum {
+    const double* omega2;
+    const double* inv_omega;
+    const double* eps1;
+    const double* eps2;
+    const double* weight;
+    size_t count;
+};
+
+// Scan grid given by its axis values (computed on the host, so the GPU evaluates exactly the
+// points of the CPU scan): point (k, i, j) is (eps_inf[k], omega_p[i], gamma[j]) with flat
+// index (k·omega_p_count + i)·gamma_count + j.
+struct CudaScanGrid {
+    const double* omega_p;
+    size_t omega_p_count;
+    const double* gamma;
+    size_t gamma_count;
+    const double* eps_inf;
+    size_t eps_inf_count;
+};
+
+// Evaluates the Drude error at every grid point on the current CUDA device. The smallest
+// error and its flat index (the lowest index among equal errors) go to best_error and
+// best_index; with surface non-null (one double per grid point) the whole surface is
+// copied back as well. Returns 0 on success, or a non-zero CUDA error code with a
+// description in error (error_size bytes, always terminated).
+int cudaScanErrorSurface(const CudaScanSpectrum& spectrum, const CudaScanGrid& grid, double* surface,
+                         double* best_error, uint64_t* best_index, char* error, size_t error_size);
+
+#endif
@@ -1,5 +1,6 @@
 param(
-    [string]$file
+    [string]$file,
+    [switch]$Headless    # build without matplotlibcpp/Python (no plots, results written to file)
 )
 
 $projectDir    = Split-Path -Path (Resolve-Path $file)
@@ -10,12 +11,19 @@ $pythonLib     = "C:\Users\ffmir\AppData\Local\Programs\Python\Python313\libs"
 $out = [System.IO.Path]::ChangeExtension($file, ".exe")
 
 Write-Host "Compiling $file ..."
-$compileOutput = g++ $file `
-    -I"$projectDir" `
-    -I"$pythonInclude" `
-    -I"$numpyInclude" `
-    -L"$pythonLib" `
-    -lpython313 -std=c++17 -o $out
+if ($Headless) {
+    $compileOutput = g++ $file `
+        -I"$projectDir" `
+        -DMETAL_DISPERSION_HEADLESS `
+        -std=c++17 -O2 -pthread -o $out
+} else {
+    $compileOutput = g++ $file `
+        -I"$projectDir" `
+        -I"$pythonInclude" `
+        -I"$numpyInclude" `
+        -L"$pythonLib" `
+        -lpython313 -std=c++17 -O2 -pthread -o $out
+}
 
 if ($LASTEXITCODE -ne 0) {
     Write-Host "Compilation failed. Check errors above." -ForegroundColor Red
@@ -24,4 +32,4 @@ if ($LASTEXITCODE -ne 0) {
 }
 
 Write-Host "Running $out ..."
-& $out
\ No newline at end of file
+& $out